@@ -36,6 +36,10 @@
 #include "render.hh"
 
 namespace drnsf {
+namespace nsf {
+class entry_index;
+class process_cache;
+}
 namespace edit {
 
 /*
@@ -50,12 +54,26 @@ private:
     // project currently open.
     std::shared_ptr<res::project> m_proj;
 
+    // (var) m_entry_index
+    // The index of the entries and texture pages in m_proj, or null if there
+    // is no project currently open.
+    std::unique_ptr<nsf::entry_index> m_entry_index;
+
+    // (var) m_process_cache
+    // The on-disk cache of decoded entries used when opening files, or null
+    // if no such cache was configured.
+    std::shared_ptr<nsf::process_cache> m_process_cache;
+
 public:
     // (explicit ctor)
     // Creates a context with the specified project open. The context takes a
     // copy of the shared pointer.
     explicit context(std::shared_ptr<res::project> proj);
 
+    // (dtor)
+    // Destroys the context, releasing its reference to the project.
+    ~context();
+
     // (func) get_proj, set_proj
     // Gets or sets the project associated with this context.
     //
@@ -70,6 +88,19 @@ public:
     const std::shared_ptr<res::project> &get_proj() const;
     void set_proj(std::shared_ptr<res::project> proj);
 
+    // (func) get_entry_index
+    // Returns the index of the entries and texture pages in the current
+    // project, or null if there is no project currently open. Lookups by EID
+    // within the editor should use this index rather than building their own.
+    nsf::entry_index *get_entry_index() const;
+
+    // (func) get_process_cache, set_process_cache
+    // Gets or sets the on-disk cache of decoded entries which is used when
+    // opening files under this context. This may be null, in which case the
+    // entries are decoded without a cache.
+    const std::shared_ptr<nsf::process_cache> &get_process_cache() const;
+    void set_process_cache(std::shared_ptr<nsf::process_cache> cache);
+
     // (event) on_project_change
     // Raised whenever the project is changed by `set_proj'. The previous
     // project, if any, will be kept alive during the execution of this event's
@@ -83,17 +114,23 @@ namespace menus {
  * edit::menus::mni_open
  *
  * File -> Open
- * Opens a file. (FIXME what kind?)
+ * File -> Open (Lazy)
+ * Opens an NSF file, or a project file saved by "Save Project As".
+ *
+ * The lazy variant leaves the NSF's pages and entries unprocessed until they
+ * are selected or otherwise used (see res::project::demand).
  */
 class mni_open : private gui::menu::item {
 private:
     context &m_ctx;
+    bool m_lazy;
     void on_activate() final override;
 
 public:
-    explicit mni_open(gui::menu &menu, context &ctx) :
-        item(menu, "Open"),
-        m_ctx(ctx) {}
+    explicit mni_open(gui::menu &menu, context &ctx, bool lazy = false) :
+        item(menu, lazy ? "Open (Lazy)" : "Open"),
+        m_ctx(ctx),
+        m_lazy(lazy) {}
 };
 
 /*
@@ -113,6 +150,24 @@ public:
         m_ctx(ctx) {}
 };
 
+/*
+ * edit::menus::mni_save_project
+ *
+ * File -> Save Project As
+ * Saves all of the assets in the currently open project as a project file (see
+ * res::project_file), which can be opened again without reimporting the NSF.
+ */
+class mni_save_project : private gui::menu::item {
+private:
+    context &m_ctx;
+    void on_activate() final override;
+
+public:
+    explicit mni_save_project(gui::menu &menu, context &ctx) :
+        item(menu, "Save Project As"),
+        m_ctx(ctx) {}
+};
+
 /*
  * edit::menus::mni_exit
  *
@@ -137,7 +192,9 @@ class mnu_file : private gui::menubar::item {
 private:
     context &m_ctx;
     mni_open m_open{*this, m_ctx};
+    mni_open m_open_lazy{*this, m_ctx, true};
     mni_save_as m_save_as{*this, m_ctx};
+    mni_save_project m_save_project{*this, m_ctx};
     mni_exit m_exit{*this};
 
 public:
@@ -214,6 +271,11 @@ public:
  */
 class asset_metactl : private gui::widget_im {
 private:
+    // (var) m_ctx
+    // The editor context, used to look up the assets which the selected asset
+    // refers to.
+    context &m_ctx;
+
     // (var) m_name
     // FIXME explain
     res::atom m_name;
@@ -234,7 +296,10 @@ public:
     // (explicit ctor)
     // Constructs the metactl widget in the given container with the given
     // layout. By default, it is not set to use any asset name.
-    explicit asset_metactl(gui::container &parent, gui::layout layout);
+    explicit asset_metactl(
+        gui::container &parent,
+        gui::layout layout,
+        context &ctx);
 
     // (func) set_name
     // FIXME explain
@@ -347,10 +412,17 @@ public:
  */
 class asset_mainctl : private gui::composite {
 private:
+    // (var) m_ctx
+    // The editor context.
+    context &m_ctx;
+
     // (var) m_metactl
     // An instance of the asset_metactl placed roughly in the top-left quarter
     // of the widget.
-    asset_metactl m_metactl{*this, gui::layout::grid(0, 3, 8, 0, 1, 2)};
+    asset_metactl m_metactl{
+        *this,
+        gui::layout::grid(0, 3, 8, 0, 1, 2),
+        m_ctx};
 
     // (var) m_viewctl
     // An instance of the asset_viewctl placed roughly in the top-right quarter
@@ -367,8 +439,12 @@ public:
     // Constructs the widget in the given container with the given layout. The
     // initial asset name is null, so the widget will merely show generic "no
     // asset selected" messages.
-    explicit asset_mainctl(gui::container &parent, gui::layout layout) :
-        composite(parent, layout)
+    explicit asset_mainctl(
+        gui::container &parent,
+        gui::layout layout,
+        context &ctx) :
+        composite(parent, layout),
+        m_ctx(ctx)
     {
         m_metactl.show();
         m_viewctl.show();
@@ -409,7 +485,7 @@ private:
 public:
     // (ctor)
     // Constructs the widget and places it in the given parent container.
-    asset_editor(gui::container &parent, gui::layout layout, res::project &proj);
+    asset_editor(gui::container &parent, gui::layout layout, context &ctx);
 
     // (dtor)
     // Destroys the widget, removing it from the parent container.
@@ -519,7 +595,7 @@ private:
     asset_editor m_assets_view{
         *this,
         gui::layout::grid(0, 2, 3, 0, 1, 1),
-        *m_ctx.get_proj()};
+        m_ctx};
     map_mainctl m_map_view{
         *this,
         gui::layout::grid(2, 1, 3, 0, 1, 1),
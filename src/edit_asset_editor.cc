@@ -55,12 +55,12 @@ public:
     // Initializes the editor, and constructs the necessary widgets.
     explicit impl(
         asset_editor &outer,
-        res::project &proj) :
+        context &ctx) :
         composite(outer, gui::layout::fill()),
         m_outer(outer),
-        m_proj(proj),
-        m_tree(*this, gui::layout::grid(0, 1, 3, 0, 1, 1), proj),
-        m_mainview(*this, gui::layout::grid(1, 2, 3, 0, 1, 1))
+        m_proj(*ctx.get_proj()),
+        m_tree(*this, gui::layout::grid(0, 1, 3, 0, 1, 1), m_proj),
+        m_mainview(*this, gui::layout::grid(1, 2, 3, 0, 1, 1), ctx)
     {
         h_tree_select <<= [this](res::atom atom) {
             g_selected_asset = atom;
@@ -74,10 +74,10 @@ public:
 };
 
 // declared in edit.hh
-asset_editor::asset_editor(gui::container &parent, gui::layout layout, res::project &proj) :
+asset_editor::asset_editor(gui::container &parent, gui::layout layout, context &ctx) :
     composite(parent, layout)
 {
-    M = new impl(*this, proj);
+    M = new impl(*this, ctx);
     M->show();
 }
 
@@ -34,12 +34,12 @@ namespace {
 // (s-func) do_options
 // FIXME explain
 template <typename T>
-void do_options(T *asset)
+void do_options(context &ctx, T *asset)
 {
     ImGui::Text("No options available.");
 }
 template <>
-void do_options<res::asset>(res::asset *asset)
+void do_options<res::asset>(context &ctx, res::asset *asset)
 {
     if (ImGui::Button("Delete asset")) {
         asset->get_proj().get_transact().run([&](TRANSACT) {
@@ -54,11 +54,33 @@ void do_options<res::asset>(res::asset *asset)
         return;
     }
 }
+template <>
+void do_options<nsf::wgeo_v2>(context &ctx, nsf::wgeo_v2 *asset)
+{
+    auto index = ctx.get_entry_index();
+    if (!index) {
+        ImGui::Text("No options available.");
+        return;
+    }
+
+    // List the texture pages which the entry refers to, as found by EID.
+    auto tpages = asset->get_tpages(*index);
+    for (auto &&i : util::range_of(tpages)) {
+        auto &&tpage = tpages[i];
+        ImGui::Text(
+            "Texture page %d: %s",
+            int(i),
+            tpage ? tpage.full_path().c_str() : "(not found)"
+        );
+    }
+}
 
 // (internal type) asset_handler
 // FIXME explain
 template <typename AssetType>
 struct asset_handler {
+    context &ctx;
+
     void operator ()(AssetType *asset)
     {
         using type_info = reflect::asset_type_info<AssetType>;
@@ -70,17 +92,19 @@ struct asset_handler {
             title.c_str(), ImGuiTreeNodeFlags_DefaultOpen
         )) {
             ImGui::Indent();
-            do_options<AssetType>(asset);
+            do_options<AssetType>(ctx, asset);
             ImGui::Unindent();
         }
 
-        asset_handler<typename type_info::base_type>{}(
+        asset_handler<typename type_info::base_type>{ctx}(
             static_cast<typename type_info::base_type *>(asset)
         );
     }
 };
 template <>
 struct asset_handler<void> {
+    context &ctx;
+
     void operator ()(void *) {}
 };
 
@@ -105,10 +129,10 @@ void asset_metactl::frame()
         return;
     }
 
-    auto handler = [](auto asset) {
+    auto handler = [this](auto asset) {
         asset_handler<
             std::remove_pointer_t<decltype(asset)>
-        >{}(asset);
+        >{m_ctx}(asset);
     };
 
     util::dynamic_call<
@@ -122,6 +146,8 @@ void asset_metactl::frame()
         misc::raw_data,
         nsf::archive,
         nsf::spage,
+        nsf::tpage,
+        nsf::nsd,
         nsf::raw_entry,
         nsf::wgeo_v2,
         nsf::entry,
@@ -129,8 +155,12 @@ void asset_metactl::frame()
 }
 
 // declared in edit.hh
-asset_metactl::asset_metactl(gui::container &parent, gui::layout layout):
-    widget_im(parent, layout)
+asset_metactl::asset_metactl(
+    gui::container &parent,
+    gui::layout layout,
+    context &ctx) :
+    widget_im(parent, layout),
+    m_ctx(ctx)
 {
     h_asset_appear <<= [this](res::asset &asset) {
         if (asset.get_name() == m_name) {
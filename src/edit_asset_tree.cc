@@ -91,17 +91,7 @@ public:
         m_tree(*this, gui::layout::fill())
     {
         h_asset_appear <<= [this](res::asset &asset) {
-            auto name = asset.get_name();
-            auto &atom_node_wp = m_atom_nodes[name];
-            auto &atom_node_sp = m_asset_nodes[&asset];
-            atom_node_sp = atom_node_wp.lock();
-            if (!atom_node_sp) {
-                atom_node_sp = std::make_shared<node>(
-                    *this,
-                    name
-                );
-                atom_node_wp = atom_node_sp;
-            }
+            add_asset(asset);
         };
         h_asset_appear.bind(m_proj.on_asset_appear);
 
@@ -110,8 +100,36 @@ public:
         };
         h_asset_disappear.bind(m_proj.on_asset_disappear);
 
+        // Add the assets which already exist in the project.
+        auto &&root = m_proj.get_asset_root();
+        root.for_each_descendant([this](const res::atom &name) {
+            auto asset = name.get();
+            if (asset) {
+                add_asset(*asset);
+            }
+            return true;
+        });
+
         m_tree.show();
     }
+
+    // (func) add_asset
+    // Adds a node for the given asset to the tree, along with any parent
+    // nodes which do not yet exist.
+    void add_asset(res::asset &asset)
+    {
+        auto name = asset.get_name();
+        auto &atom_node_wp = m_atom_nodes[name];
+        auto &atom_node_sp = m_asset_nodes[&asset];
+        atom_node_sp = atom_node_wp.lock();
+        if (!atom_node_sp) {
+            atom_node_sp = std::make_shared<node>(
+                *this,
+                name
+            );
+            atom_node_wp = atom_node_sp;
+        }
+    }
 };
 
 // (inner class) node
@@ -168,8 +186,14 @@ public:
 
         h_select <<= [this, atom, &view]{
             view.m_selected_asset = atom;
-            view.m_outer.on_select(atom);
             view.m_selected_node = view.m_atom_nodes[atom].lock();
+
+            // If the selected asset is an unprocessed stub, process it now.
+            // The node is kept alive by m_selected_node while the asset on
+            // its name is replaced.
+            view.m_proj.demand(atom);
+
+            view.m_outer.on_select(atom);
         };
         h_select.bind(m_treenode->on_select);
 
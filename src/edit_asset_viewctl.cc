@@ -210,6 +210,8 @@ asset_viewctl::asset_viewctl(gui::container &parent, gui::layout layout) :
                 misc::raw_data,
                 nsf::archive,
                 nsf::spage,
+                nsf::tpage,
+                nsf::nsd,
                 nsf::raw_entry,
                 nsf::wgeo_v2,
                 nsf::entry,
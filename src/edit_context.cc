@@ -20,6 +20,7 @@
 
 #include "common.hh"
 #include "edit.hh"
+#include "nsf.hh"
 
 namespace drnsf {
 namespace edit {
@@ -27,6 +28,14 @@ namespace edit {
 // declared in edit.hh
 context::context(std::shared_ptr<res::project> proj) :
     m_proj(std::move(proj))
+{
+    if (m_proj) {
+        m_entry_index = std::make_unique<nsf::entry_index>(*m_proj);
+    }
+}
+
+// declared in edit.hh
+context::~context()
 {
 }
 
@@ -40,10 +49,34 @@ const std::shared_ptr<res::project> &context::get_proj() const
 void context::set_proj(std::shared_ptr<res::project> proj)
 {
     if (m_proj != proj) {
+        // The index of the previous project is dropped before that project
+        // may be released below.
+        m_entry_index = nullptr;
+        if (proj) {
+            m_entry_index = std::make_unique<nsf::entry_index>(*proj);
+        }
         std::swap(m_proj, proj);
         on_project_change(m_proj);
     }
 }
 
+// declared in edit.hh
+nsf::entry_index *context::get_entry_index() const
+{
+    return m_entry_index.get();
+}
+
+// declared in edit.hh
+const std::shared_ptr<nsf::process_cache> &context::get_process_cache() const
+{
+    return m_process_cache;
+}
+
+// declared in edit.hh
+void context::set_process_cache(std::shared_ptr<nsf::process_cache> cache)
+{
+    m_process_cache = std::move(cache);
+}
+
 }
 }
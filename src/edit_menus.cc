@@ -21,6 +21,8 @@
 #include "common.hh"
 #include "edit.hh"
 #include <fstream>
+#include <random>
+#include "fs.hh"
 #include "nsf.hh"
 #include "misc.hh"
 
@@ -33,6 +35,61 @@ namespace drnsf {
 namespace edit {
 namespace menus {
 
+namespace {
+
+// (internal typedef) project_file
+// The project file format used by "Open" and "Save Project As", covering each
+// asset type which a project can hold (see res::project_file).
+using project_file = res::project_file<
+    gfx::frame,
+    gfx::anim,
+    gfx::mesh,
+    gfx::model,
+    gfx::world,
+    misc::raw_data,
+    nsf::archive,
+    nsf::spage,
+    nsf::tpage,
+    nsf::nsd,
+    nsf::raw_entry,
+    nsf::wgeo_v2>;
+
+// (s-func) write_file
+// Calls `write' to write the contents of the file at the given path. The data
+// is written to a temporary file which then replaces the target, because the
+// target may be a file which is still memory-mapped by the project (see
+// util::map_file and util::replace_file). The temporary file is given a random
+// name next to the target which is not already in use, so that no other file
+// is overwritten. If `write' fails, no partially-written file is left behind.
+void write_file(
+    const std::string &path,
+    const std::function<void(std::fstream &)> &write)
+{
+    std::random_device rng;
+    std::string tmp_path;
+    do {
+        tmp_path = "$.$.tmp"_fmt(path, rng());
+    } while (fs::exists(fs::u8path(tmp_path)));
+
+    bool finished = false;
+    DRNSF_ON_EXIT {
+        if (!finished) {
+            std::error_code ec;
+            fs::remove(fs::u8path(tmp_path), ec);
+        }
+    };
+
+    {
+        auto file = util::fstream_open_bin(tmp_path, std::fstream::out);
+        file.exceptions(std::fstream::failbit);
+        write(file);
+    }
+    util::replace_file(tmp_path, path);
+    finished = true;
+}
+
+}
+
 // declared in edit.hh
 void mni_open::on_activate()
 {
@@ -44,56 +101,52 @@ void mni_open::on_activate()
     auto proj_p = m_ctx.get_proj(); //FIXME
     auto &proj = *proj_p;
 
-    proj.get_transact().run([&](TRANSACT) {
-        TS.describe("Import NSF");
+    // Map the file into memory. The file's data is only read from the disk as
+    // it is accessed.
+    auto file_data = util::map_file(path);
 
-        // Open the NSF file and read the data into memory.
-        auto nsf_file = util::fstream_open_bin(path, std::fstream::in);
-        nsf_file.exceptions(std::fstream::failbit | std::fstream::eofbit);
+    // Project files are loaded as-is, without any further processing.
+    if (res::project_reader::is_project_file(file_data)) {
+        proj.get_transact().run([&](TRANSACT) {
+            TS.describe("Open Project");
+            project_file::load(TS, proj, std::move(file_data));
+        });
+        return;
+    }
 
-        nsf_file.seekg(0, std::fstream::end);
-        auto nsf_size = nsf_file.tellg();
-        nsf_file.seekg(0, std::fstream::beg);
+    // Decoded entries are kept in the context's process cache, if one was
+    // configured, so that opening the same file again does not need to decode
+    // them again. The cache is shared with the demand handler, which may
+    // outlive this function. If there is no cache, the entries are decoded
+    // without one.
+    auto cache = m_ctx.get_process_cache();
 
-        util::blob nsf_data(nsf_size);
-        nsf_file.read(
-            reinterpret_cast<char *>(nsf_data.data()),
-            nsf_size
-        );
-        nsf_file.close();
+    proj.get_transact().run([&](TRANSACT) {
+        TS.describe("Import NSF");
 
         // Import the data into an NSF asset.
         nsf::archive::ref nsf_asset = proj.get_asset_root() / "nsfile";
         nsf_asset.create(TS, proj);
-        nsf_asset->import_file(TS, std::move(nsf_data));
-
-        // Process all of the pages in the new NSF asset.
-        for (misc::raw_data::ref page : nsf_asset->get_pages()) {
-
-            // Pages with type 1 cannot be processed as normal pages.
-            if (page->get_data()[2] == 1)
-                continue;
-
-            nsf::spage::ref spage = page;
-            page->rename(TS, page / "_PROCESSING");
-            page /= "_PROCESSING";
-            spage.create(TS, proj);
-            spage->import_file(TS, page->get_data());
-            page->destroy(TS);
-
-            // Process all of the entries inside each standard page.
-            for (misc::raw_data::ref pagelet : spage->get_pagelets()) {
-                nsf::raw_entry::ref entry = pagelet;
-                pagelet->rename(TS, pagelet / "_PROCESSING");
-                pagelet /= "_PROCESSING";
-                entry.create(TS, proj);
-                entry->import_file(TS, pagelet->get_data());
-                pagelet->destroy(TS);
-                entry->process_by_type(TS, nsf::game_ver::crash2);
-            }
+        nsf_asset->import_file(TS, std::move(file_data));
+
+        // Process all of the pages in the new NSF asset, unless this is a
+        // lazy import, in which case they are processed on demand.
+        if (!m_lazy) {
+            nsf_asset->process_all(TS, nsf::game_ver::crash2, cache.get());
         }
     });
 
+    if (m_lazy) {
+        proj.set_demand_handler([cache](TRANSACT, res::asset &asset) {
+            return nsf::archive::process_on_demand(
+                TS,
+                asset,
+                nsf::game_ver::crash2,
+                cache.get()
+            );
+        });
+    }
+
     // Point the context to the newly opened project.
     // TODO
 }
@@ -121,23 +174,50 @@ void mni_save_as::on_activate()
 
     // TODO - make the remaining code asynchronous to not block the UI
 
-    // Deserialize all of the assets referenced (directly or indirectly) into
-    // one large blob of NSF file data.
-    util::blob nsf_data;
+    // Export the NSF into the file specified by the user, writing each page
+    // out as soon as it has been exported. The target may be the file the
+    // project was opened from, which is still memory-mapped by any unmodified
+    // pages (see write_file). The export cache is used so that saving again
+    // does not export the recently saved pages which have not changed since.
     /*try*/ {
-        nsf_data = nsf_asset->export_file();
+        write_file(path, [&](std::fstream &nsf_file) {
+            auto sink = [&](const util::byte *data, size_t size) {
+                nsf_file.write(reinterpret_cast<const char *>(data), size);
+            };
+            nsf_asset->export_file(sink, true);
+        });
     } /*catch (?) {
         TODO - handle errors
     }*/
+}
+
+// declared in edit.hh
+void mni_save_project::on_activate()
+{
+    // Verify that there is an open project.
+    auto proj = m_ctx.get_proj();
+    if (!proj) {
+        // TODO - error message box?
+        return;
+    }
+
+    // Get the file to save to from the user.
+    std::string path;
+    if (!gui::show_save_dialog(path)) return;
+
+    // TODO - make the remaining code asynchronous to not block the UI
 
-    // Write the NSF data into the file specified by the user.
+    // Save the project into the file specified by the user. The target may be
+    // a project file which the project was opened from, and whose data is still
+    // used by the project's assets (see write_file).
     /*try*/ {
-        auto nsf_file = util::fstream_open_bin(path, std::fstream::out);
-        nsf_file.exceptions(std::fstream::failbit);
-        nsf_file.write(
-            reinterpret_cast<char *>(nsf_data.data()),
-            nsf_data.size()
-        );
+        auto data = project_file::save(*proj);
+        write_file(path, [&](std::fstream &file) {
+            file.write(
+                reinterpret_cast<const char *>(data.data()),
+                data.size()
+            );
+        });
     } /*catch (?) {
         TODO - handle errors
     }*/
@@ -161,6 +161,34 @@ public:
         return changed;
     }
 
+    bool field(util::slice &value, std::string label)
+    {
+        // Slices are immutable, so the bytes are edited through a copy which
+        // replaces the slice only if a change was made.
+        auto data = value.to_blob();
+        bool changed = field(data, label);
+        if (changed) {
+            value = std::move(data);
+        }
+        return changed;
+    }
+
+    bool field(util::packed_slice &value, std::string label)
+    {
+        // Packed slices are edited as plain slices, and then packed again if
+        // they were packed before.
+        auto data = value.unpack();
+        bool changed = field(data, label);
+        if (changed) {
+            if (value.is_packed()) {
+                value = util::packed_slice::pack(data);
+            } else {
+                value = std::move(data);
+            }
+        }
+        return changed;
+    }
+
     template <typename T>
     void field(res::prop<T> &prop, std::string label)
     {
@@ -232,6 +260,8 @@ void asset_pane::show()
         misc::raw_data,
         nsf::archive,
         nsf::spage,
+        nsf::tpage,
+        nsf::nsd,
         nsf::raw_entry,
         nsf::wgeo_v2,
         nsf::entry> (*this, *g_selected_asset.get());
@@ -343,6 +343,17 @@ public:
     DEFINE_APROP(x, double, 0.0);
     DEFINE_APROP(y, double, 0.0);
     DEFINE_APROP(z, double, 0.0);
+
+    // FIXME obsolete
+    template <typename Reflector>
+    void reflect(Reflector &rfl)
+    {
+        asset::reflect(rfl);
+        rfl.field(p_model, "Model");
+        rfl.field(p_x, "X");
+        rfl.field(p_y, "Y");
+        rfl.field(p_z, "Z");
+    }
 };
 
 }
@@ -19,9 +19,11 @@
 //
 
 #include "common.hh"
+#include <cctype>
 #include <iostream>
 #include <fstream>
 #include <deque>
+#include <thread>
 #include "edit.hh"
 #include "gui.hh"
 #include "gl.hh"
@@ -33,6 +35,20 @@ namespace {
 
 using argv_t = std::deque<std::string>;
 
+// (s-var) s_pack_threshold
+// The pack threshold given by the `--pack-threshold' option, which is applied
+// to the projects created by the subcommands below (see
+// res::project::set_pack_threshold).
+static size_t s_pack_threshold = 0;
+
+// (s-var) s_use_process_cache, s_process_cache_dir
+// Whether the `--process-cache' option was given, and the directory it named,
+// if any. When enabled, the GUI keeps decoded entries in this directory (or
+// in nsf::process_cache::default_dir if no directory was given) so that files
+// which are opened again do not need to be decoded again.
+static bool s_use_process_cache = false;
+static std::string s_process_cache_dir;
+
 static int cmd_help(argv_t argv)
 {
     std::cout << R"(Usage:
@@ -44,7 +60,20 @@ static int cmd_help(argv_t argv)
     drnsf { -v | --version | :version }
 
 # Normal usage:
-    drnsf [ :subcommand ] [ subcommand options and arguments ]
+    drnsf [ options ] [ :subcommand ] [ subcommand options and arguments ]
+
+
+Options:
+
+  --pack-threshold=BYTES
+                      Hold asset data of at least this size compressed in
+                      memory, trading speed for memory (0, the default,
+                      disables this)
+
+  --process-cache[=DIR]
+                      Keep decoded entries in DIR (or in the user's cache
+                      directory if DIR is not given), so that opening the same
+                      files again is faster (disabled by default)
 
 
 Available subcommands:
@@ -54,6 +83,9 @@ Available subcommands:
   version             Display version and license information
   internal-test       Runs internal unit tests
   resave-test-crash2  Runs resave consistency tests against C2 NSF files
+  check-checksums     Checks the page checksums of the given NSF files
+  import-stats        Imports the given NSF files and shows how much of their
+                      data is shared
 
 The default subcommand is `gui', which will be used if no subcommand was
 specified.
@@ -104,9 +136,32 @@ static int cmd_gui(argv_t argv)
 
     // Create the editor.
     auto proj = std::make_shared<res::project>();
+    proj->set_pack_threshold(s_pack_threshold);
     edit::context ctx(proj);
     edit::core edcore(*proj);
 
+    // Set up the process cache, if enabled. Old files are removed once per
+    // session on a separate thread, so that the editor does not wait on the
+    // disk while starting up or opening files. The cache may be used while
+    // this is running.
+    std::thread trim_thread;
+    DRNSF_ON_EXIT {
+        if (trim_thread.joinable()) {
+            trim_thread.join();
+        }
+    };
+    if (s_use_process_cache) {
+        auto dir = s_process_cache_dir;
+        if (dir.empty()) {
+            dir = nsf::process_cache::default_dir();
+        }
+        auto cache = std::make_shared<nsf::process_cache>(dir);
+        ctx.set_process_cache(cache);
+        trim_thread = std::thread([cache] {
+            cache->trim();
+        });
+    }
+
     edit::main_window wnd(ctx);
     wnd.show();
 
@@ -191,7 +246,7 @@ static bool do_pagelet(TRANSACT, std::string filename, misc::raw_data::ref src)
 {
     bool ok = true;
 
-    util::blob in_data = src->get_data();
+    util::slice in_data = src->get_data();
 
     nsf::raw_entry::ref raw_entry = src;
     src->rename(TS, src / "_PROCESSING");
@@ -222,11 +277,29 @@ static bool do_page(TRANSACT, std::string filename, misc::raw_data::ref src)
 {
     bool ok = true;
 
-    util::blob in_data = src->get_data();
+    util::slice in_data = src->get_data();
 
     if (src->get_data()[2] == 1) {
         // This is a texture page if the type is 1.
-        // TODO
+        nsf::tpage::ref tpage = src;
+        src->rename(TS, src / "_PROCESSING");
+        src /= "_PROCESSING";
+        tpage.create(TS, src->get_proj());
+        tpage->import_file(TS, src->get_data());
+        src->destroy(TS);
+
+        util::slice out_data = tpage->export_file();
+
+        if (in_data != out_data) {
+            ok = false;
+            std::cerr
+                << filename
+                << ": \033[43;30m  tpage  \033[0m "
+                << "resave data mismatch on `"
+                << tpage.full_path()
+                << "'."
+                << std::endl;
+        }
     } else {
         // For all other types, this is a standard page.
         nsf::spage::ref spage = src;
@@ -261,7 +334,7 @@ static bool do_nsf(TRANSACT, std::string filename, misc::raw_data::ref src)
 {
     bool ok = true;
 
-    util::blob in_data = src->get_data();
+    util::slice in_data = src->get_data();
 
     nsf::archive::ref archive = src;
     src->rename(TS, src / "_PROCESSING");
@@ -298,21 +371,10 @@ static int cmd_resave_test_crash2(argv_t argv)
 
     for (auto &arg : argv) {
         try {
-            auto nsf_file = util::fstream_open_bin(arg, std::fstream::in);
-            nsf_file.exceptions(std::fstream::failbit | std::fstream::eofbit);
-
-            nsf_file.seekg(0, std::fstream::end);
-            auto nsf_size = nsf_file.tellg();
-            nsf_file.seekg(0, std::fstream::beg);
-
-            util::blob nsf_data(nsf_size);
-            nsf_file.read(
-                reinterpret_cast<char *>(nsf_data.data()),
-                nsf_size
-            );
-            nsf_file.close();
+            auto nsf_data = util::map_file(arg);
 
             res::project proj;
+            proj.set_pack_threshold(s_pack_threshold);
             proj.get_transact().run([&](TRANSACT) {
                 misc::raw_data::ref nsfile = proj.get_asset_root() / "nsfile";
                 nsfile.create(TS, proj);
@@ -332,12 +394,98 @@ static int cmd_resave_test_crash2(argv_t argv)
     return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+static int cmd_check_checksums(argv_t argv)
+{
+    bool ok = true;
+
+    for (auto &arg : argv) {
+        try {
+            auto nsf_data = util::map_file(arg);
+
+            for (auto &&page : nsf::archive::find_bad_checksums(nsf_data)) {
+                std::cerr
+                    << arg
+                    << ": bad checksum on page "
+                    << page
+                    << "."
+                    << std::endl;
+                ok = false;
+            }
+        } catch (std::exception &ex) {
+            std::cerr
+                << arg
+                << ": "
+                << ex.what()
+                << std::endl;
+            ok = false;
+        }
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int cmd_import_stats(argv_t argv)
+{
+    bool ok = true;
+
+    // Import every file into the same project, so that data shared between
+    // the files is counted as well.
+    res::project proj;
+    proj.set_pack_threshold(s_pack_threshold);
+    for (auto &&i : util::range_of(argv)) {
+        auto &&arg = argv[i];
+        try {
+            auto nsf_data = util::map_file(arg);
+
+            proj.get_transact().run([&](TRANSACT) {
+                nsf::archive::ref nsfile =
+                    proj.get_asset_root().indexed("nsfile-", i);
+                nsfile.create(TS, proj);
+                nsfile->import_file(TS, nsf_data);
+                nsfile->process_all(TS, nsf::game_ver::crash2);
+            });
+        } catch (std::exception &ex) {
+            std::cerr
+                << arg
+                << ": "
+                << ex.what()
+                << std::endl;
+            ok = false;
+        }
+    }
+
+    // Replaced duplicates only free memory once nothing else holds the buffer
+    // they came from, so the replaced size is an upper bound on the saving.
+    auto &&stats = proj.get_blob_store().get_stats();
+    std::cout
+        << "Data stored:         "
+        << stats.intern_count
+        << " pieces, "
+        << stats.intern_bytes
+        << " bytes\n"
+        << "Duplicates replaced: "
+        << stats.replaced_count
+        << " pieces, "
+        << stats.replaced_bytes
+        << " bytes\n"
+        << "Unique data held:    "
+        << stats.unique_count
+        << " pieces, "
+        << stats.unique_bytes
+        << " bytes"
+        << std::endl;
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 const static std::map<std::string, int (*)(argv_t)> s_cmds = {
     { "help", cmd_help },
     { "version", cmd_version },
     { "gui", cmd_gui },
     { "internal-test", cmd_internal_test },
-    { "resave-test-crash2", cmd_resave_test_crash2 }
+    { "resave-test-crash2", cmd_resave_test_crash2 },
+    { "check-checksums", cmd_check_checksums },
+    { "import-stats", cmd_import_stats }
 };
 
 int main(argv_t argv)
@@ -397,6 +545,51 @@ int main(argv_t argv)
             continue;
         }
 
+        if (argv[0].compare(0, 17, "--pack-threshold=") == 0) {
+            auto value = argv[0].substr(17);
+            size_t end = 0;
+            try {
+                // The value must start with a digit, as std::stoull would
+                // otherwise skip whitespace and accept a sign.
+                if (!value.empty() &&
+                    std::isdigit(static_cast<unsigned char>(value[0]))) {
+                    s_pack_threshold = std::stoull(value, &end);
+                }
+            } catch (std::logic_error &) {
+                end = 0;
+            }
+            if (end == 0 || end != value.size()) {
+                ok = false;
+                std::cerr
+                    << "drnsf: Bad value for --pack-threshold: `"
+                    << value
+                    << "'."
+                    << std::endl;
+            }
+            argv.pop_front();
+            continue;
+        }
+
+        if (argv[0] == "--process-cache") {
+            s_use_process_cache = true;
+            s_process_cache_dir.clear();
+            argv.pop_front();
+            continue;
+        }
+
+        if (argv[0].compare(0, 16, "--process-cache=") == 0) {
+            s_use_process_cache = true;
+            s_process_cache_dir = argv[0].substr(16);
+            if (s_process_cache_dir.empty()) {
+                ok = false;
+                std::cerr
+                    << "drnsf: Bad value for --process-cache: `'."
+                    << std::endl;
+            }
+            argv.pop_front();
+            continue;
+        }
+
         if (argv[0] == "--help") {
             cmd = cmd_help;
             argv.pop_front();
@@ -59,21 +59,68 @@ private:
     explicit raw_data(res::project &proj) :
         asset(proj) {}
 
+    // (func) should_pack
+    // Returns true if data of the given size is held compressed, according to
+    // the project's pack threshold.
+    bool should_pack(size_t size) const
+    {
+        auto threshold = get_proj().get_pack_threshold();
+        return threshold && size >= threshold;
+    }
+
 public:
     // (typedef) ref
     // FIXME explain
     using ref = res::ref<raw_data>;
 
-    // (prop) data
-    // FIXME explain
-    DEFINE_APROP(data, util::blob);
+    // (prop) packed_data
+    // The bytes held by this asset, which may be compressed. Use `get_data' and
+    // `set_data' to access the bytes themselves.
+    DEFINE_APROP(packed_data, util::packed_slice);
+
+    // (func) get_data
+    // Returns the bytes held by this asset. These may be shared with other
+    // assets or refer into a memory-mapped file (see util::slice).
+    util::slice get_data() const
+    {
+        return get_packed_data().unpack();
+    }
+
+    // (func) set_data
+    // Sets the bytes held by this asset. If they are at least as large as the
+    // project's pack threshold (see res::project::set_pack_threshold), they
+    // are held compressed.
+    void set_data(TRANSACT, util::slice data)
+    {
+        if (should_pack(data.size())) {
+            set_packed_data(TS, util::packed_slice::pack(data));
+        } else {
+            set_packed_data(TS, std::move(data));
+        }
+    }
+
+    // (func) set_shared_data
+    // Sets the bytes held by this asset, as `set_data' does. Bytes which are
+    // not held compressed are first passed through the project's blob store
+    // (see res::project::get_blob_store), so that identical data held by other
+    // assets is shared. Bytes which are held compressed skip the store, as
+    // nothing would keep the uncompressed bytes alive to be shared.
+    void set_shared_data(TRANSACT, util::slice data)
+    {
+        if (should_pack(data.size())) {
+            set_packed_data(TS, util::packed_slice::pack(data));
+        } else {
+            auto &&store = get_proj().get_blob_store();
+            set_packed_data(TS, store.intern(std::move(data)));
+        }
+    }
 
     // FIXME obsolete
     template <typename Reflector>
     void reflect(Reflector &rfl)
     {
         asset::reflect(rfl);
-        rfl.field(p_data, "Data");
+        rfl.field(p_packed_data, "Data");
     }
 };
 
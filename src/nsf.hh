@@ -27,8 +27,15 @@
  */
 
 #include <vector>
+#include <array>
+#include <chrono>
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
 #include "res.hh"
 #include "gfx.hh"
+#include "misc.hh"
 
 namespace drnsf {
 namespace nsf {
@@ -94,6 +101,9 @@ public:
     }
 };
 
+// Forward declaration for use in nsf::spage.
+class raw_entry;
+
 /*
  * nsf::page_size
  *
@@ -101,6 +111,126 @@ public:
  */
 constexpr size_t page_size = 65536;
 
+/*
+ * nsf::process_cache
+ *
+ * An on-disk cache of decoded entry data, kept in a directory of the caller's
+ * choosing (normally default_dir). Processing an entry (see
+ * raw_entry::prepare_by_type) first looks up the entry's items here, and only
+ * decodes them if no result was stored by a previous run, in which case the new
+ * result is stored for next time.
+ *
+ * Each result is stored in its own file, named by a hash of the entry's type,
+ * its items and the format version (see make_key). Files are written under a
+ * temporary name and then renamed into place, so that separate processes or
+ * threads sharing the directory never see a partially written file.
+ *
+ * The cache is strictly an optimization. Any failure to read or write the
+ * directory is ignored, and a missing, outdated or damaged file is treated the
+ * same as a cache miss. The stored data is in the machine's native format, so
+ * the directory must not be shared between different machines.
+ *
+ * The directory does not limit its own size. The caller should use `trim'
+ * from time to time to remove files which have not been used recently.
+ *
+ * All of the member functions are safe to call from multiple threads at once.
+ */
+class process_cache : private util::nocopy {
+private:
+    // (var) m_dir
+    // The path of the cache directory.
+    std::string m_dir;
+
+    // (var) m_ok
+    // True if the cache directory exists, or false if it could not be created,
+    // in which case the cache is disabled.
+    bool m_ok;
+
+public:
+    // (s-var) format_version
+    // The version of the cache files. This must be increased whenever the
+    // format of the data stored for any entry type changes (for example, see
+    // wgeo_v2::save_parsed), so that files written by older versions are no
+    // longer used.
+    static constexpr uint32_t format_version = 2;
+
+    // (inner struct) key
+    // Identifies the decoded data for one entry (see make_key). The file is
+    // named after `hash'. The other fields are also written into the file and
+    // checked by `load', so that two entries whose hashes collide are not
+    // given each other's data.
+    struct key {
+        // (var) hash
+        // A 64-bit hash of the entry's game version, type and items.
+        uint64_t hash;
+
+        // (var) check
+        // A second 64-bit hash of the same, calculated independently of
+        // `hash'.
+        uint64_t check;
+
+        // (var) item_sizes
+        // The size of each of the entry's items.
+        std::vector<uint32_t> item_sizes;
+    };
+
+    // (s-var) default_max_size
+    // The default size limit for `trim', in bytes.
+    static constexpr uintmax_t default_max_size = uintmax_t(1) << 30;
+
+    // (s-var) default_max_age
+    // The default age limit for `trim'.
+    static constexpr std::chrono::hours default_max_age{24 * 30};
+
+    // (s-func) default_dir
+    // Returns the path of the current user's cache directory for DRNSF, or an
+    // empty string if there is none. This is under %LOCALAPPDATA% on Windows,
+    // and under $XDG_CACHE_HOME (or ~/.cache) elsewhere.
+    static std::string default_dir();
+
+    // (explicit ctor)
+    // Constructs a cache over the given directory, creating it if it does not
+    // exist. A newly created directory is made private to the current user.
+    // If the path is empty, the cache is disabled.
+    explicit process_cache(std::string dir);
+
+    // (func) is_ok
+    // Returns false if the cache directory could not be created.
+    bool is_ok() const
+    {
+        return m_ok;
+    }
+
+    // (s-func) make_key
+    // Returns the key under which the decoded data for an entry with the given
+    // game version, type and items is stored.
+    static key make_key(
+        game_ver ver,
+        uint32_t type,
+        const std::vector<util::slice> &items);
+
+    // (func) load
+    // Returns the data stored under the given key, or an empty slice if there
+    // is none. The returned data is mapped from the cache file rather than
+    // read into memory (see util::map_file). A file stored under a key with
+    // the same hash but a different check hash or item sizes is ignored.
+    util::slice load(const key &k) const;
+
+    // (func) store
+    // Stores the given data under the given key, replacing any data which was
+    // already stored under the same hash.
+    void store(const key &k, const util::slice &data) const;
+
+    // (func) trim
+    // Removes the files which were last used longer ago than `max_age', and
+    // then the least recently used files until the rest total no more than
+    // `max_size' bytes. Temporary files left behind by unfinished calls to
+    // `store' are also removed.
+    void trim(
+        uintmax_t max_size = default_max_size,
+        std::chrono::hours max_age = default_max_age) const;
+};
+
 /*
  * nsf::archive
  *
@@ -125,13 +255,82 @@ public:
     DEFINE_APROP(pages, std::vector<res::anyref>);
 
     // (func) import_file
-    // FIXME explain
-    void import_file(TRANSACT, const util::blob &data);
+    // Splits the given NSF file data into 64K pages, each held in a new
+    // misc::raw_data asset. The pages refer to the same storage as `data'
+    // rather than copying it, so a memory-mapped file (see util::map_file)
+    // is only read from the disk as its pages are accessed.
+    void import_file(TRANSACT, util::slice data);
+
+    // (typedef) sink
+    // A function which receives the exported file data, one piece at a time
+    // and in order (see export_file). The data given is only valid for the
+    // duration of the call.
+    using sink = std::function<void(const util::byte *data, std::size_t size)>;
 
     // (func) export_file
-    // FIXME explain
+    // Exports the archive as NSF file data, passing each 64K page to `out' as
+    // soon as it has been exported. This should be preferred over the blob-
+    // returning variant for writing to a file, as the file data is never held
+    // all at once. Raw pages are passed on from their existing data, and
+    // standard pages are exported one at a time into a single reused buffer.
+    //
+    // If `use_cache' is true, standard pages are exported through
+    // spage::export_cached instead, so that pages which are unchanged since an
+    // earlier export are passed on from that export's data. This holds more
+    // memory in exchange for faster repeated exports.
+    void export_file(const sink &out, bool use_cache = false) const;
+
+    // (func) export_file
+    // Exports the archive as NSF file data into a single blob.
     util::blob export_file() const;
 
+    // (s-func) find_bad_checksums
+    // Checks the checksum of every standard page in the given NSF file data
+    // (see spage::calc_checksum), and returns the indices of the pages whose
+    // checksum is wrong, in order. Texture pages are not checked. The pages are
+    // checked in parallel across all available cores.
+    //
+    // Throws res::import_error if the data is not a multiple of 64K in size.
+    static std::vector<std::size_t> find_bad_checksums(const util::slice &data);
+
+    // (func) process_all
+    // Processes every page of the archive into a standard page or texture
+    // page, and every pagelet of the standard pages into an entry (see
+    // spage::process_all). Pages which were already processed are not
+    // imported again, but any of their pagelets which are still raw are.
+    //
+    // The page and entry data is parsed in parallel across all available
+    // cores (see spage::parse, raw_entry::prepare_by_type), after which the
+    // resulting assets are created one page at a time in the transaction.
+    //
+    // If `cache' is given, it is used to skip decoding any entries which were
+    // decoded before (see nsf::process_cache).
+    void process_all(
+        TRANSACT,
+        game_ver ver,
+        const process_cache *cache = nullptr);
+
+    // (s-func) process_page
+    // Replaces the given raw page with an nsf::tpage if it is a texture page,
+    // or otherwise an nsf::spage, imported from its data under the same name.
+    // The pagelets of a new standard page are not processed.
+    static void process_page(TRANSACT, misc::raw_data::ref page);
+
+    // (s-func) process_on_demand
+    // Processes the given asset if it is an unprocessed page of an archive or
+    // an unprocessed pagelet of a standard page, and returns true. Otherwise,
+    // returns false without making any changes.
+    //
+    // This is intended for use as a project's demand handler (see
+    // res::project::set_demand_handler), so that an archive's pages and
+    // entries are only processed as they are used, rather than all at once by
+    // `process_all'.
+    static bool process_on_demand(
+        TRANSACT,
+        res::asset &asset,
+        game_ver ver,
+        const process_cache *cache = nullptr);
+
     // FIXME obsolete
     template <typename Reflector>
     void reflect(Reflector &rfl)
@@ -150,10 +349,21 @@ class spage : public res::asset {
     friend class res::asset;
 
 private:
+    // (var) m_export_cache
+    // The data from the most recent export by `export_cached', if it is still
+    // held by the export cache or elsewhere.
+    mutable std::weak_ptr<const util::blob> m_export_cache;
+
+    // (var) m_export_cache_revision
+    // The content revision (see get_content_revision) this page had when the
+    // data in m_export_cache was exported, or zero if there is no such data.
+    mutable uint64_t m_export_cache_revision;
+
     // (explicit ctor)
     // FIXME explain
     explicit spage(res::project &proj) :
-        asset(proj) {}
+        asset(proj),
+        m_export_cache_revision(0) {}
 
 public:
     // (typedef) ref
@@ -176,14 +386,99 @@ public:
     // FIXME explain
     DEFINE_APROP(checksum, uint32_t);
 
+    // (inner struct) parse_result
+    // The contents of a standard page as read by `parse'.
+    struct parse_result {
+        uint16_t type;
+        uint32_t cid;
+        uint32_t checksum;
+        std::vector<util::slice> pagelets;
+    };
+
+    // (s-func) calc_checksum
+    // Calculates the checksum of the given 64K page data, as stored in bytes
+    // 12 to 15 of the page header. The existing value of those bytes is not
+    // included in the calculation.
+    static uint32_t calc_checksum(const util::byte *data);
+
+    // (s-func) parse
+    // Reads the given standard page data without creating any assets. This
+    // does not touch any project state, so it is safe to call from a worker
+    // thread. Throws res::import_error if the data is invalid.
+    static parse_result parse(const util::slice &data);
+
+    // (func) import_parsed
+    // Imports a page read by `parse', creating a misc::raw_data asset for each
+    // of its pagelets.
+    void import_parsed(TRANSACT, parse_result data);
+
     // (func) import_file
-    // FIXME explain
-    void import_file(TRANSACT, const util::blob &data);
+    // Equivalent to `import_parsed(TS, parse(data))'.
+    void import_file(TRANSACT, const util::slice &data);
+
+    // (func) export_file
+    // Exports the page into `buffer', replacing its contents. The buffer's
+    // storage is reused, so a caller exporting many pages can pass the same
+    // buffer for each page to avoid reallocating it.
+    //
+    // The checksum in the exported page header is calculated from the exported
+    // data (see calc_checksum); the checksum property is not used.
+    void export_file(util::blob &buffer) const;
 
     // (func) export_file
     // FIXME explain
     util::blob export_file() const;
 
+    // (func) get_content_revision
+    // Returns the highest revision number (see res::asset::get_revision) among
+    // this page, its pagelets, and the assets those pagelets are exported from
+    // (see entry::get_content_revision). If this number has not changed, the
+    // exported page data has not changed either.
+    //
+    // Returns zero if any of the pagelets are missing or of the wrong type.
+    uint64_t get_content_revision() const;
+
+    // (func) export_cached
+    // Returns the exported page data, as export_file would. If the content
+    // revision of the page is the same as when this was last called, and the
+    // data from that call is still held, it is returned again instead of
+    // exporting the page anew.
+    //
+    // The data for the most recently exported pages is held in a cache shared
+    // by all pages, which holds at most `export_cache_capacity' pages. Older
+    // data is freed once nothing else refers to it.
+    util::slice export_cached() const;
+
+    // (s-var) export_cache_capacity
+    // The number of pages held by the cache used by `export_cached'.
+    static constexpr size_t export_cache_capacity = 64;
+
+    // (func) process_all
+    // Processes every pagelet of this page into an entry (see
+    // process_pagelet). Pagelets which were already processed are skipped.
+    void process_all(
+        TRANSACT,
+        game_ver ver,
+        const process_cache *cache = nullptr);
+
+    // (s-func) process_pagelet
+    // Replaces the given raw pagelet with an nsf::raw_entry imported from its
+    // data, under the same name, and then processes that entry by its type
+    // (see raw_entry::process_by_type).
+    static void process_pagelet(
+        TRANSACT,
+        misc::raw_data::ref pagelet,
+        game_ver ver,
+        const process_cache *cache = nullptr);
+
+    // (s-func) process_pagelet
+    // Replaces the given raw pagelet with a new, empty nsf::raw_entry under
+    // the same name, and calls `finish' to import and process it.
+    static void process_pagelet(
+        TRANSACT,
+        misc::raw_data::ref pagelet,
+        const std::function<void(TRANSACT, raw_entry &)> &finish);
+
     // FIXME obsolete
     template <typename Reflector>
     void reflect(Reflector &rfl)
@@ -191,10 +486,378 @@ public:
         asset::reflect(rfl);
         rfl.field(p_cid, "CID");
         rfl.field(p_type, "Type");
+        rfl.field(p_checksum, "Checksum");
         rfl.field(p_pagelets, "Pagelets");
     }
 };
 
+/*
+ * nsf::tpage
+ *
+ * A texture page (page type 1). The page is kept as its original 64K of data,
+ * which is shared with the archive's data rather than copied (see
+ * util::slice), and is exported back out unchanged.
+ *
+ * The page data is laid out as 128 rows of 256 16-bit pixels, as the game
+ * loads it into the PlayStation's VRAM. The page header occupies the start of
+ * the first row.
+ */
+class tpage : public res::asset {
+    friend class res::asset;
+
+private:
+    // (explicit ctor)
+    // FIXME explain
+    explicit tpage(res::project &proj) :
+        asset(proj) {}
+
+public:
+    // (typedef) ref
+    // FIXME explain
+    using ref = res::ref<tpage>;
+
+    // (s-var) width, height
+    // The dimensions of the page in 16-bit pixels.
+    static constexpr int width = 256;
+    static constexpr int height = 128;
+
+    // (inner class) row
+    // A read-only view of one row of the page's pixels. The view refers to the
+    // page's data directly, and so must not be used after the page's data is
+    // changed.
+    class row {
+    private:
+        // (var) m_data
+        // A pointer to the first byte of the row.
+        const util::byte *m_data;
+
+    public:
+        // (explicit ctor)
+        // Constructs a view of the row starting at the given data.
+        explicit row(const util::byte *data) :
+            m_data(data) {}
+
+        // (subscript operator)
+        // Returns the 16-bit pixel at the given X position in the row.
+        uint16_t operator [](int x) const
+        {
+            return m_data[x * 2] | m_data[x * 2 + 1] << 8;
+        }
+
+        // (func) size
+        // Returns the number of pixels in the row.
+        int size() const
+        {
+            return width;
+        }
+    };
+
+    // (prop) data
+    // The 64K of page data, including the header.
+    DEFINE_APROP(data, util::slice);
+
+    // (func) import_file
+    // Imports the given texture page data, sharing rather than copying it. The
+    // data is passed through the project's blob store (see
+    // res::project::get_blob_store), so a page found in several files is only
+    // held once. Throws res::import_error if the data is not a 64K texture
+    // page.
+    void import_file(TRANSACT, util::slice data);
+
+    // (func) export_file
+    // Returns the page data. No copy of the data is made.
+    util::slice export_file() const;
+
+    // (func) get_eid
+    // Returns the EID of the page, as stored in its header.
+    nsf::eid get_eid() const;
+
+    // (func) get_row
+    // Returns a view of the pixels in row `y' of the page. Throws
+    // std::logic_error if `y' is out of range.
+    row get_row(int y) const;
+
+    // FIXME obsolete
+    template <typename Reflector>
+    void reflect(Reflector &rfl)
+    {
+        asset::reflect(rfl);
+        rfl.field(p_data, "Data");
+    }
+};
+
+/*
+ * nsf::nsd
+ *
+ * An NSD file, which accompanies each NSF file in Crash 2 and Crash 3. The NSD
+ * file holds a lookup table which maps the EID of every entry and texture page
+ * in the NSF to the page it is stored in, as well as other level data which
+ * is not yet understood and is kept as-is.
+ *
+ * The lookup table is a list of links, each an EID and the ID of the page it
+ * is stored in, sorted into 256 buckets by the EID's hash (see hash_eid). The
+ * file begins with the index of the first link in each bucket, so a lookup
+ * only searches the links in a single bucket. Page IDs are odd numbers, as the
+ * ID of the page at index `i' in the NSF file is `i * 2 + 1'.
+ */
+class nsd : public res::asset {
+    friend class res::asset;
+
+public:
+    // (inner struct) link
+    // A mapping from an EID to the ID of the page which contains it.
+    struct link {
+        uint32_t page_id;
+        nsf::eid eid;
+    };
+
+    // (s-var) bucket_count
+    // The number of buckets in the lookup table.
+    static constexpr int bucket_count = 256;
+
+private:
+    // (inner struct) lookup_cache
+    // The links of the NSD sorted into buckets, for use by find_page.
+    struct lookup_cache {
+        // (var) revision
+        // The revision of the NSD (see res::asset::get_revision) these links
+        // were sorted from, or zero if they have not been sorted yet.
+        uint64_t revision = 0;
+
+        // (var) links
+        // The links, sorted by bucket.
+        std::vector<link> links;
+
+        // (var) bucket_starts
+        // The index into `links' of the first link in each bucket, followed
+        // by the number of links.
+        std::array<uint32_t, bucket_count + 1> bucket_starts;
+    };
+
+    // (var) m_lookup
+    // See lookup_cache.
+    mutable lookup_cache m_lookup;
+
+    // (explicit ctor)
+    // FIXME explain
+    explicit nsd(res::project &proj) :
+        asset(proj) {}
+
+    // (func) get_lookup
+    // Returns the lookup cache, sorting the links into it first if the NSD has
+    // changed since it was last sorted.
+    const lookup_cache &get_lookup() const;
+
+public:
+    // (typedef) ref
+    // FIXME explain
+    using ref = res::ref<nsd>;
+
+    // (prop) page_count
+    // The number of pages in the NSF file.
+    DEFINE_APROP(page_count, uint32_t);
+
+    // (prop) links
+    // The links of the lookup table. These are sorted into their buckets on
+    // export, so they may be given in any order.
+    DEFINE_APROP(links, std::vector<link>);
+
+    // (prop) level_header
+    // The data between the lookup table header and the links. This holds
+    // level information which is not yet understood.
+    DEFINE_APROP(level_header, util::slice);
+
+    // (prop) level_data
+    // The data after the links. This holds level information, such as the
+    // spawn points, which is not yet understood.
+    DEFINE_APROP(level_data, util::slice);
+
+    // (s-func) hash_eid
+    // Returns the lookup table bucket for the given EID.
+    static int hash_eid(nsf::eid eid)
+    {
+        return (eid >> 15) & 0xFF;
+    }
+
+    // (s-func) page_index_to_id, page_id_to_index
+    // Converts between the index of a page in the NSF file and its page ID.
+    static uint32_t page_index_to_id(std::size_t index)
+    {
+        return uint32_t(index * 2 + 1);
+    }
+    static std::size_t page_id_to_index(uint32_t id)
+    {
+        return id / 2;
+    }
+
+    // (func) import_file
+    // Imports the given NSD file data. Throws res::import_error if the data is
+    // invalid.
+    void import_file(TRANSACT, util::slice data);
+
+    // (func) export_file
+    // Exports the NSD file data, regenerating the lookup table from `links'.
+    util::blob export_file() const;
+
+    // (func) rebuild
+    // Replaces `page_count' and `links' with the layout of the given archive,
+    // so that the NSD matches the archive's NSF file. Pages and pagelets which
+    // are still unprocessed are read directly from their data. Throws
+    // res::export_error if a page or pagelet has an incompatible type, or
+    // res::import_error if the data of an unprocessed page is invalid.
+    void rebuild(TRANSACT, const archive &nsf_archive);
+
+    // (func) find_page
+    // Returns the index of the page in the NSF file which contains the given
+    // EID, or -1 if the EID is not in the lookup table. This only searches the
+    // links in the EID's bucket.
+    long find_page(nsf::eid eid) const;
+
+    // (func) locate_entry
+    // Returns the data of the entry or texture page with the given EID in the
+    // given NSF file data, using the lookup table to find its page. Only that
+    // page is read, so a single entry can be loaded from an NSF file without
+    // importing the rest of it. Returns an empty slice if the EID is not in
+    // the lookup table or is not on its page. Throws res::import_error if the
+    // page is invalid.
+    util::slice locate_entry(const util::slice &nsf_data, nsf::eid eid) const;
+
+    // FIXME obsolete
+    template <typename Reflector>
+    void reflect(Reflector &rfl)
+    {
+        asset::reflect(rfl);
+        rfl.field(p_page_count, "Page Count");
+        rfl.field(p_links, "Links");
+        rfl.field(p_level_header, "Level Header");
+        rfl.field(p_level_data, "Level Data");
+    }
+};
+
+/*
+ * nsf::texture_format
+ *
+ * The formats of texture data which may be found in a texture page. These are
+ * the PlayStation's texture formats.
+ */
+enum class texture_format {
+    // 4-bit texels, which are indices into a 16-color CLUT.
+    clut4,
+
+    // 8-bit texels, which are indices into a 256-color CLUT.
+    clut8,
+
+    // 16-bit texels, each of which is a 15-bit color and a semi-transparency
+    // bit.
+    direct15
+};
+
+/*
+ * nsf::texture_region
+ *
+ * A rectangle of texture data within a texture page.
+ *
+ * The position and size of the rectangle are given in texels of the region's
+ * format, so a 4-bit region at `x' 8 begins at the third 16-bit pixel of each
+ * row of the page. The position of the CLUT is given in 16-bit pixels, as the
+ * CLUT is made of 15-bit colors, and is unused for direct15 regions.
+ */
+struct texture_region {
+    texture_format format;
+    int clut_x;
+    int clut_y;
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// (func) decode_texture
+// Decodes the given region of the given texture page data, which must be 64K,
+// into 32-bit RGBA texels (0xAABBGGRR) written row by row to `out'. Throws
+// std::logic_error if the region or its CLUT does not lie within the page.
+//
+// Colors with the semi-transparency bit set decode with an alpha of 0x80, and
+// the color 0x0000 decodes as fully transparent black, as it is drawn by the
+// PlayStation. All other colors are opaque.
+void decode_texture(
+    const util::byte *page,
+    const texture_region &region,
+    uint32_t *out);
+
+/*
+ * nsf::texture_cache
+ *
+ * A cache of decoded texture regions (see decode_texture), so that a region
+ * used by many polygons or by many frames is only decoded once. Once the
+ * decoded regions in the cache exceed the cache's capacity, the least recently
+ * used regions are discarded.
+ *
+ * The cache holds a reference to the data of each page it has decoded from, so
+ * regions are never decoded from stale data: a page whose data has changed is
+ * a different page as far as the cache is concerned.
+ *
+ * This class is not thread-safe.
+ */
+class texture_cache : private util::nocopy {
+public:
+    // (typedef) pixels
+    // A reference to a decoded texture region. The data remains valid after
+    // the region is discarded from the cache.
+    using pixels = std::shared_ptr<const std::vector<uint32_t>>;
+
+private:
+    // (inner struct) key
+    // The page data and region of a cached region.
+    struct key {
+        const util::byte *page;
+        texture_region region;
+
+        bool operator <(const key &rhs) const;
+    };
+
+    // (inner struct) item
+    // A cached region.
+    struct item {
+        key k;
+        util::slice page;
+        pixels data;
+    };
+
+    // (var) m_items
+    // The cached regions, from most to least recently used.
+    std::list<item> m_items;
+
+    // (var) m_index
+    // The cached regions in m_items, by key.
+    std::map<key, std::list<item>::iterator> m_index;
+
+    // (var) m_capacity
+    // The maximum total number of texels to hold in the cache.
+    std::size_t m_capacity;
+
+    // (var) m_size
+    // The total number of texels in the cached regions.
+    std::size_t m_size;
+
+public:
+    // (explicit ctor)
+    // Constructs an empty cache which holds up to `capacity' decoded texels.
+    explicit texture_cache(std::size_t capacity = 1024 * 1024) :
+        m_capacity(capacity),
+        m_size(0) {}
+
+    // (func) get
+    // Returns the given region of the given texture page data, decoding it
+    // only if it is not already in the cache. Throws std::logic_error if the
+    // page data is not 64K or if the region is not within the page.
+    pixels get(const util::slice &page, const texture_region &region);
+
+    // (func) clear
+    // Discards every region in the cache.
+    void clear();
+};
+
 /*
  * nsf::entry
  *
@@ -222,9 +885,33 @@ public:
 
     // (pure func) export_entry
     // FIXME explain
-    virtual std::vector<util::blob> export_entry(
+    virtual std::vector<util::slice> export_entry(
         uint32_t &out_type) const = 0;
 
+    // (s-func) calc_file_size
+    // Returns the exact size of the entry file data which write_file would
+    // write for the given items.
+    static size_t calc_file_size(const std::vector<util::slice> &items);
+
+    // (s-func) write_file
+    // Writes entry file data with the given EID, type, and items directly to
+    // `dest', which must have room for `calc_file_size(items)' bytes. This
+    // allows an entry to be exported straight into its place in a page (see
+    // spage::export_file) rather than into a separate buffer.
+    static void write_file(
+        util::byte *dest,
+        nsf::eid eid,
+        uint32_t type,
+        const std::vector<util::slice> &items);
+
+    // (func) get_content_revision
+    // Returns the highest revision number (see res::asset::get_revision) among
+    // this entry and any other assets its exported data is built from, or
+    // zero if any of those assets are missing. The default implementation
+    // returns the entry's own revision, and should be overridden by entry
+    // types which export data from other assets.
+    virtual uint64_t get_content_revision() const;
+
     // FIXME obsolete
     template <typename Reflector>
     void reflect(Reflector &rfl)
@@ -234,6 +921,118 @@ public:
     }
 };
 
+/*
+ * nsf::entry_index
+ *
+ * An index of the entries and texture pages in a project by EID, for resolving
+ * references between them (such as the texture page references of a wgeo_v2
+ * entry) without searching the whole project. Texture pages are not entries,
+ * and are filed under the EID in their page header (see tpage::get_eid).
+ *
+ * The index is kept up to date as entries and texture pages appear, disappear,
+ * and change their EID, including by undo and redo. Creating the index takes
+ * time linear in the number of assets in the project; after that, each change
+ * and each lookup takes constant time.
+ *
+ * Raw pages and pagelets which have yet to be processed (such as those of a
+ * lazily imported NSF) are filed separately, under the EIDs of the texture
+ * page or entries they hold. Looking up an EID which is only held by one of
+ * these processes it first (see res::ref::demand).
+ */
+class entry_index : private util::nocopy {
+private:
+    // (inner struct) record
+    // Tracks an entry, texture page or unprocessed stub in the index.
+    struct record {
+        // (var) stub
+        // True if the asset is an unprocessed raw page or pagelet, filed in
+        // m_stubs rather than m_assets.
+        bool stub;
+
+        // (var) keys
+        // The EIDs the asset is filed under. This is empty for a texture page
+        // with no data to read its EID from, and may hold several EIDs for a
+        // raw page.
+        std::vector<uint32_t> keys;
+
+        // (handler) h_change
+        // Hooks the on_change event of the property holding the asset's EID
+        // (entry::p_eid, tpage::p_data or misc::raw_data::p_packed_data) so the
+        // asset can be filed under its new EID.
+        decltype(decltype(entry::p_eid)::on_change)::watch h_change;
+    };
+
+    // (var) m_proj
+    // The project being indexed.
+    res::project &m_proj;
+
+    // (var) m_assets
+    // The entries and texture pages in the project, by EID. More than one may
+    // have the same EID.
+    std::unordered_multimap<uint32_t, res::asset *> m_assets;
+
+    // (var) m_stubs
+    // The unprocessed raw pages and pagelets in the project, by the EIDs of
+    // the texture page or entries they hold.
+    std::unordered_multimap<uint32_t, res::asset *> m_stubs;
+
+    // (var) m_records
+    // The records of the entries and texture pages in the project.
+    std::unordered_map<res::asset *, std::unique_ptr<record>> m_records;
+
+    // (handler) h_asset_appear, h_asset_disappear
+    // Hooks the project's on_asset_appear and on_asset_disappear events so
+    // that assets can be added to and removed from the index.
+    decltype(res::project::on_asset_appear)::watch h_asset_appear;
+    decltype(res::project::on_asset_disappear)::watch h_asset_disappear;
+
+    // (func) add
+    // Adds the given asset to the index under its current EID, if it is an
+    // entry or a texture page.
+    void add(res::asset &asset);
+
+    // (func) remove
+    // Removes the given asset from the index.
+    void remove(res::asset &asset);
+
+    // (func) unfile
+    // Removes the given asset from m_assets or m_stubs, if it is filed there.
+    void unfile(res::asset &asset, record &rec);
+
+    // (func) refile
+    // Moves the given asset in the index from its old EID to its current EID.
+    void refile(res::asset &asset);
+
+    // (func) find_as<T>
+    // Returns an asset of type T with the given EID, or a null ref if there is
+    // no such asset. Stubs holding the EID are processed until one is found.
+    template <typename T>
+    res::ref<T> find_as(nsf::eid eid) const;
+
+public:
+    // (explicit ctor)
+    // Constructs an index of the entries and texture pages in the given
+    // project, which must outlive the index.
+    explicit entry_index(res::project &proj);
+
+    // (func) find
+    // Returns the entry or texture page with the given EID, or a null ref if
+    // there is none. If several have the EID, one of them is returned. If the
+    // EID is only found in an unprocessed stub, the stub is processed first,
+    // which runs a transaction; this is also true of find_entry and find_tpage.
+    res::anyref find(nsf::eid eid) const;
+
+    // (func) find_entry
+    // Returns the entry with the given EID, or a null ref if there is no such
+    // entry. If several entries have the EID, one of them is returned.
+    entry::ref find_entry(nsf::eid eid) const;
+
+    // (func) find_tpage
+    // Returns the texture page with the given EID, or a null ref if there is
+    // no such page. If several pages have the EID, one of them is returned.
+    tpage::ref find_tpage(nsf::eid eid) const;
+};
+
 /*
  * nsf::raw_entry
  *
@@ -254,45 +1053,102 @@ public:
     using ref = res::ref<raw_entry>;
 
     // (prop) items
-    // FIXME explain
-    DEFINE_APROP(items, std::vector<util::blob>);
+    // The entry's items. When imported, these refer into the data the entry
+    // was imported from rather than holding copies of it.
+    DEFINE_APROP(items, std::vector<util::slice>);
 
     // (prop) type
     // FIXME explain
     DEFINE_APROP(type, uint32_t);
 
+    // (inner struct) parse_result
+    // The contents of an entry as read by `parse'.
+    struct parse_result {
+        nsf::eid eid;
+        uint32_t type;
+        std::vector<util::slice> items;
+    };
+
+    // (typedef) processor
+    // A function which completes the processing of a raw entry into another
+    // entry type (see prepare_by_type).
+    using processor = std::function<void(TRANSACT, raw_entry &)>;
+
+    // (s-func) parse
+    // Reads the given entry data without creating any assets. This does not
+    // touch any project state, so it is safe to call from a worker thread.
+    // Throws res::import_error if the data is invalid.
+    static parse_result parse(const util::slice &data);
+
+    // (func) import_parsed
+    // Imports an entry read by `parse'.
+    void import_parsed(TRANSACT, parse_result data);
+
     // (func) import_file
-    // FIXME explain
-    void import_file(TRANSACT, const util::blob &data);
+    // Equivalent to `import_parsed(TS, parse(data))'.
+    void import_file(TRANSACT, const util::slice &data);
 
     // (func) export_entry
     // FIXME explain
-    std::vector<util::blob> export_entry(
+    std::vector<util::slice> export_entry(
         uint32_t &out_type) const final override;
 
     // (func) process_as<T>
-    // FIXME explain
+    // Replaces this entry with an entry of type T under the same name, which
+    // is imported from the already-parsed data given. See T::parse.
     template <typename T>
-    void process_as(TRANSACT)
+    void process_as(TRANSACT, typename T::parse_result data)
     {
         assert_alive();
 
-        // Create the output entry under a reserved name,
-        // '_PROCESS_OUTPUT'.
+        // Move this entry out of the way, to a reserved name under its
+        // current name, '_RAW'.
         res::ref<T> result = get_name();
         rename(TS, result / "_RAW");
         result.create(TS, get_proj());
 
         // Process the raw items into the output entry.
         result->set_eid(TS, get_eid());
-        result->import_entry(TS, get_items());
+        result->import_parsed(TS, std::move(data));
 
         destroy(TS);
     }
 
+    // (func) process_as<T>
+    // Replaces this entry with an entry of type T under the same name, which
+    // is imported from this entry's items.
+    template <typename T>
+    void process_as(TRANSACT)
+    {
+        process_as<T>(TS, T::parse(get_items()));
+    }
+
+    // (s-func) prepare_by_type
+    // Parses the given items as the entry type indicated by `ver' and `type',
+    // and returns a processor which replaces a raw entry with the resulting
+    // entry in the same manner as `process_by_type'. The parsing is done here
+    // rather than in the processor, and does not touch any project state, so
+    // this is safe to call from a worker thread.
+    //
+    // If `cache' is given, the decoded data is loaded from it instead when
+    // present, and is otherwise stored into it after parsing.
+    //
+    // Returns a null processor if the type is not supported. Throws
+    // res::import_error if the items are invalid for the type.
+    static processor prepare_by_type(
+        game_ver ver,
+        uint32_t type,
+        const std::vector<util::slice> &items,
+        const process_cache *cache = nullptr);
+
     // (func) process_by_type
-    // FIXME explain
-    bool process_by_type(TRANSACT, game_ver ver);
+    // Processes this entry into the appropriate entry type for its type
+    // number, if any (see prepare_by_type). Returns false if the type is not
+    // supported, in which case no changes are made.
+    bool process_by_type(
+        TRANSACT,
+        game_ver ver,
+        const process_cache *cache = nullptr);
 
     // FIXME obsolete
     template <typename Reflector>
@@ -340,34 +1196,157 @@ public:
 
     // (prop) item4
     // FIXME explain
-    DEFINE_APROP(item4, util::blob);
+    DEFINE_APROP(item4, util::slice);
 
     // (prop) item6
     // FIXME explain
-    DEFINE_APROP(item6, util::blob);
+    DEFINE_APROP(item6, util::slice);
 
     // (prop) world
     // FIXME explain
     DEFINE_APROP(world, gfx::world::ref);
 
+    // (inner struct) parse_result
+    // The contents of a wgeo_v2 entry's items as read by `parse'.
+    struct parse_result {
+        int32_t world_x;
+        int32_t world_y;
+        int32_t world_z;
+        uint32_t info_unk0;
+        uint32_t tpag_ref_count;
+        uint32_t tpag_refs[8];
+        std::vector<gfx::vertex> vertices;
+        std::vector<gfx::triangle> triangles;
+        std::vector<gfx::quad> quads;
+        std::vector<gfx::color> colors;
+        util::slice item4;
+        util::slice item6;
+    };
+
+    // (s-func) parse
+    // Decodes the given items without creating any assets. This does not touch
+    // any project state, so it is safe to call from a worker thread. Throws
+    // res::import_error if the items are invalid.
+    static parse_result parse(const std::vector<util::slice> &items);
+
+    // (s-func) save_parsed
+    // Encodes the result of `parse' in the compact form stored by an
+    // nsf::process_cache. The arrays are written exactly as they are held in
+    // memory, so they can be loaded back without decoding each element.
+    static util::blob save_parsed(const parse_result &data);
+
+    // (s-func) load_parsed
+    // Decodes data written by `save_parsed' for an entry with the given items,
+    // giving the same result as `parse(items)'. Throws res::import_error if the
+    // data is damaged or does not match the items.
+    static parse_result load_parsed(
+        const util::slice &data,
+        const std::vector<util::slice> &items);
+
+    // (func) import_parsed
+    // Imports an entry decoded by `parse', creating the scenery assets (world,
+    // model, mesh, etc) for it.
+    void import_parsed(TRANSACT, parse_result data);
+
     // (func) import_entry
-    // FIXME explain
-    void import_entry(TRANSACT, const std::vector<util::blob> &items);
+    // Equivalent to `import_parsed(TS, parse(items))'.
+    void import_entry(TRANSACT, const std::vector<util::slice> &items);
+
+    // (func) get_tpages
+    // Returns the texture pages named by the entry's tpag refs, as found in the
+    // given index. A page which is not found is given as a null ref.
+    std::vector<tpage::ref> get_tpages(const entry_index &index) const;
 
     // (func) export_entry
     // FIXME explain
-    std::vector<util::blob> export_entry(
+    std::vector<util::slice> export_entry(
         uint32_t &out_type) const final override;
 
+    // (func) get_content_revision
+    // Includes the revisions of the world, model, mesh, anim and frame assets
+    // which the entry is exported from.
+    uint64_t get_content_revision() const final override;
+
     // FIXME obsolete
     template <typename Reflector>
     void reflect(Reflector &rfl)
     {
         entry::reflect(rfl);
+        rfl.field(p_info_unk0, "Info Unk0");
+        rfl.field(p_tpag_ref_count, "Tpag Ref Count");
+        rfl.field(p_tpag_ref0, "Tpag Ref 0");
+        rfl.field(p_tpag_ref1, "Tpag Ref 1");
+        rfl.field(p_tpag_ref2, "Tpag Ref 2");
+        rfl.field(p_tpag_ref3, "Tpag Ref 3");
+        rfl.field(p_tpag_ref4, "Tpag Ref 4");
+        rfl.field(p_tpag_ref5, "Tpag Ref 5");
+        rfl.field(p_tpag_ref6, "Tpag Ref 6");
+        rfl.field(p_tpag_ref7, "Tpag Ref 7");
         rfl.field(p_item4, "Item 4");
         rfl.field(p_item6, "Item 6");
+        rfl.field(p_world, "World");
     }
 };
 
+}
+
+namespace reflect {
+
+// reflection info for nsf::archive
+template <>
+struct asset_type_info<nsf::archive> {
+    using base_type = res::asset;
+
+    static constexpr const char *name = "nsf::archive";
+};
+
+// reflection info for nsf::spage
+template <>
+struct asset_type_info<nsf::spage> {
+    using base_type = res::asset;
+
+    static constexpr const char *name = "nsf::spage";
+};
+
+// reflection info for nsf::tpage
+template <>
+struct asset_type_info<nsf::tpage> {
+    using base_type = res::asset;
+
+    static constexpr const char *name = "nsf::tpage";
+};
+
+// reflection info for nsf::nsd
+template <>
+struct asset_type_info<nsf::nsd> {
+    using base_type = res::asset;
+
+    static constexpr const char *name = "nsf::nsd";
+};
+
+// reflection info for nsf::entry
+template <>
+struct asset_type_info<nsf::entry> {
+    using base_type = res::asset;
+
+    static constexpr const char *name = "nsf::entry";
+};
+
+// reflection info for nsf::raw_entry
+template <>
+struct asset_type_info<nsf::raw_entry> {
+    using base_type = nsf::entry;
+
+    static constexpr const char *name = "nsf::raw_entry";
+};
+
+// reflection info for nsf::wgeo_v2
+template <>
+struct asset_type_info<nsf::wgeo_v2> {
+    using base_type = nsf::entry;
+
+    static constexpr const char *name = "nsf::wgeo_v2";
+};
+
 }
 }
@@ -19,6 +19,7 @@
 //
 
 #include "common.hh"
+#include <algorithm>
 #include "nsf.hh"
 #include "misc.hh"
 
@@ -26,7 +27,7 @@ namespace drnsf {
 namespace nsf {
 
 // declared in nsf.hh
-void archive::import_file(TRANSACT, const util::blob &data)
+void archive::import_file(TRANSACT, util::slice data)
 {
     assert_alive();
 
@@ -36,21 +37,19 @@ void archive::import_file(TRANSACT, const util::blob &data)
 
     int page_count = data.size() / page_size;
 
-    // Copy the data for each page as a new raw_data asset. The caller can
-    // later process these into standard or texture pages if desired.
+    // Create a new raw_data asset for each page, sharing the original data
+    // rather than copying it. The caller can later process these into
+    // standard or texture pages if desired.
     std::vector<misc::raw_data::ref> pages(page_count);
     for (auto &&i : util::range_of(pages)) {
         auto &&page = pages[i];
 
         // Create the page asset.
-        page = get_name() / "page-$"_fmt(i);
+        page = get_name().indexed("page-", i);
         page.create(TS, get_proj());
 
-        // Copy the page data into the asset.
-        page->set_data(TS, {
-            data.data() + page_size * i,
-            data.data() + page_size * (i + 1)
-        });
+        // Point the asset at the page's data.
+        page->set_data(TS, data.sub(page_size * i, page_size));
     }
 
     // Finish importing.
@@ -58,9 +57,11 @@ void archive::import_file(TRANSACT, const util::blob &data)
 }
 
 // declared in nsf.hh
-util::blob archive::export_file() const
+void archive::export_file(const sink &out, bool use_cache) const
 {
-    util::blob data;
+    // Standard pages are exported into the same buffer one after another, so
+    // only one page is held at a time.
+    util::blob buffer;
 
     for (auto &&i : util::range_of(get_pages())) {
         auto ref = get_pages()[i];
@@ -70,23 +71,444 @@ util::blob archive::export_file() const
 
         misc::raw_data::ref raw_ref = ref;
         if (raw_ref.ok()) {
-            auto raw_data = raw_ref->get_data();
-            data.insert(data.end(), raw_data.begin(), raw_data.end());
+            auto &&raw_data = raw_ref->get_data();
+            out(raw_data.data(), raw_data.size());
             continue;
         }
 
         spage::ref spage_ref = ref;
         if (spage_ref.ok()) {
-            auto spage_data = spage_ref->export_file();
-            data.insert(data.end(), spage_data.begin(), spage_data.end());
+            if (use_cache) {
+                auto &&spage_data = spage_ref->export_cached();
+                out(spage_data.data(), spage_data.size());
+            } else {
+                spage_ref->export_file(buffer);
+                out(buffer.data(), buffer.size());
+            }
+            continue;
+        }
+
+        tpage::ref tpage_ref = ref;
+        if (tpage_ref.ok()) {
+            auto &&tpage_data = tpage_ref->export_file();
+            out(tpage_data.data(), tpage_data.size());
             continue;
         }
 
         throw res::export_error("nsf::archive: page has incompatible type");
     }
+}
+
+// declared in nsf.hh
+util::blob archive::export_file() const
+{
+    util::blob data;
+    data.reserve(get_pages().size() * page_size);
+
+    export_file([&](const util::byte *page_data, std::size_t size) {
+        data.insert(data.end(), page_data, page_data + size);
+    });
 
     return data;
 }
 
+// declared in nsf.hh
+std::vector<std::size_t> archive::find_bad_checksums(const util::slice &data)
+{
+    // Ensure the NSF size is a multiple of the page size (64K).
+    if (data.size() % page_size != 0)
+        throw res::import_error("nsf::archive: size not multiple of 64K");
+
+    std::size_t page_count = data.size() / page_size;
+
+    // Each page's result is written to its own element, as std::vector<bool>
+    // elements cannot safely be written from separate threads.
+    std::vector<char> page_ok(page_count);
+    util::parallel_for(page_count, [&](std::size_t i) {
+        auto page = data.data() + page_size * i;
+
+        // Pages with type 1 are texture pages, which are not checked.
+        if (page[2] == 1) {
+            page_ok[i] = true;
+            return;
+        }
+
+        uint32_t checksum = page[12] |
+            page[13] << 8 |
+            page[14] << 16 |
+            uint32_t(page[15]) << 24;
+        page_ok[i] = (checksum == spage::calc_checksum(page));
+    });
+
+    std::vector<std::size_t> result;
+    for (auto &&i : util::range_of(page_ok)) {
+        if (!page_ok[i]) {
+            result.push_back(i);
+        }
+    }
+    return result;
+}
+
+namespace {
+
+// (internal struct) pagelet_job
+// A raw pagelet to be processed by archive::process_all.
+struct pagelet_job {
+    // (var) name
+    // The name of the raw pagelet. This is null for the pagelets of raw pages
+    // until their page has been imported, at which point the name is built
+    // from `index'.
+    misc::raw_data::ref name;
+
+    // (var) index
+    // The index of the pagelet within its page.
+    std::size_t index;
+
+    // (var) data
+    // The raw data of the pagelet.
+    util::slice data;
+
+    // (var) entry
+    // The pagelet's data as parsed by raw_entry::parse.
+    raw_entry::parse_result entry;
+
+    // (var) process
+    // The processor for the entry (see raw_entry::prepare_by_type), or null if
+    // the entry type is not supported.
+    raw_entry::processor process;
+};
+
+// (internal struct) page_job
+// A page to be processed by archive::process_all.
+struct page_job {
+    // (var) name
+    // The name of the page.
+    res::atom name;
+
+    // (var) is_raw
+    // True if the page is still raw data and must be imported as a standard
+    // or texture page, or false if it already is a standard page.
+    bool is_raw;
+
+    // (var) is_texture
+    // True if the page is a raw texture page. Texture pages need no parsing,
+    // and have no pagelets.
+    bool is_texture;
+
+    // (var) data
+    // The raw data of the page, if `is_raw' is true.
+    util::slice data;
+
+    // (var) page
+    // The page's data as parsed by spage::parse, if `is_raw' is true.
+    spage::parse_result page;
+
+    // (var) pagelets
+    // The pagelets of the page which have yet to be processed.
+    std::vector<pagelet_job> pagelets;
+};
+
+// (s-func) replace_page
+// Replaces the given raw page with an nsf::spage under the same name, imported
+// from the given parsed page data.
+void replace_page(
+    TRANSACT,
+    misc::raw_data::ref page,
+    spage::parse_result data)
+{
+    spage::ref spage = page;
+    page->rename(TS, page / "_PROCESSING");
+    page /= "_PROCESSING";
+    spage.create(TS, page->get_proj());
+    spage->import_parsed(TS, std::move(data));
+    page->destroy(TS);
+}
+
+// (s-func) replace_texture_page
+// Replaces the given raw page with an nsf::tpage under the same name, imported
+// from the raw page's data.
+void replace_texture_page(TRANSACT, misc::raw_data::ref page)
+{
+    tpage::ref tpage = page;
+    page->rename(TS, page / "_PROCESSING");
+    page /= "_PROCESSING";
+    tpage.create(TS, page->get_proj());
+    tpage->import_file(TS, page->get_data());
+    page->destroy(TS);
+}
+
+}
+
+// declared in nsf.hh
+void archive::process_all(
+    TRANSACT,
+    game_ver ver,
+    const process_cache *cache)
+{
+    assert_alive();
+
+    // Collect the pages and pagelets which need processing, along with their
+    // data. Project state may only be accessed from this thread, so this is
+    // done before any of the parsing work is handed out.
+    std::vector<page_job> jobs;
+    for (auto &&page : get_pages()) {
+        misc::raw_data::ref raw_page = page;
+        if (raw_page.ok()) {
+            // Pages with type 1 are texture pages.
+            bool is_texture = (raw_page->get_data()[2] == 1);
+
+            jobs.push_back({
+                page,
+                true,
+                is_texture,
+                raw_page->get_data(),
+                {},
+                {}
+            });
+            continue;
+        }
+
+        spage::ref spage = page;
+        if (!spage.ok())
+            continue;
+
+        page_job job = {page, false, false, {}, {}, {}};
+        for (misc::raw_data::ref pagelet : spage->get_pagelets()) {
+            // Skip pagelets which have already been processed.
+            if (!pagelet.ok())
+                continue;
+
+            job.pagelets.push_back({
+                pagelet,
+                0,
+                pagelet->get_data(),
+                {},
+                {}
+            });
+        }
+        jobs.push_back(std::move(job));
+    }
+
+    // Parse the pages and entries. Each job only touches its own data, so the
+    // jobs can be spread across multiple threads. No atoms or assets may be
+    // created or accessed here; the pagelets of raw pages are only recorded
+    // by index, and are named once their page is imported below.
+    util::parallel_for(jobs.size(), [&](std::size_t i) {
+        auto &&job = jobs[i];
+
+        if (job.is_texture)
+            return;
+
+        if (job.is_raw) {
+            job.page = spage::parse(job.data);
+            for (auto &&j : util::range_of(job.page.pagelets)) {
+                job.pagelets.push_back({
+                    {},
+                    j,
+                    job.page.pagelets[j],
+                    {},
+                    {}
+                });
+            }
+        }
+
+        for (auto &&pagelet : job.pagelets) {
+            pagelet.entry = raw_entry::parse(pagelet.data);
+            pagelet.process = raw_entry::prepare_by_type(
+                ver,
+                pagelet.entry.type,
+                pagelet.entry.items,
+                cache
+            );
+        }
+    });
+
+    // Create the assets from the parsed data. This is done in order, on this
+    // thread, as the transaction is not safe to share between threads.
+    for (auto &&job : jobs) {
+        if (job.is_texture) {
+            replace_texture_page(TS, job.name);
+        } else if (job.is_raw) {
+            replace_page(TS, job.name, std::move(job.page));
+        }
+
+        for (auto &&pagelet : job.pagelets) {
+            if (!pagelet.name) {
+                pagelet.name = job.name.indexed("pagelet-", pagelet.index);
+            }
+
+            spage::process_pagelet(
+                TS,
+                pagelet.name,
+                [&](TRANSACT, raw_entry &entry) {
+                    entry.import_parsed(TS, std::move(pagelet.entry));
+                    if (pagelet.process) {
+                        pagelet.process(TS, entry);
+                    }
+                }
+            );
+        }
+    }
+}
+
+// declared in nsf.hh
+void archive::process_page(TRANSACT, misc::raw_data::ref page)
+{
+    // Pages with type 1 are texture pages.
+    if (page->get_data()[2] == 1) {
+        replace_texture_page(TS, page);
+    } else {
+        replace_page(TS, page, spage::parse(page->get_data()));
+    }
+}
+
+// declared in nsf.hh
+bool archive::process_on_demand(
+    TRANSACT,
+    res::asset &asset,
+    game_ver ver,
+    const process_cache *cache)
+{
+    if (!dynamic_cast<misc::raw_data *>(&asset))
+        return false;
+
+    auto &&name = asset.get_name();
+    if (name == asset.get_proj().get_asset_root())
+        return false;
+
+    auto parent = name.get_parent();
+
+    // Check if this is a page of an archive.
+    archive::ref parent_archive = parent;
+    if (parent_archive.ok()) {
+        auto &&pages = parent_archive->get_pages();
+        if (std::find(pages.begin(), pages.end(), name) == pages.end())
+            return false;
+
+        process_page(TS, name);
+        return true;
+    }
+
+    // Check if this is a pagelet of a standard page.
+    spage::ref parent_spage = parent;
+    if (parent_spage.ok()) {
+        auto &&pagelets = parent_spage->get_pagelets();
+        if (std::find(pagelets.begin(), pagelets.end(), name) ==
+            pagelets.end())
+            return false;
+
+        spage::process_pagelet(TS, name, ver, cache);
+        return true;
+    }
+
+    return false;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(nsf_archive, FindBadChecksums)
+{
+    // A standard page exported through nsf::spage.
+    res::project proj;
+    spage::ref page = proj.get_asset_root() / "page";
+    proj.get_transact().run([&](TRANSACT) {
+        page.create(TS, proj);
+        page->import_parsed(TS, {0, 1, 0, {util::blob{1, 2, 3}}});
+    });
+    util::blob page0;
+    page->export_file(page0);
+
+    // A texture page, whose checksum bytes are not a checksum.
+    util::blob page1(page_size, 0xAA);
+    page1[0] = 0x34;
+    page1[1] = 0x12;
+    page1[2] = 1;
+    page1[3] = 0;
+
+    // A standard page with its checksum filled in by hand.
+    util::blob page2(page_size);
+    for (auto &&i : util::range_of(page2)) {
+        page2[i] = i * 7;
+    }
+    page2[2] = 0;
+    auto checksum = spage::calc_checksum(page2.data());
+    page2[12] = checksum;
+    page2[13] = checksum >> 8;
+    page2[14] = checksum >> 16;
+    page2[15] = checksum >> 24;
+
+    util::blob data;
+    data.insert(data.end(), page0.begin(), page0.end());
+    data.insert(data.end(), page1.begin(), page1.end());
+    data.insert(data.end(), page2.begin(), page2.end());
+    ASSERT_EQ(data.size(), page_size * 3);
+    EXPECT_TRUE(archive::find_bad_checksums(data).empty());
+
+    // Corrupting one byte outside of the checksum itself is found, and only in
+    // the page it was made in.
+    auto bad = data;
+    bad[page_size * 2 + 100] ^= 0x40;
+    EXPECT_EQ(archive::find_bad_checksums(bad), std::vector<std::size_t>{2});
+
+    bad = data;
+    bad[page_size - 1] ^= 0x01;
+    EXPECT_EQ(archive::find_bad_checksums(bad), std::vector<std::size_t>{0});
+
+    // Texture pages are not checked.
+    bad = data;
+    bad[page_size + 100] ^= 0x40;
+    EXPECT_TRUE(archive::find_bad_checksums(bad).empty());
+
+    // Data which is not a whole number of pages is rejected.
+    data.pop_back();
+    EXPECT_THROW(archive::find_bad_checksums(data), res::import_error);
+}
+
+TEST(nsf_archive, PackThreshold)
+{
+    // Three pages, the first two of which compress well.
+    util::blob pattern(page_size * 3);
+    uint32_t state = 1;
+    for (auto &&i : util::range_of(pattern)) {
+        if (i < page_size * 2) {
+            pattern[i] = i % 251;
+        } else {
+            state = state * 1103515245 + 12345;
+            pattern[i] = state >> 16;
+        }
+    }
+    util::slice data = std::move(pattern);
+
+    res::project proj;
+    proj.set_pack_threshold(4096);
+
+    archive::ref nsfile = proj.get_asset_root() / "nsfile";
+    proj.get_transact().run([&](TRANSACT) {
+        nsfile.create(TS, proj);
+        nsfile->import_file(TS, data);
+    });
+
+    // The pages are held compressed where possible, and give back the same
+    // data either way.
+    auto &&pages = nsfile->get_pages();
+    ASSERT_EQ(pages.size(), 3u);
+    for (auto &&i : util::range_of(pages)) {
+        misc::raw_data::ref page = pages[i];
+        ASSERT_TRUE(page.ok());
+        EXPECT_EQ(page->get_packed_data().is_packed(), i < 2);
+        EXPECT_EQ(page->get_data(), data.sub(page_size * i, page_size));
+    }
+
+    util::blob out;
+    nsfile->export_file([&](const util::byte *p, size_t size) {
+        out.insert(out.end(), p, p + size);
+    });
+    EXPECT_EQ(util::slice(std::move(out)), data);
+}
+
+}
+#endif
+
 }
 }
@@ -19,6 +19,7 @@
 //
 
 #include "common.hh"
+#include <algorithm>
 #include "nsf.hh"
 
 namespace drnsf {
@@ -29,35 +30,494 @@ util::blob entry::export_file() const
 {
     assert_alive();
 
-    util::binwriter w;
-    w.begin();
-
     uint32_t type;
     auto items = export_entry(type);
 
+    util::blob data(calc_file_size(items));
+    write_file(data.data(), get_eid(), type, items);
+    return data;
+}
+
+// declared in nsf.hh
+size_t entry::calc_file_size(const std::vector<util::slice> &items)
+{
+    size_t size = 20 + items.size() * 4;
+    for (auto &&item : items) {
+        size += item.size();
+    }
+    return size;
+}
+
+// declared in nsf.hh
+void entry::write_file(
+    util::byte *dest,
+    nsf::eid eid,
+    uint32_t type,
+    const std::vector<util::slice> &items)
+{
+    auto write_u32 = [&](uint32_t value) {
+        dest[0] = value;
+        dest[1] = value >> 8;
+        dest[2] = value >> 16;
+        dest[3] = value >> 24;
+        dest += 4;
+    };
+
     // Write the entry header.
-    w.write_u32(0x100FFFF);
-    w.write_u32(get_eid());
-    w.write_u32(type);
-    w.write_u32(items.size());
+    write_u32(0x100FFFF);
+    write_u32(eid);
+    write_u32(type);
+    write_u32(items.size());
 
     // Calculate and write the item offsets.
     uint32_t item_offset = 20 + items.size() * 4;
     for (auto &&item : items) {
-        w.write_u32(item_offset);
+        write_u32(item_offset);
         item_offset += item.size();
     }
-    w.write_u32(item_offset);
-
-    auto data = w.end();
+    write_u32(item_offset);
 
     // Write the items themselves.
     for (auto &&item : items) {
-        data.insert(data.end(), item.begin(), item.end());
+        std::copy(item.begin(), item.end(), dest);
+        dest += item.size();
     }
+}
+
+// declared in nsf.hh
+uint64_t entry::get_content_revision() const
+{
+    assert_alive();
+
+    return get_revision();
+}
+
+namespace {
+
+// (s-func) read_le32
+// Reads a little-endian 32-bit value from the given bytes.
+uint32_t read_le32(const util::byte *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24;
+}
+
+// (s-func) read_stub_keys
+// Appends the EIDs held by the given raw page or pagelet data to `keys'. A
+// texture page holds its own EID, a standard page holds the EIDs of each of its
+// entries, and a pagelet holds the EID of the entry it is. Data which is none
+// of these holds no EIDs.
+void read_stub_keys(const util::slice &data, std::vector<uint32_t> &keys)
+{
+    auto p = data.data();
+
+    // Check for a page.
+    if (data.size() == page_size && (p[0] | p[1] << 8) == 0x1234) {
+        // Pages with type 1 are texture pages.
+        if (p[2] == 1 && p[3] == 0) {
+            keys.push_back(read_le32(p + 4));
+            return;
+        }
+
+        // Read the EID of each entry in the page, skipping any which are not
+        // entries or do not fit in the page.
+        auto count = read_le32(p + 8);
+        if (count > (page_size - 20) / 4)
+            return;
+
+        for (uint32_t i = 0; i < count; i++) {
+            auto offset = read_le32(p + 16 + i * 4);
+            if (offset > page_size - 8)
+                continue;
+            if (read_le32(p + offset) != 0x100FFFF)
+                continue;
+
+            keys.push_back(read_le32(p + offset + 4));
+        }
+        return;
+    }
+
+    // Check for an entry.
+    if (data.size() >= 8 && read_le32(p) == 0x100FFFF) {
+        keys.push_back(read_le32(p + 4));
+    }
+}
+
+// (s-func) read_keys
+// Reads the EIDs the given entry, texture page or raw stub is filed under
+// into `keys'. A texture page without enough data to hold an EID, such as one
+// which was just created, has none.
+void read_keys(res::asset &asset, std::vector<uint32_t> &keys)
+{
+    keys.clear();
+
+    if (auto ent = dynamic_cast<entry *>(&asset)) {
+        keys.push_back(ent->get_eid());
+        return;
+    }
+
+    if (auto raw = dynamic_cast<misc::raw_data *>(&asset)) {
+        read_stub_keys(raw->get_data(), keys);
+        return;
+    }
+
+    auto &&page = static_cast<tpage &>(asset);
+    if (page.get_data().size() < 8)
+        return;
+
+    keys.push_back(page.get_eid());
+}
+
+}
+
+// declared in nsf.hh
+entry_index::entry_index(res::project &proj) :
+    m_proj(proj)
+{
+    h_asset_appear <<= [this](res::asset &asset) {
+        add(asset);
+    };
+    h_asset_appear.bind(proj.on_asset_appear);
+
+    h_asset_disappear <<= [this](res::asset &asset) {
+        remove(asset);
+    };
+    h_asset_disappear.bind(proj.on_asset_disappear);
+
+    for (auto &&asset : proj.get_asset_list()) {
+        add(*asset);
+    }
+}
+
+// declared in nsf.hh
+void entry_index::add(res::asset &asset)
+{
+    // Find the property which the asset's EID comes from.
+    util::event<> *change;
+    bool stub = false;
+    if (auto ent = dynamic_cast<entry *>(&asset)) {
+        change = &ent->p_eid.on_change;
+    } else if (auto page = dynamic_cast<tpage *>(&asset)) {
+        change = &page->p_data.on_change;
+    } else if (auto raw = dynamic_cast<misc::raw_data *>(&asset)) {
+        change = &raw->p_packed_data.on_change;
+        stub = true;
+    } else {
+        return;
+    }
+
+    auto rec = std::make_unique<record>();
+    rec->stub = stub;
+    read_keys(asset, rec->keys);
+    rec->h_change <<= [this, &asset] {
+        refile(asset);
+    };
+    rec->h_change.bind(*change);
+
+    auto &&map = stub ? m_stubs : m_assets;
+    for (auto &&key : rec->keys) {
+        map.emplace(key, &asset);
+    }
+    m_records.emplace(&asset, std::move(rec));
+}
+
+// declared in nsf.hh
+void entry_index::remove(res::asset &asset)
+{
+    auto it = m_records.find(&asset);
+    if (it == m_records.end())
+        return;
+
+    unfile(asset, *it->second);
+    m_records.erase(it);
+}
+
+// declared in nsf.hh
+void entry_index::unfile(res::asset &asset, record &rec)
+{
+    auto &&map = rec.stub ? m_stubs : m_assets;
+    for (auto &&key : rec.keys) {
+        auto range = map.equal_range(key);
+        for (auto i = range.first; i != range.second; ++i) {
+            if (i->second == &asset) {
+                map.erase(i);
+                break;
+            }
+        }
+    }
+    rec.keys.clear();
+}
+
+// declared in nsf.hh
+void entry_index::refile(res::asset &asset)
+{
+    auto &&rec = *m_records.at(&asset);
+    std::vector<uint32_t> new_keys;
+    read_keys(asset, new_keys);
+    if (new_keys == rec.keys)
+        return;
+
+    unfile(asset, rec);
+    rec.keys = std::move(new_keys);
+
+    auto &&map = rec.stub ? m_stubs : m_assets;
+    for (auto &&key : rec.keys) {
+        map.emplace(key, &asset);
+    }
+}
+
+// declared in nsf.hh
+template <typename T>
+res::ref<T> entry_index::find_as(nsf::eid eid) const
+{
+    for (;;) {
+        auto range = m_assets.equal_range(eid);
+        for (auto i = range.first; i != range.second; ++i) {
+            if (dynamic_cast<T *>(i->second))
+                return i->second->get_name();
+        }
+
+        // The asset may still be in an unprocessed page or pagelet. Processing
+        // it changes the index, so the search starts over afterwards.
+        auto stub = m_stubs.find(eid);
+        if (stub == m_stubs.end())
+            return nullptr;
+
+        auto stub_asset = stub->second;
+        res::ref<T> ref = stub_asset->get_name();
+        if (ref.demand())
+            return ref;
+
+        // The stub may have been processed into something else, such as a
+        // standard page whose pagelets are now stubs of their own.
+
+        // Give up if the stub could not be processed, rather than trying it
+        // again.
+        range = m_stubs.equal_range(eid);
+        for (auto i = range.first; i != range.second; ++i) {
+            if (i->second == stub_asset)
+                return nullptr;
+        }
+    }
+}
+
+// declared in nsf.hh
+res::anyref entry_index::find(nsf::eid eid) const
+{
+    // Every asset in m_assets is either an entry or a texture page. These are
+    // looked up by type, so that a stub is not mistaken for its result.
+    auto ent = find_entry(eid);
+    if (ent)
+        return ent;
+
+    return find_tpage(eid);
+}
+
+// declared in nsf.hh
+entry::ref entry_index::find_entry(nsf::eid eid) const
+{
+    return find_as<entry>(eid);
+}
+
+// declared in nsf.hh
+tpage::ref entry_index::find_tpage(nsf::eid eid) const
+{
+    return find_as<tpage>(eid);
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(nsf_entry_index, FindEntry)
+{
+    res::project proj;
+    auto &&nx = proj.get_transact();
+
+    raw_entry::ref a = proj.get_asset_root() / "a";
+    raw_entry::ref b = proj.get_asset_root() / "b";
+    nx.run([&](TRANSACT) {
+        a.create(TS, proj);
+        a->set_eid(TS, 100);
+    });
+
+    // Entries which exist before the index is created are included.
+    entry_index index(proj);
+    EXPECT_EQ(index.find_entry(100), a);
+    EXPECT_EQ(index.find_entry(200), nullptr);
+
+    nx.run([&](TRANSACT) {
+        b.create(TS, proj);
+        b->set_eid(TS, 200);
+    });
+    EXPECT_EQ(index.find_entry(200), b);
+
+    // Changing an entry's EID moves it in the index.
+    nx.run([&](TRANSACT) {
+        a->set_eid(TS, 300);
+    });
+    EXPECT_EQ(index.find_entry(100), nullptr);
+    EXPECT_EQ(index.find_entry(300), a);
+
+    // Renamed entries are found under their new name.
+    raw_entry::ref c = proj.get_asset_root() / "c";
+    nx.run([&](TRANSACT) {
+        b->rename(TS, c);
+    });
+    EXPECT_EQ(index.find_entry(200), c);
+
+    nx.run([&](TRANSACT) {
+        c->destroy(TS);
+    });
+    EXPECT_EQ(index.find_entry(200), nullptr);
+
+    // Undo and redo are reflected in the index.
+    nx.undo();
+    EXPECT_EQ(index.find_entry(200), c);
+    nx.undo();
+    nx.undo();
+    EXPECT_EQ(index.find_entry(100), a);
+    EXPECT_EQ(index.find_entry(300), nullptr);
+    nx.redo();
+    EXPECT_EQ(index.find_entry(300), a);
+}
+
+TEST(nsf_entry_index, FindTpage)
+{
+    res::project proj;
+    auto &&nx = proj.get_transact();
+
+    // Returns the data of a texture page with the given EID.
+    auto make_page = [](uint32_t eid) {
+        util::blob data(page_size);
+        data[0] = 0x34;
+        data[1] = 0x12;
+        data[2] = 1;
+        data[4] = eid;
+        data[5] = eid >> 8;
+        data[6] = eid >> 16;
+        data[7] = eid >> 24;
+        return util::slice(std::move(data));
+    };
+
+    entry_index index(proj);
+
+    // Texture pages are found by the EID in their header, once they have one.
+    tpage::ref t = proj.get_asset_root() / "t";
+    nx.run([&](TRANSACT) {
+        t.create(TS, proj);
+    });
+    EXPECT_EQ(index.find(0), nullptr);
+    nx.run([&](TRANSACT) {
+        t->import_file(TS, make_page(100));
+    });
+    EXPECT_EQ(index.find_tpage(100), t);
+    EXPECT_EQ(index.find(100), t);
+    EXPECT_EQ(index.find_entry(100), nullptr);
+
+    // Entries and texture pages with the same EID are told apart by type.
+    raw_entry::ref e = proj.get_asset_root() / "e";
+    nx.run([&](TRANSACT) {
+        e.create(TS, proj);
+        e->set_eid(TS, 100);
+    });
+    EXPECT_EQ(index.find_tpage(100), t);
+    EXPECT_EQ(index.find_entry(100), e);
+
+    // Replacing a texture page's data moves it to its new EID.
+    nx.run([&](TRANSACT) {
+        t->import_file(TS, make_page(200));
+    });
+    EXPECT_EQ(index.find_tpage(100), nullptr);
+    EXPECT_EQ(index.find_tpage(200), t);
+    nx.undo();
+    EXPECT_EQ(index.find_tpage(100), t);
+    EXPECT_EQ(index.find_tpage(200), nullptr);
+
+    // The tpag refs of a wgeo_v2 entry are resolved to texture pages.
+    wgeo_v2::ref w = proj.get_asset_root() / "w";
+    nx.run([&](TRANSACT) {
+        w.create(TS, proj);
+        w->set_tpag_ref_count(TS, 2);
+        w->set_tpag_ref0(TS, 100);
+        w->set_tpag_ref1(TS, 300);
+    });
+    auto tpages = w->get_tpages(index);
+    ASSERT_EQ(tpages.size(), 2u);
+    EXPECT_EQ(tpages[0], t);
+    EXPECT_EQ(tpages[1], nullptr);
+
+    nx.run([&](TRANSACT) {
+        t->destroy(TS);
+    });
+    EXPECT_EQ(index.find_tpage(100), nullptr);
+    EXPECT_EQ(w->get_tpages(index)[0], nullptr);
+}
+
+TEST(nsf_entry_index, FindStub)
+{
+    // An NSF with a standard page holding one entry, and a texture page.
+    util::blob ent(entry::calc_file_size({}));
+    entry::write_file(ent.data(), 500, 99, {});
+
+    util::blob data;
+    {
+        res::project scratch;
+        spage::ref page = scratch.get_asset_root() / "page";
+        scratch.get_transact().run([&](TRANSACT) {
+            page.create(TS, scratch);
+            page->import_parsed(TS, {0, 1, 0, {util::slice(ent)}});
+        });
+        page->export_file(data);
+    }
+    data.resize(page_size * 2);
+    data[page_size + 0] = 0x34;
+    data[page_size + 1] = 0x12;
+    data[page_size + 2] = 1;
+    data[page_size + 4] = 600 & 0xFF;
+    data[page_size + 5] = 600 >> 8;
+    util::slice nsf_data = std::move(data);
+
+    // Import the NSF without processing it, as a lazy import does.
+    res::project proj;
+    proj.set_demand_handler([](TRANSACT, res::asset &asset) {
+        return archive::process_on_demand(
+            TS,
+            asset,
+            game_ver::crash2,
+            nullptr
+        );
+    });
+    auto import = [&](res::atom name) {
+        archive::ref nsfile = name;
+        proj.get_transact().run([&](TRANSACT) {
+            nsfile.create(TS, proj);
+            nsfile->import_file(TS, nsf_data);
+        });
+        return nsfile;
+    };
+
+    auto nsfile = import(proj.get_asset_root() / "nsfile");
+    entry_index index(proj);
+
+    // Looking up the EIDs processes the pages and pagelets holding them.
+    auto page0 = nsfile->get_pages()[0];
+    auto page1 = nsfile->get_pages()[1];
+    EXPECT_EQ(index.find_tpage(600), page1);
+    EXPECT_TRUE(page1.is_a<tpage>());
+    EXPECT_EQ(index.find_tpage(500), nullptr);
+    EXPECT_EQ(index.find(500), page0 / "pagelet-0");
+    EXPECT_TRUE(page0.is_a<spage>());
+    EXPECT_EQ(index.find_entry(700), nullptr);
+
+    // Demanding an entry by name processes the page above it first.
+    auto other = import(proj.get_asset_root() / "other");
+    entry::ref other_ent = other->get_pages()[0] / "pagelet-0";
+    EXPECT_EQ(other_ent.get(), nullptr);
+    EXPECT_NE(other_ent.demand(), nullptr);
+    EXPECT_EQ(other_ent->get_eid(), 500u);
+}
 
-    return data;
 }
+#endif
 
 }
 }
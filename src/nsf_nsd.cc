@@ -0,0 +1,353 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include "nsf.hh"
+
+namespace drnsf {
+namespace nsf {
+
+namespace {
+
+// (s-var) level_header_size
+// The size of the data between the lookup table header and the links.
+constexpr std::size_t level_header_size = 0x118;
+
+// (s-func) read_eid
+// Returns the EID of the given entry or texture page data, which is stored in
+// bytes 4 to 7 of both. Throws res::import_error if the data is too small.
+nsf::eid read_eid(const util::slice &data)
+{
+    util::span_reader r(data);
+    if (r.remaining() < 8)
+        throw res::import_error("nsf::nsd: entry too small");
+
+    r.require(8);
+    r.discard(4);
+    return r.read_u32();
+}
+
+}
+
+// declared in nsf.hh
+const nsd::lookup_cache &nsd::get_lookup() const
+{
+    if (m_lookup.revision == get_revision())
+        return m_lookup;
+
+    auto &&links = m_lookup.links;
+    links = get_links();
+    std::stable_sort(links.begin(), links.end(),
+        [](const link &lhs, const link &rhs) {
+            return hash_eid(lhs.eid) < hash_eid(rhs.eid);
+        }
+    );
+
+    // Find the first link in each bucket. Empty buckets start where the next
+    // non-empty bucket does.
+    std::size_t i = 0;
+    for (int bucket = 0; bucket < bucket_count; bucket++) {
+        while (i < links.size() && hash_eid(links[i].eid) < bucket) {
+            i++;
+        }
+        m_lookup.bucket_starts[bucket] = i;
+    }
+    m_lookup.bucket_starts[bucket_count] = links.size();
+
+    m_lookup.revision = get_revision();
+    return m_lookup;
+}
+
+// declared in nsf.hh
+void nsd::import_file(TRANSACT, util::slice data)
+{
+    assert_alive();
+
+    util::span_reader r(data);
+
+    // Read the lookup table header. The bucket table is not kept, as it is
+    // regenerated from the links on export.
+    if (r.remaining() < bucket_count * 4 + 8 + level_header_size)
+        throw res::import_error("nsf::nsd: header too small");
+
+    r.require(bucket_count * 4 + 8 + level_header_size);
+    r.discard(bucket_count * 4);
+    auto page_count = r.read_u32();
+    auto link_count = r.read_u32();
+    auto level_header = data.sub(bucket_count * 4 + 8, level_header_size);
+    r.discard(level_header_size);
+
+    // Ensure the links fit within the file.
+    if (link_count > r.remaining() / 8)
+        throw res::import_error("nsf::nsd: too many links");
+
+    // Read the links.
+    std::vector<link> links(link_count);
+    r.require(link_count * 8);
+    for (auto &&link : links) {
+        link.page_id = r.read_u32();
+        link.eid = r.read_u32();
+    }
+
+    // The rest of the file is kept as-is, sharing the original data.
+    auto level_data = data.sub(data.size() - r.remaining(), r.remaining());
+
+    set_page_count(TS, page_count);
+    set_links(TS, std::move(links));
+    set_level_header(TS, std::move(level_header));
+    set_level_data(TS, std::move(level_data));
+}
+
+// declared in nsf.hh
+util::blob nsd::export_file() const
+{
+    assert_alive();
+
+    auto &&lookup = get_lookup();
+
+    if (get_level_header().size() != level_header_size)
+        throw res::export_error("nsf::nsd: bad level header size");
+
+    util::binwriter w;
+    w.begin();
+
+    // Write the lookup table header.
+    for (int bucket = 0; bucket < bucket_count; bucket++) {
+        w.write_u32(lookup.bucket_starts[bucket]);
+    }
+    w.write_u32(get_page_count());
+    w.write_u32(lookup.links.size());
+
+    auto data = w.end();
+    data.reserve(
+        data.size() +
+        level_header_size +
+        lookup.links.size() * 8 +
+        get_level_data().size()
+    );
+
+    data.insert(
+        data.end(),
+        get_level_header().begin(),
+        get_level_header().end()
+    );
+
+    // Write the links, in bucket order.
+    w.begin();
+    for (auto &&link : lookup.links) {
+        w.write_u32(link.page_id);
+        w.write_u32(link.eid);
+    }
+    auto links_data = w.end();
+    data.insert(data.end(), links_data.begin(), links_data.end());
+
+    data.insert(
+        data.end(),
+        get_level_data().begin(),
+        get_level_data().end()
+    );
+
+    return data;
+}
+
+// declared in nsf.hh
+void nsd::rebuild(TRANSACT, const archive &nsf_archive)
+{
+    assert_alive();
+
+    auto &&pages = nsf_archive.get_pages();
+
+    std::vector<link> links;
+    for (auto &&i : util::range_of(pages)) {
+        auto &&ref = pages[i];
+        auto page_id = page_index_to_id(i);
+
+        misc::raw_data::ref raw_ref = ref;
+        if (raw_ref.ok()) {
+            auto &&data = raw_ref->get_data();
+
+            // Pages with type 1 are texture pages, which have a single EID.
+            if (data.size() >= 4 && data[2] == 1) {
+                links.push_back({page_id, read_eid(data)});
+                continue;
+            }
+
+            for (auto &&pagelet : spage::parse(data).pagelets) {
+                links.push_back({page_id, read_eid(pagelet)});
+            }
+            continue;
+        }
+
+        spage::ref spage_ref = ref;
+        if (spage_ref.ok()) {
+            for (auto &&pagelet_ref : spage_ref->get_pagelets()) {
+                entry::ref entry_ref = pagelet_ref;
+                if (entry_ref.ok()) {
+                    links.push_back({page_id, entry_ref->get_eid()});
+                    continue;
+                }
+
+                misc::raw_data::ref raw_pagelet_ref = pagelet_ref;
+                if (raw_pagelet_ref.ok()) {
+                    links.push_back({
+                        page_id,
+                        read_eid(raw_pagelet_ref->get_data())
+                    });
+                    continue;
+                }
+
+                throw res::export_error(
+                    "nsf::nsd: pagelet has incompatible type"
+                );
+            }
+            continue;
+        }
+
+        tpage::ref tpage_ref = ref;
+        if (tpage_ref.ok()) {
+            links.push_back({page_id, tpage_ref->get_eid()});
+            continue;
+        }
+
+        throw res::export_error("nsf::nsd: page has incompatible type");
+    }
+
+    set_page_count(TS, pages.size());
+    set_links(TS, std::move(links));
+}
+
+// declared in nsf.hh
+long nsd::find_page(nsf::eid eid) const
+{
+    assert_alive();
+
+    auto &&lookup = get_lookup();
+    auto bucket = hash_eid(eid);
+    auto begin = lookup.bucket_starts[bucket];
+    auto end = lookup.bucket_starts[bucket + 1];
+    for (auto i = begin; i < end; i++) {
+        if (lookup.links[i].eid == eid) {
+            return page_id_to_index(lookup.links[i].page_id);
+        }
+    }
+    return -1;
+}
+
+// declared in nsf.hh
+util::slice nsd::locate_entry(
+    const util::slice &nsf_data,
+    nsf::eid eid) const
+{
+    auto page_index = find_page(eid);
+    if (page_index == -1)
+        return {};
+
+    // Ensure the page is within the NSF file.
+    if (std::size_t(page_index) >= nsf_data.size() / page_size)
+        throw res::import_error("nsf::nsd: page not in NSF file");
+
+    auto page = nsf_data.sub(page_index * page_size, page_size);
+
+    // Pages with type 1 are texture pages, which have a single EID.
+    if (page[2] == 1)
+        return read_eid(page) == eid ? page : util::slice();
+
+    for (auto &&pagelet : spage::parse(page).pagelets) {
+        if (read_eid(pagelet) == eid) {
+            return pagelet;
+        }
+    }
+    return {};
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(nsf_nsd, RoundTrip)
+{
+    // Build an NSD file with links given out of bucket order.
+    std::vector<nsd::link> links = {
+        {1, 0x00050001},
+        {3, 0x7F808001},
+        {3, 0x00000001},
+        {5, 0x00010001},
+        {7, 0x00018001}
+    };
+
+    res::project proj;
+    nsd::ref a = proj.get_asset_root() / "a";
+    nsd::ref b = proj.get_asset_root() / "b";
+    proj.get_transact().run([&](TRANSACT) {
+        a.create(TS, proj);
+        a->set_page_count(TS, 4);
+        a->set_links(TS, links);
+        a->set_level_header(TS, util::blob(0x118, 0xAA));
+        a->set_level_data(TS, util::blob{1, 2, 3});
+    });
+
+    auto data = a->export_file();
+    ASSERT_EQ(data.size(), 0x520u + links.size() * 8 + 3);
+
+    // The bucket table should give the first link of each bucket.
+    auto read_u32 = [&](std::size_t offset) {
+        return data[offset] |
+            data[offset + 1] << 8 |
+            data[offset + 2] << 16 |
+            uint32_t(data[offset + 3]) << 24;
+    };
+    EXPECT_EQ(read_u32(0 * 4), 0u);
+    EXPECT_EQ(read_u32(1 * 4), 1u);
+    EXPECT_EQ(read_u32(2 * 4), 2u);
+    EXPECT_EQ(read_u32(3 * 4), 3u);
+    EXPECT_EQ(read_u32(4 * 4), 4u);
+    EXPECT_EQ(read_u32(10 * 4), 4u);
+    EXPECT_EQ(read_u32(11 * 4), 5u);
+    EXPECT_EQ(read_u32(255 * 4), 5u);
+    EXPECT_EQ(read_u32(0x400), 4u);
+    EXPECT_EQ(read_u32(0x404), links.size());
+    EXPECT_EQ(read_u32(0x520 + 8 * 0 + 4), 0x00000001u);
+    EXPECT_EQ(read_u32(0x520 + 8 * 1 + 4), 0x7F808001u);
+    EXPECT_EQ(read_u32(0x520 + 8 * 4 + 4), 0x00050001u);
+
+    // Re-importing the file and exporting it again should give the same data.
+    proj.get_transact().run([&](TRANSACT) {
+        b.create(TS, proj);
+        b->import_file(TS, data);
+    });
+    EXPECT_EQ(b->export_file(), data);
+
+    EXPECT_EQ(b->find_page(0x00050001), 0);
+    EXPECT_EQ(b->find_page(0x7F808001), 1);
+    EXPECT_EQ(b->find_page(0x00018001), 3);
+    EXPECT_EQ(b->find_page(0x00020001), -1);
+
+    // Truncated files are rejected.
+    util::blob truncated(data.begin(), data.end() - 12);
+    proj.get_transact().run([&](TRANSACT) {
+        EXPECT_THROW(b->import_file(TS, truncated), res::import_error);
+    });
+}
+
+}
+#endif
+
+}
+}
@@ -0,0 +1,493 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <thread>
+#include "fs.hh"
+#include "nsf.hh"
+
+namespace drnsf {
+namespace nsf {
+
+namespace {
+
+// (s-var) file_magic
+// The magic number at the start of every cache file ("DRPC").
+constexpr uint32_t file_magic = 0x43505244;
+
+// (s-var) file_header_size
+// The size of the fixed part of the header at the start of every cache file,
+// which holds the magic number, the format version, the key's two hashes and
+// its item count. The size of each item follows.
+constexpr size_t file_header_size = 28;
+
+// (s-var) stale_temp_age
+// The age after which a temporary file left in the directory is assumed to
+// belong to a `store' which never finished (for example, because its process
+// was killed), and is removed by `trim'.
+constexpr std::chrono::hours stale_temp_age{1};
+
+// (s-var) s_temp_counter
+// Counter used to give each temporary file written by `store' a unique name.
+std::atomic<unsigned> s_temp_counter{0};
+
+// (s-func) key_to_name
+// Returns the name of the cache file for the given key.
+std::string key_to_name(uint64_t key)
+{
+    char name[32];
+    std::snprintf(
+        name,
+        sizeof(name),
+        "%016llx.bin",
+        static_cast<unsigned long long>(key)
+    );
+    return name;
+}
+
+// (s-func) fnv1a64
+// Continues the 64-bit FNV-1a hash `hash' over the given bytes. This is used
+// for the check hash of a key, as it shares nothing with util::hash64.
+uint64_t fnv1a64(uint64_t hash, const util::byte *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+// (s-func) make_header
+// Returns the header of the cache file for the given key.
+util::blob make_header(const process_cache::key &k)
+{
+    util::binwriter w;
+    w.begin();
+    w.write_u32(file_magic);
+    w.write_u32(process_cache::format_version);
+    w.write_u32(k.hash);
+    w.write_u32(k.hash >> 32);
+    w.write_u32(k.check);
+    w.write_u32(k.check >> 32);
+    w.write_u32(k.item_sizes.size());
+    for (auto &&item_size : k.item_sizes) {
+        w.write_u32(item_size);
+    }
+    return w.end();
+}
+
+// (s-func) get_env
+// Returns the value of the given environment variable, or an empty string if
+// it is not set.
+std::string get_env(const char *name)
+{
+#ifdef _WIN32
+    auto value = _wgetenv(util::u8str_to_wstr(name).c_str());
+    return value ? util::wstr_to_u8str(value) : std::string();
+#else
+    auto value = std::getenv(name);
+    return value ? std::string(value) : std::string();
+#endif
+}
+
+}
+
+// declared in nsf.hh
+std::string process_cache::default_dir()
+{
+    // The cache is kept in the user's own cache directory, never in a shared
+    // temporary directory where other users could read or replace its files.
+    // The paths are UTF-8, as are those given to and returned by this class.
+    fs::path base;
+#ifdef _WIN32
+    base = fs::u8path(get_env("LOCALAPPDATA"));
+#else
+    base = fs::u8path(get_env("XDG_CACHE_HOME"));
+    if (!base.is_absolute()) {
+        base = fs::u8path(get_env("HOME"));
+        if (base.is_absolute()) {
+            base /= ".cache";
+        }
+    }
+#endif
+    if (!base.is_absolute())
+        return {};
+
+    return (base / "drnsf" / "cache").u8string();
+}
+
+// declared in nsf.hh
+process_cache::process_cache(std::string dir) :
+    m_dir(std::move(dir)),
+    m_ok(false)
+{
+    std::error_code ec;
+    if (m_dir.empty())
+        return;
+
+    auto path = fs::u8path(m_dir);
+    if (fs::create_directories(path, ec)) {
+        // Only the owner may use a newly created directory.
+        fs::permissions(path, fs::perms::owner_all, ec);
+    }
+    m_ok = fs::is_directory(path, ec);
+}
+
+// declared in nsf.hh
+process_cache::key process_cache::make_key(
+    game_ver ver,
+    uint32_t type,
+    const std::vector<util::slice> &items)
+{
+    key result;
+
+    // The items are hashed individually, and then the hashes are hashed along
+    // with the other parameters, so that the items never need to be copied
+    // together into one buffer.
+    util::binwriter w;
+    w.begin();
+    w.write_u32(format_version);
+    w.write_u32(static_cast<uint32_t>(ver));
+    w.write_u32(type);
+    w.write_u32(items.size());
+    for (auto &&item : items) {
+        auto hash = util::hash64(item.data(), item.size());
+        w.write_u32(item.size());
+        w.write_u32(hash);
+        w.write_u32(hash >> 32);
+        result.item_sizes.push_back(item.size());
+    }
+    auto data = w.end();
+    result.hash = util::hash64(data.data(), data.size());
+
+    // The check hash covers the same parameters (the first 16 bytes written
+    // above) and the items' bytes themselves, through a different function.
+    result.check = fnv1a64(0xCBF29CE484222325ull, data.data(), 16);
+    for (auto &&item : items) {
+        result.check = fnv1a64(result.check, item.data(), item.size());
+    }
+    return result;
+}
+
+// declared in nsf.hh
+util::slice process_cache::load(const key &k) const
+{
+    if (!m_ok)
+        return {};
+
+    auto path = fs::u8path(m_dir) / key_to_name(k.hash);
+
+    std::error_code ec;
+    if (!fs::is_regular_file(path, ec))
+        return {};
+
+    util::slice data;
+    try {
+        data = util::map_file(path.u8string());
+    } catch (std::runtime_error &) {
+        return {};
+    }
+
+    // Ensure the file was written for this key by this format version. Any
+    // other file, including one written for another key with the same hash,
+    // is ignored, and will be replaced by the next `store'.
+    auto header = make_header(k);
+    if (data.size() < header.size())
+        return {};
+
+    if (!std::equal(header.begin(), header.end(), data.begin()))
+        return {};
+
+    // Mark the file as recently used, so that `trim' removes it only after the
+    // files which have not been used for longer.
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+
+    return data.sub(header.size(), data.size() - header.size());
+}
+
+// declared in nsf.hh
+void process_cache::store(const key &k, const util::slice &data) const
+{
+    if (!m_ok)
+        return;
+
+    auto dir = fs::u8path(m_dir);
+    auto name = key_to_name(k.hash);
+
+    // Write the file under a name unique to this call, so that other threads
+    // or processes storing the same key cannot interfere with it.
+    auto temp_name = "$.$.$.tmp"_fmt(
+        name,
+        std::hash<std::thread::id>()(std::this_thread::get_id()),
+        s_temp_counter++
+    );
+    auto temp_path = dir / temp_name;
+
+    auto header = make_header(k);
+
+    bool ok;
+    {
+        auto f = util::fstream_open_bin(
+            temp_path.u8string(),
+            std::fstream::out
+        );
+        f.write(reinterpret_cast<const char *>(header.data()), header.size());
+        f.write(reinterpret_cast<const char *>(data.data()), data.size());
+        f.close();
+        ok = !f.fail();
+    }
+
+    // Move the finished file into place, replacing any older file which may
+    // still be mapped by `load'. If this fails, the temporary file is removed
+    // and the data is simply not cached.
+    if (ok) {
+        try {
+            util::replace_file(temp_path.u8string(), (dir / name).u8string());
+        } catch (std::runtime_error &) {
+            ok = false;
+        }
+    }
+    if (!ok) {
+        std::error_code ec;
+        fs::remove(temp_path, ec);
+    }
+}
+
+// declared in nsf.hh
+void process_cache::trim(
+    uintmax_t max_size,
+    std::chrono::hours max_age) const
+{
+    if (!m_ok)
+        return;
+
+    struct file_info {
+        fs::path path;
+        uintmax_t size;
+        fs::file_time_type time;
+    };
+
+    auto now = fs::file_time_type::clock::now();
+    std::vector<file_info> files;
+    uintmax_t total_size = 0;
+
+    // Any file which cannot be examined or removed is skipped; it may be in
+    // use by another process, and will be tried again by the next `trim'.
+    std::error_code ec;
+    fs::directory_iterator it(fs::u8path(m_dir), ec);
+    for (; !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        auto path = it->path();
+        auto ext = path.extension();
+        if (ext != ".bin" && ext != ".tmp")
+            continue;
+
+        std::error_code file_ec;
+        if (!fs::is_regular_file(it->status(file_ec)))
+            continue;
+
+        auto time = fs::last_write_time(path, file_ec);
+        if (file_ec)
+            continue;
+
+        auto size = fs::file_size(path, file_ec);
+        if (file_ec)
+            continue;
+
+        if (ext == ".tmp") {
+            if (now - time > stale_temp_age) {
+                fs::remove(path, file_ec);
+            }
+            continue;
+        }
+
+        if (now - time > max_age) {
+            fs::remove(path, file_ec);
+            continue;
+        }
+
+        files.push_back({std::move(path), size, time});
+        total_size += size;
+    }
+
+    if (total_size <= max_size)
+        return;
+
+    // Remove the least recently used files until the rest fit within the size
+    // limit (`load' marks each file it uses as recently written).
+    std::sort(
+        files.begin(),
+        files.end(),
+        [](const file_info &a, const file_info &b) {
+            return a.time < b.time;
+        }
+    );
+    for (auto &&file : files) {
+        if (total_size <= max_size)
+            break;
+
+        std::error_code file_ec;
+        if (fs::remove(file.path, file_ec)) {
+            total_size -= file.size;
+        }
+    }
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-func) test_key
+// Returns a key with the given hash, for tests which do not need real keys.
+process_cache::key test_key(uint64_t hash)
+{
+    return {hash, ~hash, {}};
+}
+
+TEST(nsf_process_cache, LoadStore)
+{
+    auto dir = fs::temp_directory_path() / "drnsf-test-process-cache";
+    fs::remove_all(dir);
+
+    process_cache cache(dir.u8string());
+    ASSERT_TRUE(cache.is_ok());
+
+    util::blob item0 = {1, 2, 3, 4};
+    util::blob item1 = {5, 6, 7};
+    std::vector<util::slice> items = {item0, item1};
+
+    auto key = process_cache::make_key(game_ver::crash2, 3, items);
+
+    // Both hashes must depend on every parameter and on the item boundaries.
+    util::blob joined = {1, 2, 3, 4, 5, 6, 7};
+    process_cache::key others[] = {
+        process_cache::make_key(game_ver::crash3, 3, items),
+        process_cache::make_key(game_ver::crash2, 4, items),
+        process_cache::make_key(game_ver::crash2, 3, {joined})
+    };
+    for (auto &&other : others) {
+        EXPECT_NE(key.hash, other.hash);
+        EXPECT_NE(key.check, other.check);
+    }
+    EXPECT_EQ(key.item_sizes, (std::vector<uint32_t>{4, 3}));
+
+    EXPECT_EQ(cache.load(key).size(), 0u);
+
+    util::blob data = {9, 8, 7, 6, 5};
+    cache.store(key, data);
+    EXPECT_EQ(cache.load(key), data);
+
+    // Storing again replaces the existing file.
+    util::blob data2 = {1};
+    cache.store(key, data2);
+    EXPECT_EQ(cache.load(key), data2);
+
+    // A key whose hash collides with this one does not get its data.
+    auto collision = key;
+    collision.check++;
+    EXPECT_EQ(cache.load(collision).size(), 0u);
+    collision = key;
+    collision.item_sizes = {3, 4};
+    EXPECT_EQ(cache.load(collision).size(), 0u);
+    EXPECT_EQ(cache.load(key), data2);
+
+    collision = key;
+    collision.hash++;
+    EXPECT_EQ(cache.load(collision).size(), 0u);
+
+    fs::remove_all(dir);
+}
+
+TEST(nsf_process_cache, Trim)
+{
+    auto dir = fs::temp_directory_path() / "drnsf-test-process-cache-trim";
+    fs::remove_all(dir);
+
+    process_cache cache(dir.u8string());
+    ASSERT_TRUE(cache.is_ok());
+
+    util::blob data(100, 0x55);
+    for (uint64_t key = 0; key < 4; key++) {
+        cache.store(test_key(key), data);
+    }
+
+    // Give each file a different time of last use, with key 3 last used long
+    // ago and key 0 the least recently used of the others.
+    auto now = fs::file_time_type::clock::now();
+    for (uint64_t key = 0; key < 4; key++) {
+        fs::last_write_time(
+            dir / key_to_name(key),
+            now - std::chrono::minutes(10 - key)
+        );
+    }
+    fs::last_write_time(dir / key_to_name(3), now - std::chrono::hours(2));
+
+    // Using a file makes it the most recently used.
+    EXPECT_EQ(cache.load(test_key(0)), data);
+
+    // A temporary file left by an unfinished store is removed once stale.
+    auto stale_temp = dir / "stale.tmp";
+    auto fresh_temp = dir / "fresh.tmp";
+    util::fstream_open_bin(stale_temp.u8string(), std::fstream::out).put(1);
+    util::fstream_open_bin(fresh_temp.u8string(), std::fstream::out).put(1);
+    fs::last_write_time(stale_temp, now - std::chrono::hours(2));
+
+    // Files older than the age limit are removed, regardless of the size.
+    cache.trim(UINTMAX_MAX, std::chrono::hours(1));
+    EXPECT_FALSE(fs::exists(stale_temp));
+    EXPECT_TRUE(fs::exists(fresh_temp));
+    EXPECT_EQ(cache.load(test_key(3)).size(), 0u);
+    EXPECT_EQ(cache.load(test_key(2)), data);
+
+    // Loading key 2 above made key 1 the least recently used; it must be the
+    // first to be removed to fit the size limit.
+    cache.trim(2 * (data.size() + file_header_size), std::chrono::hours(1));
+    EXPECT_EQ(cache.load(test_key(1)).size(), 0u);
+    EXPECT_EQ(cache.load(test_key(0)), data);
+    EXPECT_EQ(cache.load(test_key(2)), data);
+
+    cache.trim(0, std::chrono::hours(1));
+    EXPECT_EQ(cache.load(test_key(0)).size(), 0u);
+    EXPECT_EQ(cache.load(test_key(2)).size(), 0u);
+    EXPECT_TRUE(fs::exists(fresh_temp));
+
+    fs::remove_all(dir);
+}
+
+TEST(nsf_process_cache, NoDirectory)
+{
+    // An empty path disables the cache, as when there is no cache directory.
+    process_cache cache("");
+    EXPECT_FALSE(cache.is_ok());
+
+    util::blob data = {1, 2, 3};
+    cache.store(test_key(1), data);
+    EXPECT_EQ(cache.load(test_key(1)).size(), 0u);
+}
+
+}
+#endif
+
+}
+}
@@ -24,15 +24,17 @@
 namespace drnsf {
 namespace nsf {
 
-// declared in res.hh
-void raw_entry::import_file(TRANSACT, const util::blob &data)
+// declared in nsf.hh
+raw_entry::parse_result raw_entry::parse(const util::slice &data)
 {
-    assert_alive();
+    util::span_reader r(data);
 
-    util::binreader r;
-    r.begin(data);
+    // Ensure the entry is large enough for the header.
+    if (r.remaining() < 16)
+        throw res::import_error("nsf::raw_entry: too small for header");
 
     // Read the entry header.
+    r.require(16);
     auto magic      = r.read_u32();
     auto eid        = r.read_u32();
     auto type       = r.read_u32();
@@ -42,15 +44,20 @@ void raw_entry::import_file(TRANSACT, const util::blob &data)
     if (magic != 0x100FFFF)
         throw res::import_error("nsf::raw_entry: bad magic number");
 
+    // Ensure the item offsets fit within the entry.
+    if (item_count >= r.remaining() / 4)
+        throw res::import_error("nsf::raw_entry: too many items");
+
     // Read the item offsets.
     std::vector<uint32_t> item_offsets(item_count + 1);
+    r.require(item_offsets.size() * 4);
     for (auto &&item_offset : item_offsets) {
         item_offset = r.read_u32();
     }
-    r.end_early();
 
-    // Copy the data for each item.
-    std::vector<util::blob> items(item_count);
+    // Extract the data for each item. The items share the entry's data
+    // rather than copying it.
+    std::vector<util::slice> items(item_count);
     for (auto &&i : util::range_of(items)) {
         auto &&item_start_offset = item_offsets[i];
         auto &&item_end_offset = item_offsets[i + 1];
@@ -70,20 +77,39 @@ void raw_entry::import_file(TRANSACT, const util::blob &data)
             throw res::import_error("nsf::raw_entry: negative item size");
 
         // Extract the item's data.
-        items[i] = {
-            data.data() + item_start_offset,
-            data.data() + item_end_offset
-        };
+        items[i] = data.sub(
+            item_start_offset,
+            item_end_offset - item_start_offset
+        );
+    }
+
+    return {eid, type, std::move(items)};
+}
+
+// declared in nsf.hh
+void raw_entry::import_parsed(TRANSACT, parse_result data)
+{
+    assert_alive();
+
+    // Share the storage of any identical item data already in the project.
+    auto &&store = get_proj().get_blob_store();
+    for (auto &&item : data.items) {
+        item = store.intern(std::move(item));
     }
 
-    // Finish importing.
-    set_eid(TS, eid);
-    set_type(TS, type);
-    set_items(TS, std::move(items));
+    set_eid(TS, data.eid);
+    set_type(TS, data.type);
+    set_items(TS, std::move(data.items));
 }
 
 // declared in nsf.hh
-std::vector<util::blob> raw_entry::export_entry(uint32_t &out_type) const
+void raw_entry::import_file(TRANSACT, const util::slice &data)
+{
+    import_parsed(TS, parse(data));
+}
+
+// declared in nsf.hh
+std::vector<util::slice> raw_entry::export_entry(uint32_t &out_type) const
 {
     assert_alive();
 
@@ -91,26 +117,96 @@ std::vector<util::blob> raw_entry::export_entry(uint32_t &out_type) const
     return get_items();
 }
 
-// declared in res.hh
-bool raw_entry::process_by_type(TRANSACT, game_ver ver)
+namespace {
+
+// (s-func) parse_cached<T>
+// Parses the given items as an entry of type T, as T::parse would. If a cache
+// is given, the result is loaded from it under `key' when present, and is
+// otherwise stored into it after parsing (see nsf::process_cache).
+template <typename T>
+typename T::parse_result parse_cached(
+    const std::vector<util::slice> &items,
+    const process_cache *cache,
+    const process_cache::key &key)
 {
-    assert_alive();
+    if (!cache)
+        return T::parse(items);
+
+    auto saved = cache->load(key);
+    if (!saved.empty()) {
+        try {
+            return T::load_parsed(saved, items);
+        } catch (res::import_error &) {
+            // The cached data is unusable, so treat this as a cache miss. The
+            // file is replaced below.
+        }
+    }
+
+    auto result = T::parse(items);
+    cache->store(key, T::save_parsed(result));
+    return result;
+}
+
+// (s-func) prepare_as<T>
+// Parses the given items as an entry of type T, and returns a processor which
+// replaces a raw entry with the resulting entry (see raw_entry::process_as).
+template <typename T>
+raw_entry::processor prepare_as(
+    const std::vector<util::slice> &items,
+    const process_cache *cache,
+    const process_cache::key &key)
+{
+    auto data = parse_cached<T>(items, cache, key);
+    return [data = std::move(data)](TRANSACT, raw_entry &entry) mutable {
+        entry.process_as<T>(TS, std::move(data));
+    };
+}
+
+}
+
+// declared in nsf.hh
+raw_entry::processor raw_entry::prepare_by_type(
+    game_ver ver,
+    uint32_t type,
+    const std::vector<util::slice> &items,
+    const process_cache *cache)
+{
+    // The key is only needed if there is a cache to look it up in.
+    process_cache::key key = {};
+    if (cache) {
+        key = process_cache::make_key(ver, type, items);
+    }
 
     switch (ver) {
     case game_ver::crash1:
         break;
     case game_ver::crash2:
-        switch (get_type()) {
+        switch (type) {
         case 3:
-            process_as<wgeo_v2>(TS);
-            return true;
+            return prepare_as<wgeo_v2>(items, cache, key);
         }
         break;
     case game_ver::crash3:
         break;
     }
 
-    return false;
+    return nullptr;
+}
+
+// declared in nsf.hh
+bool raw_entry::process_by_type(
+    TRANSACT,
+    game_ver ver,
+    const process_cache *cache)
+{
+    assert_alive();
+
+    auto process = prepare_by_type(ver, get_type(), get_items(), cache);
+    if (!process)
+        return false;
+
+    process(TS, *this);
+    return true;
 }
 
 }
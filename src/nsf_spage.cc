@@ -19,25 +19,66 @@
 //
 
 #include "common.hh"
+#include <algorithm>
+#include <list>
 #include "nsf.hh"
 #include "misc.hh"
 
 namespace drnsf {
 namespace nsf {
 
-// declared in res.hh
-void spage::import_file(TRANSACT, const util::blob &data)
-{
-    assert_alive();
+namespace {
 
-    util::binreader r;
-    r.begin(data);
+// (s-var) s_export_cache
+// The data most recently exported by spage::export_cached, most recent first.
+// Holding these keeps the data in memory after all other users are gone. Like
+// the pages themselves, this is only used from the main thread.
+std::list<std::shared_ptr<const util::blob>> s_export_cache;
 
+}
+
+// declared in nsf.hh
+uint32_t spage::calc_checksum(const util::byte *data)
+{
+    // Each byte is added to the checksum, which is then rotated left by three
+    // bits. The checksum bytes themselves are skipped, but the rotation still
+    // occurs for each of them.
+    //
+    // Every step depends on the result of the previous one, so this cannot be
+    // split up or vectorized; callers checking many pages should instead check
+    // multiple pages at once (see archive::find_bad_checksums).
+    auto step = [](uint32_t checksum, uint32_t value) {
+        checksum += value;
+        return checksum << 3 | checksum >> 29;
+    };
+
+    uint32_t checksum = 0x12345678;
+    for (std::size_t i = 0; i < 12; i++) {
+        checksum = step(checksum, data[i]);
+    }
+    for (std::size_t i = 12; i < 16; i++) {
+        checksum = step(checksum, 0);
+    }
+    for (std::size_t i = 16; i < page_size; i += 4) {
+        checksum = step(checksum, data[i]);
+        checksum = step(checksum, data[i + 1]);
+        checksum = step(checksum, data[i + 2]);
+        checksum = step(checksum, data[i + 3]);
+    }
+    return checksum;
+}
+
+// declared in nsf.hh
+spage::parse_result spage::parse(const util::slice &data)
+{
     // Ensure the page data is the correct size (64K).
     if (data.size() != page_size)
         throw res::import_error("nsf::spage: not 64K");
 
+    util::span_reader r(data);
+
     // Read the page header.
+    r.require(16);
     auto magic         = r.read_u16();
     auto type          = r.read_u16();
     auto cid           = r.read_u32();
@@ -48,19 +89,22 @@ void spage::import_file(TRANSACT, const util::blob &data)
     if (magic != 0x1234)
         throw res::import_error("nsf::spage: bad magic number");
 
+    // Ensure the pagelet offsets fit within the page.
+    if (pagelet_count >= r.remaining() / 4)
+        throw res::import_error("nsf::spage: too many pagelets");
+
     // Read the pagelet offsets. Pagelets should be entries, but we treat
     // them as blobs instead so they can be totally unprocessed, etc.
     std::vector<uint32_t> pagelet_offsets(pagelet_count + 1);
+    r.require(pagelet_offsets.size() * 4);
     for (auto &&pagelet_offset : pagelet_offsets) {
         pagelet_offset = r.read_u32();
     }
-    r.end_early();
 
-    // Copy the data for each pagelet as a new raw_data asset. The caller
-    // can later process these into entries if desired.
-    std::vector<misc::raw_data::ref> pagelets(pagelet_count);
+    // Extract the data for each pagelet, sharing the page's data rather than
+    // copying it.
+    std::vector<util::slice> pagelets(pagelet_count);
     for (auto &&i : util::range_of(pagelets)) {
-        auto &&pagelet = pagelets[i];
         auto &&pagelet_start_offset = pagelet_offsets[i];
         auto &&pagelet_end_offset = pagelet_offsets[i + 1];
 
@@ -78,91 +122,460 @@ void spage::import_file(TRANSACT, const util::blob &data)
         if (pagelet_end_offset < pagelet_start_offset)
             throw res::import_error("nsf::spage: negative pagelet size");
 
+        pagelets[i] = data.sub(
+            pagelet_start_offset,
+            pagelet_end_offset - pagelet_start_offset
+        );
+    }
+
+    return {type, cid, checksum, std::move(pagelets)};
+}
+
+// declared in nsf.hh
+void spage::import_parsed(TRANSACT, parse_result data)
+{
+    assert_alive();
+
+    // Create a new raw_data asset for each pagelet. The caller can later
+    // process these into entries if desired.
+    std::vector<misc::raw_data::ref> pagelets(data.pagelets.size());
+    for (auto &&i : util::range_of(pagelets)) {
+        auto &&pagelet = pagelets[i];
+
         // Create the pagelet asset.
-        pagelet = get_name() / "pagelet-$"_fmt(i);
+        pagelet = get_name().indexed("pagelet-", i);
         pagelet.create(TS, get_proj());
 
-        // Copy the pagelet data into the asset.
-        pagelet->set_data(TS,
-            {&data[pagelet_start_offset], &data[pagelet_end_offset]}
-        );
+        // Point the asset at the pagelet's data, sharing the storage of any
+        // identical data already in the project.
+        pagelet->set_shared_data(TS, std::move(data.pagelets[i]));
     }
 
     // Finish importing.
-    set_type(TS, type);
-    set_cid(TS, cid);
-    set_checksum(TS, checksum);
+    set_type(TS, data.type);
+    set_cid(TS, data.cid);
+    set_checksum(TS, data.checksum);
     set_pagelets(TS, {pagelets.begin(), pagelets.end()});
 }
 
 // declared in nsf.hh
-util::blob spage::export_file() const
+void spage::import_file(TRANSACT, const util::slice &data)
 {
-    assert_alive();
+    import_parsed(TS, parse(data));
+}
 
-    util::binwriter w;
-    w.begin();
+// declared in nsf.hh
+void spage::export_file(util::blob &buffer) const
+{
+    assert_alive();
 
     auto &&pagelets = get_pagelets();
 
-    // Write the page header.
-    w.write_u16(0x1234);
-    w.write_u16(get_type());
-    w.write_u32(get_cid());
-    w.write_u32(pagelets.size());
-    w.write_u32(get_checksum());
-
-    // Export the pagelets if they are processed entries.
-    std::vector<util::blob> pagelets_raw(pagelets.size());
-    for (auto &&i : util::range_of(get_pagelets())) {
-        auto ref = get_pagelets()[i];
+    // Gather the data for each pagelet. Entries are not exported into their
+    // own buffers; only their items are gathered here, so that they can be
+    // written straight into the page once the pagelet offsets are known.
+    struct pagelet_data {
+        util::slice raw;
+        const entry *entry_asset;
+        uint32_t entry_type;
+        std::vector<util::slice> entry_items;
+        size_t size;
+    };
+    std::vector<pagelet_data> pagelets_data(pagelets.size());
+    for (auto &&i : util::range_of(pagelets)) {
+        auto ref = pagelets[i];
+        auto &pagelet = pagelets_data[i];
 
         if (!ref)
             throw res::export_error("nsf::spage: null pagelet ref");
 
         misc::raw_data::ref raw_ref = ref;
         if (raw_ref.ok()) {
-            pagelets_raw[i] = raw_ref->get_data();
+            pagelet.raw = raw_ref->get_data();
+            pagelet.entry_asset = nullptr;
+            pagelet.size = pagelet.raw.size();
             continue;
         }
 
         entry::ref entry_ref = ref;
         if (entry_ref.ok()) {
-            pagelets_raw[i] = entry_ref->export_file();
+            pagelet.entry_asset = entry_ref.get();
+            pagelet.entry_items = pagelet.entry_asset->export_entry(
+                pagelet.entry_type
+            );
+            pagelet.size = entry::calc_file_size(pagelet.entry_items);
             continue;
         }
 
         throw res::export_error("nsf::spage: pagelet has incompatible type");
     }
 
+    util::binwriter w;
+    w.begin(std::move(buffer));
+
+    // Write the page header.
+    w.write_u16(0x1234);
+    w.write_u16(get_type());
+    w.write_u32(get_cid());
+    w.write_u32(pagelets.size());
+    w.write_u32(get_checksum());
+
     // Calculate and write the pagelet offsets.
+    std::vector<uint32_t> pagelet_offsets(pagelets.size());
     uint32_t pagelet_offset = 20 + pagelets.size() * 4;
-    for (auto &&pagelet : pagelets_raw) {
+    for (auto &&i : util::range_of(pagelets_data)) {
+        pagelet_offsets[i] = pagelet_offset;
         w.write_u32(pagelet_offset);
-        pagelet_offset += pagelet.size();
+        pagelet_offset += pagelets_data[i].size;
     }
     w.write_u32(pagelet_offset);
 
-    auto data = w.end();
-
-    // Write the pagelets themselves.
-    for (auto &&pagelet : pagelets_raw) {
-        data.insert(data.end(), pagelet.begin(), pagelet.end());
-    }
+    buffer = w.end();
 
     // Ensure a 64K page size.
-    if (data.size() > page_size)
+    if (pagelet_offset > page_size)
         throw res::export_error("nsf::spage: over 64K page size");
 
-    if (data.size() < page_size) {
-        data.resize(page_size);
+    // Write the pagelets themselves, directly into their places in the page.
+    buffer.resize(page_size);
+    for (auto &&i : util::range_of(pagelets_data)) {
+        auto &pagelet = pagelets_data[i];
+        auto dest = buffer.data() + pagelet_offsets[i];
+        if (pagelet.entry_asset) {
+            entry::write_file(
+                dest,
+                pagelet.entry_asset->get_eid(),
+                pagelet.entry_type,
+                pagelet.entry_items
+            );
+        } else {
+            std::copy(pagelet.raw.begin(), pagelet.raw.end(), dest);
+        }
     }
 
-    // Calculate checksum, if necessary.
-    // TODO
+    // Calculate and write the checksum.
+    auto checksum = calc_checksum(buffer.data());
+    buffer[12] = checksum;
+    buffer[13] = checksum >> 8;
+    buffer[14] = checksum >> 16;
+    buffer[15] = checksum >> 24;
+}
 
+// declared in nsf.hh
+util::blob spage::export_file() const
+{
+    util::blob data;
+    export_file(data);
     return data;
 }
 
+// declared in nsf.hh
+uint64_t spage::get_content_revision() const
+{
+    assert_alive();
+
+    uint64_t result = get_revision();
+    for (auto &&ref : get_pagelets()) {
+        uint64_t pagelet_revision;
+
+        misc::raw_data::ref raw_ref = ref;
+        entry::ref entry_ref = ref;
+        if (raw_ref.ok()) {
+            pagelet_revision = raw_ref->get_revision();
+        } else if (entry_ref.ok()) {
+            pagelet_revision = entry_ref->get_content_revision();
+        } else {
+            return 0;
+        }
+
+        if (pagelet_revision == 0)
+            return 0;
+
+        result = std::max(result, pagelet_revision);
+    }
+    return result;
+}
+
+// declared in nsf.hh
+util::slice spage::export_cached() const
+{
+    assert_alive();
+
+    auto revision = get_content_revision();
+    if (revision != 0 && revision == m_export_cache_revision) {
+        auto cached = m_export_cache.lock();
+        if (cached) {
+            // Move the data to the front of the cache, if it is in there.
+            for (auto it = s_export_cache.begin();
+                it != s_export_cache.end();
+                ++it) {
+                if (*it == cached) {
+                    s_export_cache.splice(
+                        s_export_cache.begin(),
+                        s_export_cache,
+                        it
+                    );
+                    break;
+                }
+            }
+            return util::slice(cached, cached->data(), cached->size());
+        }
+    }
+
+    // Export the page. The cached revision is cleared first so that nothing
+    // is reused if the export fails.
+    m_export_cache.reset();
+    m_export_cache_revision = 0;
+    auto data = std::make_shared<util::blob>();
+    export_file(*data);
+
+    std::shared_ptr<const util::blob> result = std::move(data);
+    m_export_cache = result;
+    m_export_cache_revision = revision;
+
+    s_export_cache.push_front(result);
+    if (s_export_cache.size() > export_cache_capacity) {
+        s_export_cache.pop_back();
+    }
+
+    return util::slice(result, result->data(), result->size());
+}
+
+// declared in nsf.hh
+void spage::process_all(
+    TRANSACT,
+    game_ver ver,
+    const process_cache *cache)
+{
+    assert_alive();
+
+    for (misc::raw_data::ref pagelet : get_pagelets()) {
+        // Skip pagelets which have already been processed.
+        if (!pagelet.ok())
+            continue;
+
+        process_pagelet(TS, pagelet, ver, cache);
+    }
+}
+
+// declared in nsf.hh
+void spage::process_pagelet(
+    TRANSACT,
+    misc::raw_data::ref pagelet,
+    game_ver ver,
+    const process_cache *cache)
+{
+    auto parsed = raw_entry::parse(pagelet->get_data());
+    auto process = raw_entry::prepare_by_type(
+        ver,
+        parsed.type,
+        parsed.items,
+        cache
+    );
+    process_pagelet(TS, pagelet, [&](TRANSACT, raw_entry &entry) {
+        entry.import_parsed(TS, std::move(parsed));
+        if (process) {
+            process(TS, entry);
+        }
+    });
+}
+
+// declared in nsf.hh
+void spage::process_pagelet(
+    TRANSACT,
+    misc::raw_data::ref pagelet,
+    const std::function<void(TRANSACT, raw_entry &)> &finish)
+{
+    raw_entry::ref entry = pagelet;
+    pagelet->rename(TS, pagelet / "_PROCESSING");
+    pagelet /= "_PROCESSING";
+    entry.create(TS, pagelet->get_proj());
+    pagelet->destroy(TS);
+    finish(TS, *entry);
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(nsf_spage, CalcChecksum)
+{
+    // The expected values were calculated separately for these pages.
+    util::blob page(page_size);
+    page[0] = 0x34;
+    page[1] = 0x12;
+    EXPECT_EQ(spage::calc_checksum(page.data()), 0x523456AEu);
+
+    for (auto &&i : util::range_of(page)) {
+        page[i] = i * 7;
+    }
+    EXPECT_EQ(spage::calc_checksum(page.data()), 0x5B4203DDu);
+
+    // The checksum stored in the page header is not included.
+    for (size_t i = 12; i < 16; i++) {
+        page[i] = 0xFF;
+    }
+    EXPECT_EQ(spage::calc_checksum(page.data()), 0x5B4203DDu);
+
+    // Every other byte is included.
+    for (size_t i : {size_t(0), size_t(11), size_t(16), page_size - 1}) {
+        page[i] ^= 1;
+        EXPECT_NE(spage::calc_checksum(page.data()), 0x5B4203DDu) << i;
+        page[i] ^= 1;
+    }
+}
+
+TEST(nsf_spage, ExportChecksum)
+{
+    res::project proj;
+    spage::ref page = proj.get_asset_root() / "page";
+    proj.get_transact().run([&](TRANSACT) {
+        page.create(TS, proj);
+        page->import_parsed(TS, {
+            0,
+            1234,
+            0,
+            {util::blob{1, 2, 3, 4}, util::blob{5, 6, 7}}
+        });
+    });
+
+    // The exported page holds the checksum of its own data, and parses back
+    // to the same pagelets.
+    util::blob data;
+    page->export_file(data);
+    ASSERT_EQ(data.size(), page_size);
+    uint32_t checksum = data[12] |
+        data[13] << 8 |
+        data[14] << 16 |
+        uint32_t(data[15]) << 24;
+    EXPECT_EQ(checksum, spage::calc_checksum(data.data()));
+
+    auto parsed = spage::parse(util::slice(data));
+    EXPECT_EQ(parsed.cid, 1234u);
+    EXPECT_EQ(parsed.checksum, checksum);
+    ASSERT_EQ(parsed.pagelets.size(), 2u);
+    EXPECT_EQ(parsed.pagelets[0], (util::blob{1, 2, 3, 4}));
+    EXPECT_EQ(parsed.pagelets[1], (util::blob{5, 6, 7}));
+}
+
+TEST(nsf_spage, ExportReusesBuffer)
+{
+    res::project proj;
+    spage::ref pages[2] = {
+        proj.get_asset_root() / "page-0",
+        proj.get_asset_root() / "page-1"
+    };
+    proj.get_transact().run([&](TRANSACT) {
+        pages[0].create(TS, proj);
+        pages[0]->import_parsed(TS, {0, 1, 0, {util::blob{1, 2, 3, 4}}});
+        pages[1].create(TS, proj);
+        pages[1]->import_parsed(TS, {0, 2, 0, {util::blob{5, 6, 7}}});
+    });
+
+    // Exporting into the same buffer again keeps its storage, and leaves
+    // nothing behind from the previous page.
+    util::blob buffer;
+    pages[0]->export_file(buffer);
+    auto storage = buffer.data();
+    pages[1]->export_file(buffer);
+    EXPECT_EQ(buffer.data(), storage);
+    EXPECT_EQ(buffer, pages[1]->export_file());
+}
+
+TEST(nsf_spage, ExportCached)
+{
+    res::project proj;
+    spage::ref page = proj.get_asset_root() / "page";
+    proj.get_transact().run([&](TRANSACT) {
+        page.create(TS, proj);
+        page->import_parsed(TS, {0, 1, 0, {util::blob{1, 2, 3, 4}}});
+    });
+
+    // An unchanged page gives back the same data, without exporting it into
+    // a new buffer.
+    auto data = page->export_cached();
+    EXPECT_EQ(data, page->export_file());
+    std::weak_ptr<const util::blob> cached = s_export_cache.front();
+    EXPECT_EQ(page->export_cached().data(), data.data());
+    EXPECT_EQ(s_export_cache.front(), cached.lock());
+
+    // A changed page is exported again.
+    proj.get_transact().run([&](TRANSACT) {
+        page->set_cid(TS, 2);
+    });
+    auto changed = page->export_cached();
+    EXPECT_NE(changed.data(), data.data());
+    EXPECT_EQ(changed, page->export_file());
+
+    // Once enough other pages have been exported, the old data is freed.
+    data = {};
+    changed = {};
+    std::weak_ptr<const util::blob> changed_cached = s_export_cache.front();
+    for (size_t i = 0; i < spage::export_cache_capacity; i++) {
+        spage::ref other = proj.get_asset_root() / "other-$"_fmt(i);
+        proj.get_transact().run([&](TRANSACT) {
+            other.create(TS, proj);
+            other->import_parsed(TS, {0, 1, 0, {}});
+        });
+        other->export_cached();
+    }
+    EXPECT_TRUE(cached.expired());
+    EXPECT_TRUE(changed_cached.expired());
+    EXPECT_EQ(s_export_cache.size(), spage::export_cache_capacity);
+}
+
+TEST(nsf_spage, PackedPageletsSkipDedup)
+{
+    // A pagelet large enough to be packed, and one too small to be packed.
+    util::blob big(8192);
+    for (auto &&i : util::range_of(big)) {
+        big[i] = i % 13;
+    }
+    util::blob small = {1, 2, 3, 4, 5, 6, 7, 8};
+
+    res::project proj;
+    proj.set_pack_threshold(4096);
+
+    // Import two pages holding separate copies of the same pagelets.
+    spage::ref pages[2] = {
+        proj.get_asset_root() / "page-0",
+        proj.get_asset_root() / "page-1"
+    };
+    proj.get_transact().run([&](TRANSACT) {
+        for (auto &&page : pages) {
+            page.create(TS, proj);
+            page->import_parsed(TS, {
+                0,
+                0,
+                0,
+                {util::slice(big), util::slice(small)}
+            });
+        }
+    });
+
+    misc::raw_data::ref big0 = pages[0]->get_pagelets()[0];
+    misc::raw_data::ref big1 = pages[1]->get_pagelets()[0];
+    misc::raw_data::ref small0 = pages[0]->get_pagelets()[1];
+    misc::raw_data::ref small1 = pages[1]->get_pagelets()[1];
+
+    // The large pagelets are packed, and never go through the blob store.
+    EXPECT_TRUE(big0->get_packed_data().is_packed());
+    EXPECT_TRUE(big1->get_packed_data().is_packed());
+    EXPECT_EQ(big0->get_data(), big);
+    EXPECT_EQ(big1->get_data(), big);
+
+    // The small pagelets are not packed, and share one copy of their data.
+    EXPECT_FALSE(small0->get_packed_data().is_packed());
+    EXPECT_EQ(small0->get_data(), small);
+    EXPECT_EQ(small1->get_data().data(), small0->get_data().data());
+
+    auto &&stats = proj.get_blob_store().get_stats();
+    EXPECT_EQ(stats.intern_count, 2u);
+    EXPECT_EQ(stats.replaced_count, 1u);
+    EXPECT_EQ(stats.replaced_bytes, small.size());
+}
+
+}
+#endif
+
 }
 }
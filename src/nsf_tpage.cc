@@ -0,0 +1,411 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <tuple>
+#include "nsf.hh"
+
+namespace drnsf {
+namespace nsf {
+
+// declared in nsf.hh
+void tpage::import_file(TRANSACT, util::slice data)
+{
+    assert_alive();
+
+    // Ensure the page data is the correct size (64K).
+    if (data.size() != page_size)
+        throw res::import_error("nsf::tpage: not 64K");
+
+    util::span_reader r(data);
+
+    // Read the page header.
+    r.require(4);
+    auto magic = r.read_u16();
+    auto type  = r.read_u16();
+
+    // Ensure the magic number is correct.
+    if (magic != 0x1234)
+        throw res::import_error("nsf::tpage: bad magic number");
+
+    // Ensure this is a texture page.
+    if (type != 1)
+        throw res::import_error("nsf::tpage: not a texture page");
+
+    // Share the storage of an identical page already in the project, as the
+    // same texture pages are often found in several NSF files.
+    set_data(TS, get_proj().get_blob_store().intern(std::move(data)));
+}
+
+// declared in nsf.hh
+util::slice tpage::export_file() const
+{
+    assert_alive();
+
+    return get_data();
+}
+
+// declared in nsf.hh
+nsf::eid tpage::get_eid() const
+{
+    assert_alive();
+
+    util::span_reader r(get_data());
+    r.require(8);
+    r.discard(4);
+    return r.read_u32();
+}
+
+// declared in nsf.hh
+tpage::row tpage::get_row(int y) const
+{
+    assert_alive();
+
+    if (y < 0 || y >= height)
+        throw std::logic_error("nsf::tpage::get_row: out of range");
+
+    return row(get_data().data() + y * width * 2);
+}
+
+namespace {
+
+// (s-func) convert_color
+// Converts a 15-bit PlayStation color to 32-bit RGBA (0xAABBGGRR). See
+// decode_texture for how the alpha value is chosen.
+inline uint32_t convert_color(uint16_t color)
+{
+    uint32_t r = color & 0x1F;
+    uint32_t g = color >> 5 & 0x1F;
+    uint32_t b = color >> 10 & 0x1F;
+    uint32_t a = (color & 0x8000) ? 0x80 : (color ? 0xFF : 0x00);
+
+    // Expand each 5-bit channel to 8 bits such that 0x1F becomes 0xFF.
+    r = r << 3 | r >> 2;
+    g = g << 3 | g >> 2;
+    b = b << 3 | b >> 2;
+
+    return r | g << 8 | b << 16 | a << 24;
+}
+
+// (s-func) read_pixel
+// Reads the 16-bit pixel at the given position in the page data.
+inline uint16_t read_pixel(const util::byte *page, int x, int y)
+{
+    auto p = page + (y * tpage::width + x) * 2;
+    return p[0] | p[1] << 8;
+}
+
+// (s-func) load_clut
+// Converts the `count' colors of the CLUT at the given position in the page
+// data to RGBA, so that the texels can then be decoded by table lookup.
+void load_clut(
+    const util::byte *page,
+    int clut_x,
+    int clut_y,
+    int count,
+    uint32_t *out)
+{
+    if (clut_x < 0 || clut_x + count > tpage::width ||
+        clut_y < 0 || clut_y >= tpage::height)
+        throw std::logic_error("nsf::decode_texture: CLUT out of range");
+
+    for (int i = 0; i < count; i++) {
+        out[i] = convert_color(read_pixel(page, clut_x + i, clut_y));
+    }
+}
+
+}
+
+// declared in nsf.hh
+void decode_texture(
+    const util::byte *page,
+    const texture_region &region,
+    uint32_t *out)
+{
+    // The number of texels in each 16-bit pixel of the page.
+    int texels_per_pixel;
+    switch (region.format) {
+    case texture_format::clut4:
+        texels_per_pixel = 4;
+        break;
+    case texture_format::clut8:
+        texels_per_pixel = 2;
+        break;
+    case texture_format::direct15:
+        texels_per_pixel = 1;
+        break;
+    default:
+        throw std::logic_error("nsf::decode_texture: bad format");
+    }
+
+    if (region.x < 0 || region.width < 0 ||
+        region.x + region.width > tpage::width * texels_per_pixel ||
+        region.y < 0 || region.height < 0 ||
+        region.y + region.height > tpage::height)
+        throw std::logic_error("nsf::decode_texture: region out of range");
+
+    // Each format has its own loop, so that the inner loops are simple enough
+    // for the compiler to unroll and vectorize.
+    uint32_t clut[256];
+    switch (region.format) {
+    case texture_format::clut4:
+        load_clut(page, region.clut_x, region.clut_y, 16, clut);
+        for (int y = 0; y < region.height; y++) {
+            auto row = page + (region.y + y) * tpage::width * 2;
+            for (int x = 0; x < region.width; x++) {
+                int texel = region.x + x;
+                int index = row[texel / 2] >> (texel % 2 * 4) & 0xF;
+                *out++ = clut[index];
+            }
+        }
+        break;
+    case texture_format::clut8:
+        load_clut(page, region.clut_x, region.clut_y, 256, clut);
+        for (int y = 0; y < region.height; y++) {
+            auto row = page + (region.y + y) * tpage::width * 2 + region.x;
+            for (int x = 0; x < region.width; x++) {
+                *out++ = clut[row[x]];
+            }
+        }
+        break;
+    case texture_format::direct15:
+        for (int y = 0; y < region.height; y++) {
+            auto row = page + (region.y + y) * tpage::width * 2 + region.x * 2;
+            for (int x = 0; x < region.width; x++) {
+                *out++ = convert_color(row[x * 2] | row[x * 2 + 1] << 8);
+            }
+        }
+        break;
+    }
+}
+
+// declared in nsf.hh
+bool texture_cache::key::operator <(const key &rhs) const
+{
+    auto tie = [](const key &k) {
+        return std::tie(
+            k.page,
+            k.region.format,
+            k.region.clut_x,
+            k.region.clut_y,
+            k.region.x,
+            k.region.y,
+            k.region.width,
+            k.region.height
+        );
+    };
+    return tie(*this) < tie(rhs);
+}
+
+// declared in nsf.hh
+texture_cache::pixels texture_cache::get(
+    const util::slice &page,
+    const texture_region &region)
+{
+    if (page.size() != page_size)
+        throw std::logic_error("nsf::texture_cache::get: page not 64K");
+
+    // The CLUT position has no effect on direct15 regions, so it is left out
+    // of the key to avoid decoding the same region twice.
+    key k = {page.data(), region};
+    if (region.format == texture_format::direct15) {
+        k.region.clut_x = 0;
+        k.region.clut_y = 0;
+    }
+
+    // Check for the region in the cache. If found, move it to the front of the
+    // list as the most recently used region.
+    auto it = m_index.find(k);
+    if (it != m_index.end()) {
+        m_items.splice(m_items.begin(), m_items, it->second);
+        return it->second->data;
+    }
+
+    // Decode the region. This throws if the region is out of range, before any
+    // changes are made to the cache.
+    auto data = std::make_shared<std::vector<uint32_t>>(
+        std::size_t(region.width) * std::size_t(region.height)
+    );
+    decode_texture(page.data(), region, data->data());
+
+    m_items.push_front({k, page, data});
+    m_index.emplace(k, m_items.begin());
+    m_size += data->size();
+
+    // Discard the least recently used regions until the cache is within its
+    // capacity. The new region is kept regardless of its size.
+    while (m_size > m_capacity && m_items.size() > 1) {
+        auto &&oldest = m_items.back();
+        m_size -= oldest.data->size();
+        m_index.erase(oldest.k);
+        m_items.pop_back();
+    }
+
+    return data;
+}
+
+// declared in nsf.hh
+void texture_cache::clear()
+{
+    m_index.clear();
+    m_items.clear();
+    m_size = 0;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-func) make_test_page
+// Returns a texture page for the tests below, where every pixel's value is
+// derived from its position.
+util::blob make_test_page()
+{
+    util::blob data(page_size);
+    for (int y = 0; y < tpage::height; y++) {
+        for (int x = 0; x < tpage::width; x++) {
+            uint16_t value = x * 37 + y * 1021;
+            data[(y * tpage::width + x) * 2] = value;
+            data[(y * tpage::width + x) * 2 + 1] = value >> 8;
+        }
+    }
+    return data;
+}
+
+TEST(nsf_tpage, ConvertColor)
+{
+    EXPECT_EQ(convert_color(0x0000), 0x00000000u);
+    EXPECT_EQ(convert_color(0x8000), 0x80000000u);
+    EXPECT_EQ(convert_color(0x7FFF), 0xFFFFFFFFu);
+    EXPECT_EQ(convert_color(0xFFFF), 0x80FFFFFFu);
+    EXPECT_EQ(convert_color(0x001F), 0xFF0000FFu);
+    EXPECT_EQ(convert_color(0x03E0), 0xFF00FF00u);
+    EXPECT_EQ(convert_color(0x7C00), 0xFFFF0000u);
+}
+
+TEST(nsf_tpage, DecodeTexture)
+{
+    auto page = make_test_page();
+
+    // The reference decoder below reads each texel using the formats' bit
+    // layouts as they are usually described: texels are packed into each
+    // 16-bit pixel starting from the least significant bits.
+    auto reference = [&](const texture_region &region, int x, int y) {
+        int bits;
+        switch (region.format) {
+        case texture_format::clut4: bits = 4; break;
+        case texture_format::clut8: bits = 8; break;
+        default: bits = 16; break;
+        }
+        int texel = region.x + x;
+        int per_pixel = 16 / bits;
+        uint16_t pixel = read_pixel(
+            page.data(),
+            texel / per_pixel,
+            region.y + y
+        );
+        if (bits == 16)
+            return convert_color(pixel);
+
+        int index = pixel >> (texel % per_pixel * bits) & ((1 << bits) - 1);
+        return convert_color(read_pixel(
+            page.data(),
+            region.clut_x + index,
+            region.clut_y
+        ));
+    };
+
+    texture_region regions[] = {
+        {texture_format::clut4, 16, 3, 5, 7, 61, 9},
+        {texture_format::clut8, 0, 127, 3, 100, 125, 28},
+        {texture_format::direct15, 0, 0, 200, 0, 56, 128}
+    };
+    for (auto &&region : regions) {
+        std::vector<uint32_t> out(region.width * region.height);
+        decode_texture(page.data(), region, out.data());
+        for (int y = 0; y < region.height; y++) {
+            for (int x = 0; x < region.width; x++) {
+                ASSERT_EQ(
+                    out[y * region.width + x],
+                    reference(region, x, y)
+                );
+            }
+        }
+    }
+}
+
+TEST(nsf_tpage, DecodeTextureRange)
+{
+    auto page = make_test_page();
+    uint32_t out[1024];
+
+    texture_region ok_4 = {texture_format::clut4, 240, 127, 1000, 120, 24, 8};
+    EXPECT_NO_THROW(decode_texture(page.data(), ok_4, out));
+
+    texture_region bad_x = {texture_format::clut8, 0, 0, 500, 0, 13, 1};
+    EXPECT_THROW(decode_texture(page.data(), bad_x, out), std::logic_error);
+
+    texture_region bad_y = {texture_format::direct15, 0, 0, 0, 127, 1, 2};
+    EXPECT_THROW(decode_texture(page.data(), bad_y, out), std::logic_error);
+
+    texture_region bad_clut = {texture_format::clut8, 1, 0, 0, 0, 1, 1};
+    EXPECT_THROW(
+        decode_texture(page.data(), bad_clut, out),
+        std::logic_error
+    );
+}
+
+TEST(nsf_tpage, TextureCache)
+{
+    util::slice page = make_test_page();
+    texture_cache cache(1000);
+
+    texture_region a = {texture_format::clut4, 0, 0, 0, 0, 20, 20};
+    texture_region b = {texture_format::clut8, 0, 0, 0, 0, 20, 20};
+    texture_region c = {texture_format::direct15, 0, 0, 0, 0, 20, 20};
+
+    auto a1 = cache.get(page, a);
+    auto b1 = cache.get(page, b);
+    EXPECT_EQ(cache.get(page, a), a1);
+    EXPECT_EQ(cache.get(page, b), b1);
+
+    // There is only room for two of the regions, and `a' is the least recently
+    // used, so it is discarded. Its data must remain valid.
+    auto a_data = *a1;
+    auto c1 = cache.get(page, c);
+    EXPECT_EQ(*a1, a_data);
+    EXPECT_EQ(cache.get(page, b), b1);
+    EXPECT_EQ(cache.get(page, c), c1);
+    auto a2 = cache.get(page, a);
+    EXPECT_NE(a2, a1);
+    EXPECT_EQ(*a2, *a1);
+
+    // The same pixels in different page data are cached separately.
+    util::slice other_page = make_test_page();
+    EXPECT_NE(cache.get(other_page, a), a2);
+
+    cache.clear();
+    EXPECT_NE(cache.get(page, a), a2);
+}
+
+}
+#endif
+
+}
+}
@@ -19,18 +19,440 @@
 //
 
 #include "common.hh"
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
 #include "nsf.hh"
 
+// DRNSF_USE_SSE2 is set when SSE2 is always available on the target, which is
+// the case for every x86-64 build. encode_vertices uses it for its main loop.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DRNSF_USE_SSE2 1
+#include <emmintrin.h>
+#else
+#define DRNSF_USE_SSE2 0
+#endif
+
 namespace drnsf {
 namespace nsf {
 
-// declared in res.hh
-void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
+namespace {
+
+// (s-type) vertex_hi, vertex_lo
+// The layouts of the 4-byte and 2-byte parts of a vertex (see decode_vertices).
+//
+// vertex_hi: color index bits 4-7, X, color index bits 8-9, FX, Y
+// vertex_lo: color index bits 0-3, Z
+using vertex_hi = util::bitfield<4, 12, 2, 2, 12>;
+using vertex_lo = util::bitfield<4, 12>;
+
+// (s-type) triangle_hi, triangle_lo
+// The layouts of the 4-byte and 2-byte parts of a triangle (see
+// decode_triangles).
+//
+// triangle_hi: unk0, vertex index 0, vertex index 1
+// triangle_lo: unk1, vertex index 2
+using triangle_hi = util::bitfield<8, 12, 12>;
+using triangle_lo = util::bitfield<4, 12>;
+
+// (s-type) quad_half
+// The layout of each half of a quad (see decode_quads).
+//
+// quad_half: unk0 or unk1, vertex index 0 or 2, vertex index 1 or 3
+using quad_half = util::bitfield<8, 12, 12>;
+
+// (s-func) decode_vertices
+// Decodes `count' vertices from the given vertex item data, which must be at
+// least `count * 6' bytes in size. Each vertex is split into a 4-byte part
+// holding its X and Y coordinates, FX, and the upper color index bits, and a
+// 2-byte part holding its Z coordinate and the lower color index bits. The
+// 4-byte parts are stored first, in reverse order, followed by the 2-byte
+// parts in forward order.
+void decode_vertices(const util::byte *data, size_t count, gfx::vertex *out)
 {
-    assert_alive();
+    auto data_hi = data;
+    auto data_lo = data + count * 4;
+    for (size_t i = 0; i < count; i++) {
+        auto &vertex = out[i];
+
+        auto hi = vertex_hi::load(&data_hi[(count - 1 - i) * 4]);
+        auto lo = vertex_lo::load(&data_lo[i * 2]);
+
+        auto color_mid  = vertex_hi::get<0>(hi);
+        auto x          = vertex_hi::get_signed<1>(hi);
+        auto color_high = vertex_hi::get<2>(hi);
+        auto fx         = vertex_hi::get<3>(hi);
+        auto y          = vertex_hi::get_signed<4>(hi);
+        auto color_low  = vertex_lo::get<0>(lo);
+        auto z          = vertex_lo::get_signed<1>(lo);
 
-    util::binreader r;
+        vertex.x = x * 16;
+        vertex.y = y * 16;
+        vertex.z = z * 16;
+
+        vertex.fx = fx;
+
+        vertex.color_index = color_low | color_mid << 4 | color_high << 8;
+    }
+}
+
+// (s-func) decode_triangles
+// Decodes `count' triangles from the given triangle item data, which must be
+// at least `count * 6' bytes in size. The triangles are split into 4-byte and
+// 2-byte parts in the same manner as vertices (see decode_vertices).
+void decode_triangles(
+    const util::byte *data,
+    size_t count,
+    gfx::triangle *out)
+{
+    auto data_hi = data;
+    auto data_lo = data + count * 4;
+    for (size_t i = 0; i < count; i++) {
+        auto &triangle = out[i];
+
+        auto hi = triangle_hi::load(&data_hi[(count - 1 - i) * 4]);
+        auto lo = triangle_lo::load(&data_lo[i * 2]);
+
+        triangle.v[0].vertex_index = triangle_hi::get<1>(hi);
+        triangle.v[1].vertex_index = triangle_hi::get<2>(hi);
+        triangle.v[2].vertex_index = triangle_lo::get<1>(lo);
+
+        triangle.v[0].color_index = -1;
+        triangle.v[1].color_index = -1;
+        triangle.v[2].color_index = -1;
+
+        triangle.unk0 = triangle_hi::get<0>(hi);
+        triangle.unk1 = triangle_lo::get<0>(lo);
+    }
+}
+
+// (s-func) decode_quads
+// Decodes `count' quads from the given quad item data, which must be at least
+// `count * 8' bytes in size.
+void decode_quads(const util::byte *data, size_t count, gfx::quad *out)
+{
+    for (size_t i = 0; i < count; i++) {
+        auto &quad = out[i];
+
+        auto a = quad_half::load(&data[i * 8]);
+        auto b = quad_half::load(&data[i * 8 + 4]);
+
+        quad.v[0].vertex_index = quad_half::get<1>(a);
+        quad.v[1].vertex_index = quad_half::get<2>(a);
+        quad.v[2].vertex_index = quad_half::get<1>(b);
+        quad.v[3].vertex_index = quad_half::get<2>(b);
+
+        quad.v[0].color_index = -1;
+        quad.v[1].color_index = -1;
+        quad.v[2].color_index = -1;
+        quad.v[3].color_index = -1;
+
+        quad.unk0 = quad_half::get<0>(a);
+        quad.unk1 = quad_half::get<0>(b);
+    }
+}
+
+#if DRNSF_USE_SSE2
+// (s-func) put_sse2
+// Equivalent to `Layout::put<I>' applied to each 32-bit lane of the given
+// value.
+template <typename Layout, int I>
+inline __m128i put_sse2(__m128i value)
+{
+    return _mm_slli_epi32(
+        _mm_and_si128(value, _mm_set1_epi32(Layout::template mask<I>)),
+        Layout::template offset<I>
+    );
+}
+
+// (s-func) any_sse2
+// Returns true if any bit of the given value is set.
+inline bool any_sse2(__m128i value)
+{
+    auto zero = _mm_cmpeq_epi32(value, _mm_setzero_si128());
+    return _mm_movemask_epi8(zero) != 0xFFFF;
+}
+#endif
+
+// (s-func) encode_vertices
+// Encodes the given vertices into vertex item data, in the format described by
+// decode_vertices, padded with zeroes to a multiple of 4 bytes. Throws
+// res::export_error if any of the vertices cannot be represented.
+//
+// Every vertex is range checked and packed in a single pass without branching,
+// and the checks are only acted on afterwards. Where SSE2 is available, four
+// vertices are converted and packed at once, and the scalar loop only handles
+// the remainder. This roughly halves the time taken to encode large arrays of
+// vertices, as the float conversions are otherwise done one at a time.
+util::blob encode_vertices(const std::vector<gfx::vertex> &vertices)
+{
+    const int COORD_MIN = -(1 << 11);
+    const int COORD_MAX = (1 << 11) - 1;
+
+    auto count = vertices.size();
+    util::blob data((count * 6 + 3) & ~3);
+    auto data_hi = data.data();
+    auto data_lo = data.data() + count * 4;
+
+    bool bad_xy = false;
+    bool bad_z = false;
+    bool no_color = false;
+    bool bad_color = false;
+    bool bad_fx = false;
+    size_t i = 0;
+
+#if DRNSF_USE_SSE2
+    {
+        const __m128 scale = _mm_set1_ps(1.0f / 16.0f);
+        const __m128i coord_min = _mm_set1_epi32(COORD_MIN);
+        const __m128i coord_last = _mm_set1_epi32(COORD_MAX - 1);
+        const __m128i color_over = _mm_set1_epi32(~0x3FF);
+        const __m128i fx_over = _mm_set1_epi32(~vertex_hi::mask<3>);
+        const __m128i none = _mm_set1_epi32(-1);
+
+        __m128i bad_xy4 = _mm_setzero_si128();
+        __m128i bad_z4 = _mm_setzero_si128();
+        __m128i no_color4 = _mm_setzero_si128();
+        __m128i bad_color4 = _mm_setzero_si128();
+        __m128i bad_fx4 = _mm_setzero_si128();
+        for (; i + 4 <= count; i += 4) {
+            auto &v0 = vertices[i];
+            auto &v1 = vertices[i + 1];
+            auto &v2 = vertices[i + 2];
+            auto &v3 = vertices[i + 3];
+
+            // Multiplying by 1/16 is exact, as is the division it replaces,
+            // and the conversions truncate as the scalar loop does. Values
+            // which do not fit in an int become INT_MIN, and so fail the
+            // range checks below.
+            auto x = _mm_cvttps_epi32(
+                _mm_mul_ps(_mm_set_ps(v3.x, v2.x, v1.x, v0.x), scale)
+            );
+            auto y = _mm_cvttps_epi32(
+                _mm_mul_ps(_mm_set_ps(v3.y, v2.y, v1.y, v0.y), scale)
+            );
+            auto z = _mm_cvttps_epi32(
+                _mm_mul_ps(_mm_set_ps(v3.z, v2.z, v1.z, v0.z), scale)
+            );
+            auto fx = _mm_set_epi32(v3.fx, v2.fx, v1.fx, v0.fx);
+            auto color = _mm_set_epi32(
+                v3.color_index,
+                v2.color_index,
+                v1.color_index,
+                v0.color_index
+            );
+
+            bad_xy4 = _mm_or_si128(bad_xy4, _mm_cmplt_epi32(x, coord_min));
+            bad_xy4 = _mm_or_si128(bad_xy4, _mm_cmpgt_epi32(x, coord_last));
+            bad_xy4 = _mm_or_si128(bad_xy4, _mm_cmplt_epi32(y, coord_min));
+            bad_xy4 = _mm_or_si128(bad_xy4, _mm_cmpgt_epi32(y, coord_last));
+            bad_z4 = _mm_or_si128(bad_z4, _mm_cmplt_epi32(z, coord_min));
+            bad_z4 = _mm_or_si128(bad_z4, _mm_cmpgt_epi32(z, coord_last));
+            no_color4 = _mm_or_si128(no_color4, _mm_cmpeq_epi32(color, none));
+            bad_color4 = _mm_or_si128(
+                bad_color4,
+                _mm_and_si128(color, color_over)
+            );
+            bad_fx4 = _mm_or_si128(bad_fx4, _mm_and_si128(fx, fx_over));
+
+            auto color_low  = color;
+            auto color_mid  = _mm_srli_epi32(color, 4);
+            auto color_high = _mm_srli_epi32(color, 8);
+
+            auto hi = _mm_or_si128(
+                _mm_or_si128(
+                    put_sse2<vertex_hi, 0>(color_mid),
+                    put_sse2<vertex_hi, 1>(x)
+                ),
+                _mm_or_si128(
+                    _mm_or_si128(
+                        put_sse2<vertex_hi, 2>(color_high),
+                        put_sse2<vertex_hi, 3>(fx)
+                    ),
+                    put_sse2<vertex_hi, 4>(y)
+                )
+            );
+            auto lo = _mm_or_si128(
+                put_sse2<vertex_lo, 0>(color_low),
+                put_sse2<vertex_lo, 1>(z)
+            );
+
+            // The 4-byte parts are stored in reverse order, so the four
+            // records are swapped end for end before storing. The 2-byte
+            // parts are sign-extended from 16 bits so that packing them to
+            // 16 bits does not saturate.
+            hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(0, 1, 2, 3));
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i *>(&data_hi[(count - 4 - i) * 4]),
+                hi
+            );
+            lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+            _mm_storel_epi64(
+                reinterpret_cast<__m128i *>(&data_lo[i * 2]),
+                _mm_packs_epi32(lo, lo)
+            );
+        }
+
+        bad_xy = any_sse2(bad_xy4);
+        bad_z = any_sse2(bad_z4);
+        no_color = any_sse2(no_color4);
+        bad_color = any_sse2(bad_color4);
+        bad_fx = any_sse2(bad_fx4);
+    }
+#endif
+
+    for (; i < count; i++) {
+        auto &vertex = vertices[i];
+
+        int x = vertex.x / 16.0f;
+        int y = vertex.y / 16.0f;
+        int z = vertex.z / 16.0f;
+
+        bad_xy |= (x < COORD_MIN) | (x >= COORD_MAX);
+        bad_xy |= (y < COORD_MIN) | (y >= COORD_MAX);
+        bad_z |= (z < COORD_MIN) | (z >= COORD_MAX);
+        no_color |= (vertex.color_index == -1);
+        bad_color |= (vertex.color_index < 0) | (vertex.color_index >= 1024);
+        bad_fx |= !vertex_hi::fits<3>(vertex.fx);
+
+        uint32_t color_low  = vertex.color_index;
+        uint32_t color_mid  = vertex.color_index >> 4;
+        uint32_t color_high = vertex.color_index >> 8;
+
+        auto hi =
+            vertex_hi::put<0>(color_mid) |
+            vertex_hi::put<1>(x) |
+            vertex_hi::put<2>(color_high) |
+            vertex_hi::put<3>(vertex.fx) |
+            vertex_hi::put<4>(y);
+        auto lo =
+            vertex_lo::put<0>(color_low) |
+            vertex_lo::put<1>(z);
+
+        vertex_hi::store(&data_hi[(count - 1 - i) * 4], hi);
+        vertex_lo::store(&data_lo[i * 2], lo);
+    }
+
+    if (bad_xy)
+        throw res::export_error("nsf::wgeo_v2: vertex x/y out of range");
+    if (no_color)
+        throw res::export_error("nsf::wgeo_v2: vertex colors required");
+    if (bad_color)
+        throw res::export_error("nsf::wgeo_v2: vertex color out of range");
+    if (bad_fx)
+        throw res::export_error("nsf::wgeo_v2: vertex fx out of range");
+    if (bad_z)
+        throw res::export_error("nsf::wgeo_v2: vertex z out of range");
+
+    return data;
+}
+
+// (s-func) is_bad_index
+// Returns true if the given corner's vertex index cannot be stored in the
+// 12-bit fields used by triangles and quads.
+inline bool is_bad_index(const gfx::corner &corner)
+{
+    return !triangle_hi::fits<1>(corner.vertex_index);
+}
+
+// (s-func) encode_triangles
+// Encodes the given triangles into triangle item data, in the format described
+// by decode_triangles, padded with zeroes to a multiple of 4 bytes. Throws
+// res::export_error if any of the triangles cannot be represented. See
+// encode_vertices regarding the structure of the loop.
+//
+// Unlike encode_vertices, this has no SSE2 loop. The fields are already
+// integers, so there is no conversion to speed up, and gathering them from
+// each triangle into SSE2 registers made the loop about twice as slow.
+util::blob encode_triangles(const std::vector<gfx::triangle> &triangles)
+{
+    auto count = triangles.size();
+    util::blob data((count * 6 + 3) & ~3);
+    auto data_hi = data.data();
+    auto data_lo = data.data() + count * 4;
+
+    bool bad_value = false;
+    bool has_colors = false;
+    for (size_t i = 0; i < count; i++) {
+        auto &triangle = triangles[i];
+
+        bad_value |= !triangle_hi::fits<0>(triangle.unk0);
+        bad_value |= !triangle_lo::fits<0>(triangle.unk1);
+        bad_value |= is_bad_index(triangle.v[0]);
+        bad_value |= is_bad_index(triangle.v[1]);
+        bad_value |= is_bad_index(triangle.v[2]);
+        has_colors |= (triangle.v[0].color_index != -1);
+        has_colors |= (triangle.v[1].color_index != -1);
+        has_colors |= (triangle.v[2].color_index != -1);
+
+        auto hi =
+            triangle_hi::put<0>(triangle.unk0) |
+            triangle_hi::put<1>(triangle.v[0].vertex_index) |
+            triangle_hi::put<2>(triangle.v[1].vertex_index);
+        auto lo =
+            triangle_lo::put<0>(triangle.unk1) |
+            triangle_lo::put<1>(triangle.v[2].vertex_index);
+
+        triangle_hi::store(&data_hi[(count - 1 - i) * 4], hi);
+        triangle_lo::store(&data_lo[i * 2], lo);
+    }
+
+    if (bad_value)
+        throw res::export_error("nsf::wgeo_v2: triangle value out of range");
+    if (has_colors)
+        throw res::export_error("nsf::wgeo_v2: corner colors not supported");
+
+    return data;
+}
+
+// (s-func) encode_quads
+// Encodes the given quads into quad item data, in the format described by
+// decode_quads. Throws res::export_error if any of the quads cannot be
+// represented. See encode_triangles regarding the structure of the loop.
+util::blob encode_quads(const std::vector<gfx::quad> &quads)
+{
+    auto count = quads.size();
+    util::blob data(count * 8);
+
+    bool bad_value = false;
+    bool has_colors = false;
+    for (size_t i = 0; i < count; i++) {
+        auto &quad = quads[i];
+
+        bad_value |= !quad_half::fits<0>(quad.unk0);
+        bad_value |= !quad_half::fits<0>(quad.unk1);
+        for (auto &&corner : quad.v) {
+            bad_value |= is_bad_index(corner);
+            has_colors |= (corner.color_index != -1);
+        }
 
+        auto a =
+            quad_half::put<0>(quad.unk0) |
+            quad_half::put<1>(quad.v[0].vertex_index) |
+            quad_half::put<2>(quad.v[1].vertex_index);
+        auto b =
+            quad_half::put<0>(quad.unk1) |
+            quad_half::put<1>(quad.v[2].vertex_index) |
+            quad_half::put<2>(quad.v[3].vertex_index);
+
+        quad_half::store(&data[i * 8], a);
+        quad_half::store(&data[i * 8 + 4], b);
+    }
+
+    if (bad_value)
+        throw res::export_error("nsf::wgeo_v2: quad value out of range");
+    if (has_colors)
+        throw res::export_error("nsf::wgeo_v2: corner colors not supported");
+
+    return data;
+}
+
+}
+
+// declared in nsf.hh
+wgeo_v2::parse_result wgeo_v2::parse(const std::vector<util::slice> &items)
+{
     // Ensure we have the correct number of items (7).
     if (items.size() != 7)
         throw res::import_error("nsf::wgeo_v2: wrong item count");
@@ -43,8 +465,13 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
     auto &item_colors    = items[5];
     auto &item_6         = items[6];
 
+    // Ensure the info item is the correct size (76 bytes).
+    if (item_info.size() != 76)
+        throw res::import_error("nsf::wgeo_v2: bad info item size");
+
     // Parse the info item (0).
-    r.begin(item_info);
+    util::span_reader r(item_info);
+    r.require(76);
     auto world_x        = r.read_s32();
     auto world_y        = r.read_s32();
     auto world_z        = r.read_s32();
@@ -64,7 +491,6 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
     auto tpag_ref5      = r.read_u32();
     auto tpag_ref6      = r.read_u32();
     auto tpag_ref7      = r.read_u32();
-    r.end();
 
     // Ensure the vertex count is correct.
     if (vertex_count != item_vertices.size() / 6)
@@ -72,32 +498,7 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
 
     // Parse the vertices.
     std::vector<gfx::vertex> vertices(vertex_count);
-    for (auto &&i : util::range_of(vertices)) {
-        auto &vertex = vertices[i];
-
-        // TODO - explain vertex format here
-
-        r.begin(&item_vertices[(vertex_count - 1 - i) * 4], 4);
-        auto color_mid  = r.read_ubits(4);
-        auto x          = r.read_sbits(12);
-        auto color_high = r.read_ubits(2);
-        auto fx         = r.read_ubits(2);
-        auto y          = r.read_sbits(12);
-        r.end();
-
-        r.begin(&item_vertices[vertex_count * 4 + i * 2], 2);
-        auto color_low = r.read_ubits(4);
-        auto z         = r.read_sbits(12);
-        r.end();
-
-        vertex.x = x * 16;
-        vertex.y = y * 16;
-        vertex.z = z * 16;
-
-        vertex.fx = fx;
-
-        vertex.color_index = color_low | color_mid << 4 | color_high << 8;
-    }
+    decode_vertices(item_vertices.data(), vertex_count, vertices.data());
 
     // Ensure the triangle count is correct.
     if (triangle_count != item_triangles.size() / 6)
@@ -105,33 +506,7 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
 
     // Parse the triangles.
     std::vector<gfx::triangle> triangles(triangle_count);
-    for (auto &&i : util::range_of(triangles)) {
-        auto &triangle = triangles[i];
-
-        // TODO - explain triangle format here
-
-        r.begin(&item_triangles[(triangle_count - 1 - i) * 4], 4);
-        auto triangle_unk0 = r.read_ubits(8);
-        auto vertex0       = r.read_ubits(12);
-        auto vertex1       = r.read_ubits(12);
-        r.end();
-
-        r.begin(&item_triangles[triangle_count * 4 + i * 2], 2);
-        auto triangle_unk1 = r.read_ubits(4);
-        auto vertex2       = r.read_ubits(12);
-        r.end();
-
-        triangle.v[0].vertex_index = vertex0;
-        triangle.v[1].vertex_index = vertex1;
-        triangle.v[2].vertex_index = vertex2;
-
-        triangle.v[0].color_index = -1;
-        triangle.v[1].color_index = -1;
-        triangle.v[2].color_index = -1;
-
-        triangle.unk0 = triangle_unk0;
-        triangle.unk1 = triangle_unk1;
-    }
+    decode_triangles(item_triangles.data(), triangle_count, triangles.data());
 
     // Ensure the quad count is correct.
     if (quad_count != item_quads.size() / 8)
@@ -139,31 +514,7 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
 
     // Parse the quads.
     std::vector<gfx::quad> quads(quad_count);
-    r.begin(item_quads);
-    for (auto &&quad : quads) {
-        // TODO - explain quad format here
-
-        auto quad_unk0 = r.read_ubits(8);
-        auto vertex0   = r.read_ubits(12);
-        auto vertex1   = r.read_ubits(12);
-        auto quad_unk1 = r.read_ubits(8);
-        auto vertex2   = r.read_ubits(12);
-        auto vertex3   = r.read_ubits(12);
-
-        quad.v[0].vertex_index = vertex0;
-        quad.v[1].vertex_index = vertex1;
-        quad.v[2].vertex_index = vertex2;
-        quad.v[3].vertex_index = vertex3;
-
-        quad.v[0].color_index = -1;
-        quad.v[1].color_index = -1;
-        quad.v[2].color_index = -1;
-        quad.v[3].color_index = -1;
-
-        quad.unk0 = quad_unk0;
-        quad.unk1 = quad_unk1;
-    }
-    r.end();
+    decode_quads(item_quads.data(), quad_count, quads.data());
 
     // Ensure the item4 count is correct.
     if (item4_count != item_4.size() / 12)
@@ -178,7 +529,8 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
 
     // Parse the colors.
     std::vector<gfx::color> colors(color_count);
-    r.begin(item_colors);
+    r = util::span_reader(item_colors);
+    r.require(color_count * 4);
     for (auto &&color : colors) {
         // TODO - explain color format here
 
@@ -190,7 +542,6 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
         if (ex != 0)
             throw res::import_error("nsf::wgeo_v2: bad extra color byte");
     }
-    r.end();
 
     // Ensure the item6 count is correct.
     if (item6_count != item_6.size() / 4)
@@ -206,6 +557,179 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
     // Parse the tpag references.
     // TODO
 
+    return {
+        world_x,
+        world_y,
+        world_z,
+        info_unk0,
+        tpag_ref_count,
+        {
+            tpag_ref0,
+            tpag_ref1,
+            tpag_ref2,
+            tpag_ref3,
+            tpag_ref4,
+            tpag_ref5,
+            tpag_ref6,
+            tpag_ref7
+        },
+        std::move(vertices),
+        std::move(triangles),
+        std::move(quads),
+        std::move(colors),
+        item_4,
+        item_6
+    };
+}
+
+namespace {
+
+// The arrays of a parse_result are saved and loaded by copying their memory
+// directly (see wgeo_v2::save_parsed).
+static_assert(std::is_trivially_copyable<gfx::vertex>::value);
+static_assert(std::is_trivially_copyable<gfx::triangle>::value);
+static_assert(std::is_trivially_copyable<gfx::quad>::value);
+static_assert(std::is_trivially_copyable<gfx::color>::value);
+
+// (s-var) saved_header_size
+// The size of the header written by wgeo_v2::save_parsed.
+constexpr size_t saved_header_size = 84;
+
+// (s-func) append_array
+// Appends the memory of the given array to the end of `data'.
+template <typename T>
+void append_array(util::blob &data, const std::vector<T> &array)
+{
+    auto p = reinterpret_cast<const util::byte *>(array.data());
+    data.insert(data.end(), p, p + array.size() * sizeof(T));
+}
+
+// (s-func) load_array
+// Fills the given array with `count' elements copied from the memory at `p',
+// and returns a pointer to the end of the copied memory.
+template <typename T>
+const util::byte *load_array(
+    const util::byte *p,
+    std::vector<T> &array,
+    size_t count)
+{
+    array.resize(count);
+    std::memcpy(array.data(), p, count * sizeof(T));
+    return p + count * sizeof(T);
+}
+
+}
+
+// declared in nsf.hh
+util::blob wgeo_v2::save_parsed(const parse_result &data)
+{
+    // The sizes of the element types are included so that data saved by a
+    // build with a different layout for them is never loaded.
+    util::binwriter w;
+    w.begin();
+    w.write_u32(sizeof(gfx::vertex));
+    w.write_u32(sizeof(gfx::triangle));
+    w.write_u32(sizeof(gfx::quad));
+    w.write_u32(sizeof(gfx::color));
+    w.write_s32(data.world_x);
+    w.write_s32(data.world_y);
+    w.write_s32(data.world_z);
+    w.write_u32(data.info_unk0);
+    w.write_u32(data.tpag_ref_count);
+    for (auto &&tpag_ref : data.tpag_refs) {
+        w.write_u32(tpag_ref);
+    }
+    w.write_u32(data.vertices.size());
+    w.write_u32(data.triangles.size());
+    w.write_u32(data.quads.size());
+    w.write_u32(data.colors.size());
+    auto result = w.end();
+    assert(result.size() == saved_header_size);
+
+    append_array(result, data.vertices);
+    append_array(result, data.triangles);
+    append_array(result, data.quads);
+    append_array(result, data.colors);
+    return result;
+}
+
+// declared in nsf.hh
+wgeo_v2::parse_result wgeo_v2::load_parsed(
+    const util::slice &data,
+    const std::vector<util::slice> &items)
+{
+    // Ensure we have the correct number of items (7).
+    if (items.size() != 7)
+        throw res::import_error("nsf::wgeo_v2: wrong item count");
+
+    // Ensure the data is large enough for the header.
+    if (data.size() < saved_header_size)
+        throw res::import_error("nsf::wgeo_v2: saved data too small");
+
+    util::span_reader r(data);
+    r.require(saved_header_size);
+    auto vertex_size   = r.read_u32();
+    auto triangle_size = r.read_u32();
+    auto quad_size     = r.read_u32();
+    auto color_size    = r.read_u32();
+
+    // Ensure the data was saved with the same element layouts.
+    if (vertex_size != sizeof(gfx::vertex) ||
+        triangle_size != sizeof(gfx::triangle) ||
+        quad_size != sizeof(gfx::quad) ||
+        color_size != sizeof(gfx::color))
+        throw res::import_error("nsf::wgeo_v2: saved data has bad layout");
+
+    parse_result result;
+    result.world_x = r.read_s32();
+    result.world_y = r.read_s32();
+    result.world_z = r.read_s32();
+    result.info_unk0 = r.read_u32();
+    result.tpag_ref_count = r.read_u32();
+    for (auto &&tpag_ref : result.tpag_refs) {
+        tpag_ref = r.read_u32();
+    }
+    auto vertex_count   = r.read_u32();
+    auto triangle_count = r.read_u32();
+    auto quad_count     = r.read_u32();
+    auto color_count    = r.read_u32();
+
+    // Ensure the tpag ref count is viable, as `parse' would.
+    if (result.tpag_ref_count > 8)
+        throw res::import_error("nsf::wgeo_v2: bad tpag ref count");
+
+    // Ensure the counts agree with the items, as `parse' would.
+    if (vertex_count != items[1].size() / 6 ||
+        triangle_count != items[2].size() / 6 ||
+        quad_count != items[3].size() / 8 ||
+        color_count != items[5].size() / 4)
+        throw res::import_error("nsf::wgeo_v2: saved data has bad counts");
+
+    // Ensure the arrays exactly fill the rest of the data.
+    size_t array_size =
+        size_t(vertex_count) * sizeof(gfx::vertex) +
+        size_t(triangle_count) * sizeof(gfx::triangle) +
+        size_t(quad_count) * sizeof(gfx::quad) +
+        size_t(color_count) * sizeof(gfx::color);
+    if (r.remaining() != array_size)
+        throw res::import_error("nsf::wgeo_v2: saved data has bad size");
+
+    auto p = data.data() + saved_header_size;
+    p = load_array(p, result.vertices, vertex_count);
+    p = load_array(p, result.triangles, triangle_count);
+    p = load_array(p, result.quads, quad_count);
+    p = load_array(p, result.colors, color_count);
+
+    result.item4 = items[4];
+    result.item6 = items[6];
+    return result;
+}
+
+// declared in nsf.hh
+void wgeo_v2::import_parsed(TRANSACT, parse_result data)
+{
+    assert_alive();
+
     res::atom atom = get_proj().get_asset_root()
         / "scenery"
         / "$"_fmt(get_eid());
@@ -213,7 +737,7 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
     // Create the frame which will contain this scene's vertex positions.
     gfx::frame::ref frame = atom / "frame";
     frame.create(TS, get_proj());
-    frame->set_vertices(TS, std::move(vertices));
+    frame->set_vertices(TS, std::move(data.vertices));
 
     // Create the animation for this scene (just one frame, scenes are not
     // vertex-animated).
@@ -224,9 +748,9 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
     // Create the mesh for this scene.
     gfx::mesh::ref mesh = atom / "mesh";
     mesh.create(TS, get_proj());
-    mesh->set_triangles(TS, std::move(triangles));
-    mesh->set_quads(TS, std::move(quads));
-    mesh->set_colors(TS, std::move(colors));
+    mesh->set_triangles(TS, std::move(data.triangles));
+    mesh->set_quads(TS, std::move(data.quads));
+    mesh->set_colors(TS, std::move(data.colors));
 
     // Create the model for this scene.
     gfx::model::ref model = atom / "model";
@@ -238,35 +762,104 @@ void wgeo_v2::import_entry(TRANSACT, const std::vector<util::blob> &items)
     gfx::world::ref world = atom;
     world.create(TS, get_proj());
     world->set_model(TS, model);
-    world->set_x(TS, world_x);
-    world->set_y(TS, world_y);
-    world->set_z(TS, world_z);
+    world->set_x(TS, data.world_x);
+    world->set_y(TS, data.world_y);
+    world->set_z(TS, data.world_z);
 
     // Finish importing.
-    set_info_unk0(TS, info_unk0);
-    set_tpag_ref_count(TS, tpag_ref_count);
-    set_tpag_ref0(TS, tpag_ref0);
-    set_tpag_ref1(TS, tpag_ref1);
-    set_tpag_ref2(TS, tpag_ref2);
-    set_tpag_ref3(TS, tpag_ref3);
-    set_tpag_ref4(TS, tpag_ref4);
-    set_tpag_ref5(TS, tpag_ref5);
-    set_tpag_ref6(TS, tpag_ref6);
-    set_tpag_ref7(TS, tpag_ref7);
-    set_item4(TS, items[4]);
-    set_item6(TS, items[6]);
+    set_info_unk0(TS, data.info_unk0);
+    set_tpag_ref_count(TS, data.tpag_ref_count);
+    set_tpag_ref0(TS, data.tpag_refs[0]);
+    set_tpag_ref1(TS, data.tpag_refs[1]);
+    set_tpag_ref2(TS, data.tpag_refs[2]);
+    set_tpag_ref3(TS, data.tpag_refs[3]);
+    set_tpag_ref4(TS, data.tpag_refs[4]);
+    set_tpag_ref5(TS, data.tpag_refs[5]);
+    set_tpag_ref6(TS, data.tpag_refs[6]);
+    set_tpag_ref7(TS, data.tpag_refs[7]);
+    set_item4(TS, std::move(data.item4));
+    set_item6(TS, std::move(data.item6));
     set_world(TS, world);
 }
 
 // declared in nsf.hh
-std::vector<util::blob> wgeo_v2::export_entry(uint32_t &out_type) const
+void wgeo_v2::import_entry(
+    TRANSACT,
+    const std::vector<util::slice> &items)
+{
+    import_parsed(TS, parse(items));
+}
+
+// declared in nsf.hh
+std::vector<tpage::ref> wgeo_v2::get_tpages(const entry_index &index) const
+{
+    assert_alive();
+
+    const uint32_t tpag_refs[] = {
+        get_tpag_ref0(),
+        get_tpag_ref1(),
+        get_tpag_ref2(),
+        get_tpag_ref3(),
+        get_tpag_ref4(),
+        get_tpag_ref5(),
+        get_tpag_ref6(),
+        get_tpag_ref7()
+    };
+
+    auto count = std::min<size_t>(get_tpag_ref_count(), 8);
+    std::vector<tpage::ref> result(count);
+    for (auto &&i : util::range_of(result)) {
+        result[i] = index.find_tpage(tpag_refs[i]);
+    }
+    return result;
+}
+
+// declared in nsf.hh
+uint64_t wgeo_v2::get_content_revision() const
+{
+    assert_alive();
+
+    auto &&world = get_world();
+    if (!world.ok())
+        return 0;
+
+    auto &&model = world->get_model();
+    if (!model.ok())
+        return 0;
+
+    auto &&mesh = model->get_mesh();
+    if (!mesh.ok())
+        return 0;
+
+    auto &&anim = model->get_anim();
+    if (!anim.ok())
+        return 0;
+
+    uint64_t result = std::max({
+        get_revision(),
+        world->get_revision(),
+        model->get_revision(),
+        mesh->get_revision(),
+        anim->get_revision()
+    });
+    for (auto &&frame : anim->get_frames()) {
+        if (!frame.ok())
+            return 0;
+
+        result = std::max(result, frame->get_revision());
+    }
+    return result;
+}
+
+// declared in nsf.hh
+std::vector<util::slice> wgeo_v2::export_entry(uint32_t &out_type) const
 {
     assert_alive();
 
     util::binwriter w;
 
     out_type = 3;
-    std::vector<util::blob> items(7);
+    std::vector<util::slice> items(7);
 
     auto &item_info      = items[0];
     auto &item_vertices  = items[1];
@@ -323,112 +916,316 @@ std::vector<util::blob> wgeo_v2::export_entry(uint32_t &out_type) const
     w.write_u32(get_tpag_ref7());
     item_info = w.end();
 
-    // Export the vertices.
-    const int COORD_MIN = -(1 << 11);
-    const int COORD_MAX = (1 << 11) - 1;
+    // Export the vertices, triangles, and quads.
+    item_vertices = encode_vertices(frame->get_vertices());
+    item_triangles = encode_triangles(mesh->get_triangles());
+    item_quads = encode_quads(mesh->get_quads());
+
+    // Export item4.
+    item_4 = get_item4();
+
+    // Export the colors.
     w.begin();
-    for (auto &&vertex : util::reverse_of(frame->get_vertices())) {
-        int x = vertex.x / 16.0f;
-        int y = vertex.y / 16.0f;
+    for (auto &&color : mesh->get_colors()) {
+        w.write_u8(color.r);
+        w.write_u8(color.g);
+        w.write_u8(color.b);
+        w.write_u8(0);
+    }
+    item_colors = w.end();
 
-        if (x < COORD_MIN || x >= COORD_MAX ||
-            y < COORD_MIN || y >= COORD_MAX) {
-            throw res::export_error("nsf::wgeo_v2: vertex x/y out of range");
-        }
+    // Export item6.
+    item_6 = get_item6();
 
-        if (vertex.color_index == -1) {
-            throw res::export_error("nsf::wgeo_v2: vertex colors required");
-        }
-        if (vertex.color_index < 0 || vertex.color_index >= (1L << 10)) {
-            throw res::export_error("nsf::wgeo_v2: vertex color out of range");
+    return items;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-func) random_item
+// Returns `size' bytes of pseudo-random data for use as item data in the tests
+// below.
+util::blob random_item(size_t size)
+{
+    util::blob data(size);
+    uint32_t state = 0x2A2A2A2A + size;
+    for (auto &&b : data) {
+        state = state * 1103515245 + 12345;
+        b = state >> 16;
+    }
+    return data;
+}
+
+// The reference decoders in the following tests use util::binreader to read
+// each field in turn, and the bulk decoders must give exactly the same result.
+
+TEST(nsf_wgeo_v2, DecodeVertices)
+{
+    const size_t count = 1000;
+    auto data = random_item(count * 6);
+
+    std::vector<gfx::vertex> vertices(count);
+    decode_vertices(data.data(), count, vertices.data());
+
+    util::binreader r;
+    for (auto &&i : util::range_of(vertices)) {
+        auto &vertex = vertices[i];
+
+        r.begin(&data[(count - 1 - i) * 4], 4);
+        auto color_mid  = r.read_ubits(4);
+        auto x          = r.read_sbits(12);
+        auto color_high = r.read_ubits(2);
+        auto fx         = r.read_ubits(2);
+        auto y          = r.read_sbits(12);
+        r.end();
+
+        r.begin(&data[count * 4 + i * 2], 2);
+        auto color_low = r.read_ubits(4);
+        auto z         = r.read_sbits(12);
+        r.end();
+
+        EXPECT_EQ(vertex.x, x * 16);
+        EXPECT_EQ(vertex.y, y * 16);
+        EXPECT_EQ(vertex.z, z * 16);
+        EXPECT_EQ(vertex.fx, fx);
+        EXPECT_EQ(
+            vertex.color_index,
+            color_low | color_mid << 4 | color_high << 8
+        );
+    }
+}
+
+TEST(nsf_wgeo_v2, DecodeTriangles)
+{
+    const size_t count = 1000;
+    auto data = random_item(count * 6);
+
+    std::vector<gfx::triangle> triangles(count);
+    decode_triangles(data.data(), count, triangles.data());
+
+    util::binreader r;
+    for (auto &&i : util::range_of(triangles)) {
+        auto &triangle = triangles[i];
+
+        r.begin(&data[(count - 1 - i) * 4], 4);
+        auto triangle_unk0 = r.read_ubits(8);
+        auto vertex0       = r.read_ubits(12);
+        auto vertex1       = r.read_ubits(12);
+        r.end();
+
+        r.begin(&data[count * 4 + i * 2], 2);
+        auto triangle_unk1 = r.read_ubits(4);
+        auto vertex2       = r.read_ubits(12);
+        r.end();
+
+        EXPECT_EQ(triangle.v[0].vertex_index, vertex0);
+        EXPECT_EQ(triangle.v[1].vertex_index, vertex1);
+        EXPECT_EQ(triangle.v[2].vertex_index, vertex2);
+        EXPECT_EQ(triangle.v[0].color_index, -1);
+        EXPECT_EQ(triangle.v[1].color_index, -1);
+        EXPECT_EQ(triangle.v[2].color_index, -1);
+        EXPECT_EQ(triangle.unk0, triangle_unk0);
+        EXPECT_EQ(triangle.unk1, triangle_unk1);
+    }
+}
+
+TEST(nsf_wgeo_v2, DecodeQuads)
+{
+    const size_t count = 1000;
+    auto data = random_item(count * 8);
+
+    std::vector<gfx::quad> quads(count);
+    decode_quads(data.data(), count, quads.data());
+
+    util::binreader r;
+    r.begin(data);
+    for (auto &&quad : quads) {
+        auto quad_unk0 = r.read_ubits(8);
+        auto vertex0   = r.read_ubits(12);
+        auto vertex1   = r.read_ubits(12);
+        auto quad_unk1 = r.read_ubits(8);
+        auto vertex2   = r.read_ubits(12);
+        auto vertex3   = r.read_ubits(12);
+
+        EXPECT_EQ(quad.v[0].vertex_index, vertex0);
+        EXPECT_EQ(quad.v[1].vertex_index, vertex1);
+        EXPECT_EQ(quad.v[2].vertex_index, vertex2);
+        EXPECT_EQ(quad.v[3].vertex_index, vertex3);
+        for (auto &&corner : quad.v) {
+            EXPECT_EQ(corner.color_index, -1);
         }
+        EXPECT_EQ(quad.unk0, quad_unk0);
+        EXPECT_EQ(quad.unk1, quad_unk1);
+    }
+    r.end();
+}
+
+// The reference encoders in the following tests use util::binwriter to write
+// each field in turn, and the bulk encoders must give exactly the same result.
+// The data to encode is produced by decoding random item data.
 
-        unsigned int color_high = (vertex.color_index >> 8) & 0x3;
-        unsigned int color_mid  = (vertex.color_index >> 4) & 0xF;
+TEST(nsf_wgeo_v2, EncodeVertices)
+{
+    const size_t count = 999;
+    auto item = random_item(count * 6);
+    std::vector<gfx::vertex> vertices(count);
+    decode_vertices(item.data(), count, vertices.data());
+
+    // The largest coordinate value (2047) is not accepted by the encoder.
+    for (auto &&vertex : vertices) {
+        for (auto &&coord : vertex.v) {
+            coord = std::min(coord, 2046.0f * 16);
+        }
+    }
 
-        w.write_ubits( 4, color_mid);
-        w.write_sbits(12, x);
-        w.write_ubits( 2, color_high);
+    util::binwriter w;
+    w.begin();
+    for (auto &&vertex : util::reverse_of(vertices)) {
+        w.write_ubits( 4, (vertex.color_index >> 4) & 0xF);
+        w.write_sbits(12, vertex.x / 16);
+        w.write_ubits( 2, (vertex.color_index >> 8) & 0x3);
         w.write_ubits( 2, vertex.fx);
-        w.write_sbits(12, y);
+        w.write_sbits(12, vertex.y / 16);
     }
-    for (auto &&vertex : frame->get_vertices()) {
-        int z = vertex.z / 16.0f;
+    for (auto &&vertex : vertices) {
+        w.write_ubits( 4, vertex.color_index & 0xF);
+        w.write_sbits(12, vertex.z / 16);
+    }
+    w.pad(4);
+    EXPECT_EQ(encode_vertices(vertices), w.end());
+
+    vertices[10].color_index = -1;
+    EXPECT_THROW(encode_vertices(vertices), res::export_error);
+}
 
-        if (z < COORD_MIN || z >= COORD_MAX) {
-            throw res::export_error("nsf::wgeo_v2: vertex z out of range");
+TEST(nsf_wgeo_v2, EncodeVerticesRange)
+{
+    // The bad values are placed both within the groups of four vertices which
+    // are encoded together and in the remainder after them.
+    const size_t count = 7;
+    for (size_t i : { 0, 3, 5, 6 }) {
+        std::vector<gfx::vertex> vertices(count);
+        for (auto &&vertex : vertices) {
+            vertex.x = vertex.y = vertex.z = -2048.0f * 16;
+            vertex.fx = 3;
+            vertex.color_index = 1023;
         }
+        EXPECT_NO_THROW(encode_vertices(vertices));
+
+        auto bad = vertices;
+        bad[i].x = 2047.0f * 16;
+        EXPECT_THROW(encode_vertices(bad), res::export_error);
 
-        // The vertex color index has already been range checked in the loop
-        // above.
+        bad = vertices;
+        bad[i].y = -2049.0f * 16;
+        EXPECT_THROW(encode_vertices(bad), res::export_error);
 
-        unsigned int color_low = vertex.color_index & 0xF;
+        bad = vertices;
+        bad[i].z = 2047.0f * 16;
+        EXPECT_THROW(encode_vertices(bad), res::export_error);
 
-        w.write_ubits( 4, color_low);
-        w.write_sbits(12, z);
+        bad = vertices;
+        bad[i].fx = 4;
+        EXPECT_THROW(encode_vertices(bad), res::export_error);
+
+        bad = vertices;
+        bad[i].color_index = 1024;
+        EXPECT_THROW(encode_vertices(bad), res::export_error);
+
+        bad = vertices;
+        bad[i].color_index = -2;
+        EXPECT_THROW(encode_vertices(bad), res::export_error);
     }
-    w.pad(4);
-    item_vertices = w.end();
+}
+
+TEST(nsf_wgeo_v2, EncodeTriangles)
+{
+    const size_t count = 999;
+    auto item = random_item(count * 6);
+    std::vector<gfx::triangle> triangles(count);
+    decode_triangles(item.data(), count, triangles.data());
 
-    // Export the triangles.
+    util::binwriter w;
     w.begin();
-    for (auto &&triangle : util::reverse_of(mesh->get_triangles())) {
+    for (auto &&triangle : util::reverse_of(triangles)) {
         w.write_ubits(8, triangle.unk0);
         w.write_ubits(12, triangle.v[0].vertex_index);
         w.write_ubits(12, triangle.v[1].vertex_index);
     }
-    for (auto &&triangle : mesh->get_triangles()) {
+    for (auto &&triangle : triangles) {
         w.write_ubits(4, triangle.unk1);
         w.write_ubits(12, triangle.v[2].vertex_index);
-
-        if (triangle.v[0].color_index != -1 ||
-            triangle.v[1].color_index != -1 ||
-            triangle.v[2].color_index != -1) {
-            throw res::export_error(
-                "nsf::wgeo_v2: corner colors not supported"
-            );
-        }
     }
     w.pad(4);
-    item_triangles = w.end();
+    EXPECT_EQ(encode_triangles(triangles), w.end());
 
-    // Export the quads.
-    w.begin();
-    for (auto &&quad : mesh->get_quads()) {
-        w.write_ubits(8, quad.unk0);
-        w.write_ubits(12, quad.v[0].vertex_index);
-        w.write_ubits(12, quad.v[1].vertex_index);
-        w.write_ubits(8, quad.unk1);
-        w.write_ubits(12, quad.v[2].vertex_index);
-        w.write_ubits(12, quad.v[3].vertex_index);
-
-        if (quad.v[0].color_index != -1 || quad.v[1].color_index != -1 ||
-            quad.v[2].color_index != -1 || quad.v[3].color_index != -1) {
-            throw res::export_error(
-                "nsf::wgeo_v2: corner colors not supported"
-            );
-        }
-    }
-    item_quads = w.end();
+    triangles[10].v[2].vertex_index = 4096;
+    EXPECT_THROW(encode_triangles(triangles), res::export_error);
+}
 
-    // Export item4.
-    item_4 = get_item4();
+TEST(nsf_wgeo_v2, EncodeQuads)
+{
+    const size_t count = 999;
+    auto item = random_item(count * 8);
+    std::vector<gfx::quad> quads(count);
+    decode_quads(item.data(), count, quads.data());
 
-    // Export the colors.
+    EXPECT_EQ(encode_quads(quads), item);
+
+    quads[10].v[3].color_index = 0;
+    EXPECT_THROW(encode_quads(quads), res::export_error);
+}
+
+TEST(nsf_wgeo_v2, SaveLoadParsed)
+{
+    util::binwriter w;
     w.begin();
-    for (auto &&color : mesh->get_colors()) {
-        w.write_u8(color.r);
-        w.write_u8(color.g);
-        w.write_u8(color.b);
-        w.write_u8(0);
+    for (uint32_t value : {100, 200, 300, 7, 10, 5, 4, 0, 3, 0, 2}) {
+        w.write_u32(value);
     }
-    item_colors = w.end();
-
-    // Export item6.
-    item_6 = get_item6();
+    for (int i = 0; i < 8; i++) {
+        w.write_u32(i * 11);
+    }
+    auto item_info = w.end();
+
+    util::blob item_colors = {1, 2, 3, 0, 4, 5, 6, 0, 7, 8, 9, 0};
+    std::vector<util::slice> items = {
+        item_info,
+        random_item(10 * 6),
+        random_item(5 * 6),
+        random_item(4 * 8),
+        {},
+        item_colors,
+        {}
+    };
+
+    auto parsed = wgeo_v2::parse(items);
+    auto saved = wgeo_v2::save_parsed(parsed);
+    auto loaded = wgeo_v2::load_parsed(saved, items);
+
+    EXPECT_EQ(loaded.world_x, 100);
+    EXPECT_EQ(loaded.tpag_ref_count, 2u);
+    EXPECT_EQ(loaded.tpag_refs[7], 77u);
+    EXPECT_EQ(wgeo_v2::save_parsed(loaded), saved);
+
+    // Data which does not match the items must be rejected.
+    items[1] = random_item(11 * 6);
+    EXPECT_THROW(wgeo_v2::load_parsed(saved, items), res::import_error);
+    items[1] = random_item(10 * 6);
+    saved.pop_back();
+    EXPECT_THROW(wgeo_v2::load_parsed(saved, items), res::import_error);
+
+    // A bad tpag ref count must be rejected, as it is by `parse'.
+    saved = wgeo_v2::save_parsed(parsed);
+    saved[32] = 9;
+    EXPECT_THROW(wgeo_v2::load_parsed(saved, items), res::import_error);
+    saved[32] = 8;
+    EXPECT_EQ(wgeo_v2::load_parsed(saved, items).tpag_ref_count, 8u);
+}
 
-    return items;
 }
+#endif
 
 }
 }
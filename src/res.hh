@@ -27,6 +27,9 @@
  */
 
 #include <map>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
 #include <vector>
 #include "transact.hh"
 
@@ -56,7 +59,14 @@ class project;
 /*
  * res::atom
  *
- * FIXME explain
+ * A reference-counted name in a project's tree of asset names, such as
+ * "/nsfile/page-3". Each name exists only while an atom refers to it or to one
+ * of its descendants.
+ *
+ * Atoms, and the res::ref objects built on them, may be created, copied,
+ * compared and released on any thread at once, so worker threads may name and
+ * look up assets freely. The assets themselves are not covered by this, and
+ * are only changed through the project's transaction system.
  */
 class atom {
     friend class asset;
@@ -134,6 +144,14 @@ public:
     atom operator /(const char *s) const;
     atom operator /(const std::string &s) const;
 
+    // (func) indexed
+    // Returns the child named by `prefix' followed by `index' in decimal, the
+    // same as `*this / (prefix + std::to_string(index))'. Children found this
+    // way are remembered by their index, so looking them up again takes
+    // constant time and builds no string. This is meant for numbered names,
+    // such as the pages of an NSF file ("page-0", "page-1", ...).
+    atom indexed(const char *prefix, size_t index) const;
+
     // (path append operator)
     // This operates as though `a /= b' was `a = a / b'.
     atom &operator /=(const char *s);
@@ -164,8 +182,16 @@ public:
     std::string name() const;
 
     // (func) full_path
-    // FIXME explain
-    std::string full_path() const;
+    // Returns the path of this atom from the root, such as "/nsfile/page-3",
+    // or an empty string for the root itself. The path is built once and then
+    // kept, so later calls are free. The returned string is only valid for as
+    // long as this atom's name is still referenced.
+    const std::string &full_path() const;
+
+    // (func) append_path
+    // Appends the same path as `full_path' to the end of `out', without
+    // allocating any memory apart from what `out' needs to grow.
+    void append_path(std::string &out) const;
 
     // (func) get_parent
     // FIXME explain
@@ -176,11 +202,26 @@ public:
     std::vector<atom> get_children() const;
 
     // (func) get_children_recursive
-    // FIXME explain
+    // Returns every descendant of this atom, in the same order as
+    // atom::walker, so that each atom is followed by its own descendants. This
+    // takes time linear in the number of descendants. Use walker or
+    // for_each_descendant instead to avoid building a list.
     std::vector<atom> get_children_recursive() const;
 
+    // (inner class) walker
+    // See below.
+    class walker;
+
+    // (func) for_each_descendant
+    // Calls `fn' with every descendant of this atom, in the same order as
+    // atom::walker. If `fn' returns false, the descendants of the atom it was
+    // given are skipped.
+    template <typename F>
+    void for_each_descendant(F &&fn) const;
+
     // (func) get_proj
     // Gets the project pointer the root node was created with (see make_root).
+    // This takes constant time, as every atom holds a pointer to it.
     project *get_proj() const;
 
     // (func) get_asset_names
@@ -198,6 +239,84 @@ public:
     }
 };
 
+/*
+ * res::atom::walker
+ *
+ * Walks every descendant of an atom depth-first, with each atom followed by its
+ * own descendants. The children of each atom are visited in no particular
+ * order (see atom::get_children for a sorted list).
+ *
+ * The walk is made through the atoms' own parent and children tables, so it
+ * needs no memory of its own and takes time linear in the number of
+ * descendants. The walker holds only the top atom and the current one.
+ *
+ * Atoms under the top atom may be created or released during the walk, by the
+ * walk's user or by other threads, but this may reorder the children tables
+ * and cause some descendants to be skipped or visited twice.
+ *
+ * Example:
+ *
+ *   atom::walker w(proj.get_asset_root());
+ *   while (w.next()) {
+ *       if (w.get().is_a<nsf::archive>())
+ *           w.skip_children();
+ *   }
+ */
+class atom::walker : private util::nocopy {
+private:
+    // (var) m_top
+    // The atom whose descendants are being walked.
+    atom m_top;
+
+    // (var) m_current
+    // The current atom, which is the top atom before the first call to `next'
+    // and null once the walk is finished.
+    atom m_current;
+
+    // (var) m_descend
+    // False if the children of the current atom should be skipped.
+    bool m_descend;
+
+public:
+    // (explicit ctor)
+    // Constructs a walker over the descendants of the given atom, which must
+    // not be null. The walk does not include the top atom itself.
+    explicit walker(atom top);
+
+    // (func) next
+    // Moves to the next descendant, returning false if there are none left.
+    // This must be called once before the first descendant is available.
+    bool next();
+
+    // (func) get
+    // Returns the current descendant. The reference remains valid until the
+    // next call to `next'.
+    const atom &get() const noexcept
+    {
+        return m_current;
+    }
+
+    // (func) skip_children
+    // Causes the next call to `next' to skip the descendants of the current
+    // atom.
+    void skip_children() noexcept
+    {
+        m_descend = false;
+    }
+};
+
+// declared above
+template <typename F>
+void atom::for_each_descendant(F &&fn) const
+{
+    walker w(*this);
+    while (w.next()) {
+        if (!fn(w.get())) {
+            w.skip_children();
+        }
+    }
+}
+
 /*
  * res::project
  *
@@ -219,11 +338,31 @@ private:
     // FIXME explain
     transact::nexus m_transact;
 
+    // (var) m_demand_handler
+    // The function used by `demand' to process stub assets, or null if none
+    // has been set.
+    std::function<bool(TRANSACT, asset &)> m_demand_handler;
+
+    // (var) m_last_revision
+    // The revision number most recently given to an asset (see
+    // asset::get_revision).
+    uint64_t m_last_revision;
+
+    // (var) m_blob_store
+    // See get_blob_store.
+    util::blob_store m_blob_store;
+
+    // (var) m_pack_threshold
+    // See set_pack_threshold.
+    size_t m_pack_threshold;
+
 public:
     // (default ctor)
     // FIXME explain
     project() :
-        m_root(atom::make_root(this)) {}
+        m_root(atom::make_root(this)),
+        m_last_revision(0),
+        m_pack_threshold(0) {}
 
     // (func) get_asset_root
     // FIXME explain
@@ -246,6 +385,59 @@ public:
         return m_transact;
     }
 
+    // (func) get_blob_store
+    // Returns the project's blob store. Importers pass the data they store in
+    // assets through this store (see util::blob_store::intern), so that data
+    // which appears more than once in the project, such as the same item in
+    // several NSF files, is only held in memory once.
+    util::blob_store &get_blob_store()
+    {
+        return m_blob_store;
+    }
+
+    // (func) get_pack_threshold, set_pack_threshold
+    // The size at which asset data which is rarely used, such as the data of
+    // a misc::raw_data asset, is held compressed (see util::packed_slice). A
+    // threshold of zero, the default, disables compression.
+    //
+    // Compressing data reads all of it, so with compression enabled, imported
+    // files are no longer left on disk until they are used (see
+    // util::map_file). This trades import time for memory.
+    size_t get_pack_threshold() const
+    {
+        return m_pack_threshold;
+    }
+    void set_pack_threshold(size_t threshold)
+    {
+        m_pack_threshold = threshold;
+    }
+
+    // (func) set_demand_handler
+    // Sets the function used by `demand'. The function is given the asset
+    // currently on the demanded name, and should replace it with its processed
+    // form (if it is an unprocessed stub of some kind) and return true, or
+    // otherwise make no changes and return false.
+    void set_demand_handler(std::function<bool(TRANSACT, asset &)> fn)
+    {
+        m_demand_handler = std::move(fn);
+    }
+
+    // (func) demand
+    // Runs the demand handler (see `set_demand_handler') on the asset on the
+    // given name in a new transaction. This allows assets such as the pages of
+    // a lazily imported NSF to be left unprocessed until they are first used.
+    //
+    // If there is no asset on the name, the name may be below one which has
+    // yet to be processed (such as an entry of an unprocessed page), so the
+    // nearest name above it is demanded first, and then the name itself.
+    //
+    // Nothing happens if there is no handler, no asset on the name or above
+    // it, or if a transaction is already running. If the handler fails with an
+    // import error, its changes are rolled back and the asset is left as-is.
+    //
+    // Returns true if the handler made any changes.
+    bool demand(const atom &name);
+
     // (event) on_asset_appear
     // FIXME explain
     util::event<asset &> on_asset_appear;
@@ -263,6 +455,7 @@ public:
 class asset : private util::nocopy {
     template <typename T>
     friend class prop;
+    friend class asset_appear_event_op;
 
 private:
     // (var) m_name
@@ -277,15 +470,29 @@ private:
     // FIXME explain
     std::list<std::unique_ptr<asset>>::iterator m_iter;
 
+    // (var) m_revision
+    // See get_revision.
+    uint64_t m_revision;
+
     // (func) create_imple
     // FIXME explain
     void create_impl(TRANSACT, atom name);
 
+    // (func) update_revision
+    // Gives the asset a new revision number. This is called whenever one of
+    // the asset's properties changes, and whenever the asset appears on or
+    // disappears from a name.
+    void update_revision() noexcept
+    {
+        m_revision = ++m_proj.m_last_revision;
+    }
+
 protected:
     // (explicit ctor)
     // FIXME explain
     explicit asset(project &proj) :
-        m_proj(proj) {}
+        m_proj(proj),
+        m_revision(++proj.m_last_revision) {}
 
     // (func) on_prop_change
     // This function is called after the value of a property on the asset is
@@ -335,6 +542,19 @@ public:
     // FIXME explain
     project &get_proj() const;
 
+    // (func) get_revision
+    // Returns a number which is replaced whenever the asset changes in any way,
+    // including by undo or redo. The numbers come from a counter shared by all
+    // of the assets in the project, so an asset never goes back to a revision
+    // number it has had before, and a newer change always has a higher number.
+    //
+    // This can be used to tell whether data derived from the asset (such as
+    // exported file data) is still up to date.
+    uint64_t get_revision() const
+    {
+        return m_revision;
+    }
+
     // FIXME obsolete
     template <typename Reflector>
     void reflect(Reflector &rfl)
@@ -375,6 +595,7 @@ private:
         void execute() noexcept override
         {
             if (m_after) {
+                m_prop.m_owner.update_revision();
                 m_prop.m_owner.on_prop_change(&m_prop);
                 m_prop.on_change();
             }
@@ -462,12 +683,30 @@ public:
     }
 
     // (func) get
-    // FIXME explain
+    // Returns the asset on this name if it is of type T, or null otherwise.
+    // Unprocessed assets on the name are left as they are (see `demand').
     T *get() const
     {
         return get_as<T>();
     }
 
+    // (func) demand
+    // Returns the asset on this name if it is of type T. If there is not, the
+    // project is asked to process whatever is on the name or above it first
+    // (see res::project::demand), which runs a transaction. This should be used
+    // where a ref is followed to an asset which may not have been processed
+    // yet, such as an entry in a lazily imported NSF.
+    T *demand() const
+    {
+        auto result = get_as<T>();
+        if (!result && *this) {
+            if (get_proj()->demand(*this)) {
+                result = get_as<T>();
+            }
+        }
+        return result;
+    }
+
     // (pointer member access operator)
     // FIXME explain
     T *operator ->() const
@@ -479,7 +718,7 @@ public:
     // FIXME explain
     T &operator *() const
     {
-        auto result = get_as<T>();
+        auto result = get();
         if (!result) {
             throw std::logic_error("res::ref::(deref op): bad ref");
         }
@@ -639,3 +878,348 @@ struct asset_type_info<res::asset> {
 
 }
 }
+
+namespace drnsf {
+namespace res {
+
+/*
+ * res::project_writer
+ *
+ * A Reflector (see the `reflect' function of each asset type) which writes the
+ * values of each asset's properties in the binary form used by project files
+ * (see res::project_file).
+ *
+ * Values are written in the machine's native byte order. Arrays of plain data,
+ * such as the vertices of a gfx::frame, are written as a count followed by the
+ * array's memory in one piece, so that they can be read back the same way.
+ * Refs to other assets are written as indices into a table of the names used
+ * by the project, which is written ahead of the assets by `finish'.
+ */
+class project_writer : private util::nocopy {
+private:
+    // (var) m_proj
+    // The project being written.
+    project &m_proj;
+
+    // (var) m_data
+    // The asset data written so far.
+    util::blob m_data;
+
+    // (var) m_atoms
+    // The names written so far, in order of first use, beginning with the
+    // project's root. The parent of each name comes before it.
+    std::vector<atom> m_atoms;
+
+    // (var) m_atom_ids
+    // The index in m_atoms of each name written so far.
+    std::map<atom, uint32_t> m_atom_ids;
+
+    // (var) m_asset_count
+    // The number of assets written so far.
+    uint32_t m_asset_count;
+
+    // (var) m_asset_start
+    // The offset in m_data of the size field of the asset currently being
+    // written (see begin_asset).
+    size_t m_asset_start;
+
+    // (func) get_atom_id
+    // Returns the index of the given name in m_atoms, adding it and any of its
+    // parents which are not yet present.
+    uint32_t get_atom_id(const atom &name);
+
+public:
+    // (explicit ctor)
+    // Constructs a writer for the given project.
+    explicit project_writer(project &proj);
+
+    // (func) write_bytes
+    // Writes the given bytes as-is.
+    void write_bytes(const void *data, size_t size);
+
+    // (func) write_u32, write_u64
+    // Writes an unsigned integer.
+    void write_u32(uint32_t value)
+    {
+        write_bytes(&value, sizeof(value));
+    }
+    void write_u64(uint64_t value)
+    {
+        write_bytes(&value, sizeof(value));
+    }
+
+    // (func) begin_asset, end_asset
+    // Begins and ends the record for an asset of the given type name. The
+    // asset's properties are written in between, normally by passing this
+    // writer to the asset's `reflect' function.
+    void begin_asset(const char *type_name, const atom &name);
+    void end_asset();
+
+    // (func) finish
+    // Returns the complete project file data.
+    util::blob finish();
+
+    // (func) write_value
+    // Writes a value of any type which may be held by an asset property.
+    template <typename T>
+    std::enable_if_t<std::is_trivially_copyable<T>::value>
+        write_value(const T &value)
+    {
+        write_bytes(&value, sizeof(T));
+    }
+    void write_value(const std::string &value);
+    void write_value(const atom &value);
+    void write_value(const util::slice &value);
+    void write_value(const util::packed_slice &value);
+    template <typename T>
+    void write_value(const std::vector<T> &value)
+    {
+        write_u32(value.size());
+        if constexpr (std::is_trivially_copyable<T>::value) {
+            write_bytes(value.data(), value.size() * sizeof(T));
+        } else {
+            for (auto &&element : value) {
+                write_value(element);
+            }
+        }
+    }
+
+    // (func) field
+    // Writes the value of the given property.
+    template <typename T>
+    void field(prop<T> &prop, const std::string &label)
+    {
+        write_value(prop.get());
+    }
+};
+
+/*
+ * res::project_reader
+ *
+ * A Reflector which reads the values of each asset's properties from project
+ * file data written by res::project_writer, and sets them on the asset in the
+ * given transaction.
+ *
+ * Byte data (util::slice) is not copied, but instead shares the storage of the
+ * given file data, so a memory-mapped project file (see util::map_file) is only
+ * read from the disk as that data is used. Packed data (util::packed_slice) is
+ * compressed as it is read if it is at least as large as the project's pack
+ * threshold, the same as misc::raw_data::set_data.
+ *
+ * Throws res::import_error if the file data is invalid.
+ */
+class project_reader : private util::nocopy {
+private:
+    // (var) m_ts
+    // The transaction in which the properties are set.
+    transact::teller &m_ts;
+
+    // (var) m_data
+    // The project file data.
+    util::slice m_data;
+
+    // (var) m_pos
+    // The offset in m_data of the next byte to be read.
+    size_t m_pos;
+
+    // (var) m_asset_end
+    // The offset in m_data of the end of the asset currently being read.
+    size_t m_asset_end;
+
+    // (var) m_assets_left
+    // The number of assets which have not yet been read.
+    uint32_t m_assets_left;
+
+    // (var) m_pack_threshold
+    // The project's pack threshold (see project::set_pack_threshold), which
+    // applies to the packed data read from the file.
+    size_t m_pack_threshold;
+
+    // (var) m_atoms
+    // The names read from the file's name table, in the same order.
+    std::vector<atom> m_atoms;
+
+public:
+    // (explicit ctor)
+    // Constructs a reader for the given project file data, reading the file's
+    // header and name table. The names are relative to the root of `proj'.
+    explicit project_reader(TRANSACT, project &proj, util::slice data);
+
+    // (s-func) is_project_file
+    // Returns true if the given data begins with the project file header. This
+    // does not check whether the rest of the data is valid.
+    static bool is_project_file(const util::slice &data);
+
+    // (func) read_bytes
+    // Reads the given number of bytes into `data'.
+    void read_bytes(void *data, size_t size);
+
+    // (func) read_u32, read_u64
+    // Reads an unsigned integer.
+    uint32_t read_u32()
+    {
+        uint32_t value;
+        read_bytes(&value, sizeof(value));
+        return value;
+    }
+    uint64_t read_u64()
+    {
+        uint64_t value;
+        read_bytes(&value, sizeof(value));
+        return value;
+    }
+
+    // (func) begin_asset, end_asset
+    // Begins reading the record of the next asset, returning its type name and
+    // name, or returns false if there are no more assets. The asset's
+    // properties are read in between, normally by passing this reader to the
+    // asset's `reflect' function, and must fill the record exactly.
+    bool begin_asset(std::string &type_name, atom &name);
+    void end_asset();
+
+    // (func) read_value
+    // Reads a value written by project_writer::write_value.
+    template <typename T>
+    std::enable_if_t<std::is_trivially_copyable<T>::value>
+        read_value(T &value)
+    {
+        read_bytes(&value, sizeof(T));
+    }
+    void read_value(std::string &value);
+    void read_value(atom &value);
+    void read_value(util::slice &value);
+    void read_value(util::packed_slice &value);
+    template <typename T>
+    void read_value(std::vector<T> &value)
+    {
+        size_t count = read_u32();
+        if constexpr (std::is_trivially_copyable<T>::value) {
+            if (count > (m_asset_end - m_pos) / sizeof(T))
+                throw import_error("res::project_reader: array too long");
+
+            value.resize(count);
+            read_bytes(value.data(), count * sizeof(T));
+        } else {
+            // Each element takes at least four bytes, so a count which could
+            // not fit in the rest of the asset is rejected before allocating
+            // space for it.
+            if (count > (m_asset_end - m_pos) / 4)
+                throw import_error("res::project_reader: array too long");
+
+            value.resize(count);
+            for (auto &&element : value) {
+                read_value(element);
+            }
+        }
+    }
+
+    // (func) field
+    // Reads a value and sets the given property to it.
+    template <typename T>
+    void field(prop<T> &prop, const std::string &label)
+    {
+        T value{};
+        read_value(value);
+        prop.set(m_ts, std::move(value));
+    }
+};
+
+/*
+ * res::project_file<Types...>
+ *
+ * Saves and loads a project's assets and their properties as a single binary
+ * file. Only assets of the given types are supported, each of which must have
+ * a `reflect' function covering all of its properties and an entry in
+ * reflect::asset_type_info giving its name.
+ *
+ * The file holds the name table and then each asset in turn, as its type name,
+ * its name and its properties (see res::project_writer). Loading a file reads
+ * each property directly into place, rather than decoding the file the asset
+ * data was originally imported from.
+ */
+template <typename... Types>
+class project_file {
+private:
+    // (s-func) save_asset<T, Rest...>
+    // Writes the given asset if its type is exactly T, or otherwise tries the
+    // remaining types. Returns false if none of the types match.
+    template <typename T, typename... Rest>
+    static bool save_asset(project_writer &w, asset &asset)
+    {
+        if (typeid(asset) != typeid(T)) {
+            if constexpr (sizeof...(Rest) > 0) {
+                return save_asset<Rest...>(w, asset);
+            } else {
+                return false;
+            }
+        }
+
+        w.begin_asset(reflect::asset_type_info<T>::name, asset.get_name());
+        static_cast<T &>(asset).reflect(w);
+        w.end_asset();
+        return true;
+    }
+
+    // (s-func) load_asset<T, Rest...>
+    // Creates an asset of type T on the given name and reads its properties if
+    // `type_name' is the name of T, or otherwise tries the remaining types.
+    // Returns false if none of the types match.
+    template <typename T, typename... Rest>
+    static bool load_asset(
+        TRANSACT,
+        project_reader &r,
+        project &proj,
+        const std::string &type_name,
+        const atom &name)
+    {
+        if (type_name != reflect::asset_type_info<T>::name) {
+            if constexpr (sizeof...(Rest) > 0) {
+                return load_asset<Rest...>(TS, r, proj, type_name, name);
+            } else {
+                return false;
+            }
+        }
+
+        asset::create<T>(TS, name, proj);
+        name.get_as<T>()->reflect(r);
+        return true;
+    }
+
+public:
+    // (s-func) save
+    // Returns the project file data for all of the assets in the project.
+    // Throws res::export_error if any asset is not of one of the given types.
+    static util::blob save(project &proj)
+    {
+        project_writer w(proj);
+        for (auto &&asset : proj.get_asset_list()) {
+            if (!save_asset<Types...>(w, *asset))
+                throw export_error("res::project_file: unsupported asset type");
+        }
+        return w.finish();
+    }
+
+    // (s-func) load
+    // Creates the assets held in the given project file data. Throws
+    // res::import_error if the data is invalid, holds an asset type which is
+    // not one of the given types, or holds an asset on a name which is already
+    // in use.
+    static void load(TRANSACT, project &proj, util::slice data)
+    {
+        project_reader r(TS, proj, std::move(data));
+        std::string type_name;
+        atom name;
+        while (r.begin_asset(type_name, name)) {
+            if (name.get())
+                throw import_error("res::project_file: name in use");
+
+            if (!load_asset<Types...>(TS, r, proj, type_name, name))
+                throw import_error("res::project_file: unsupported asset type");
+
+            r.end_asset();
+        }
+    }
+};
+
+}
+}
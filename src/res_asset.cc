@@ -52,6 +52,7 @@ public:
     // FIXME explain
     void execute() noexcept override
     {
+        m_asset.update_revision();
         if (m_appear) {
             m_proj.on_asset_appear(m_asset);
         } else {
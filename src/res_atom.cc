@@ -19,51 +19,464 @@
 //
 
 #include "common.hh"
+#include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <mutex>
+#include <set>
+#include <thread>
 #include "res.hh"
 
 namespace drnsf {
 namespace res {
 
-// (internal class) nucleus_name_comparator
-// FIXME explain
-struct nucleus_name_comparator {
-    bool operator()(const char *lhs, const char *rhs) const
-    {
-        return (std::strcmp(lhs, rhs) < 0);
+namespace {
+
+// (s-var) inline_name_size
+// The size of the name buffer held within each nucleus. Longer names are held
+// in a separate allocation.
+constexpr size_t inline_name_size = 24;
+
+// (s-var) arena_block_size
+// The number of nuclei allocated at once by the nucleus arena.
+constexpr size_t arena_block_size = 256;
+
+// (s-var) lock_count
+// The number of mutexes shared by the children tables of every nucleus in a
+// tree (see nucleus::root_ext::lock_for).
+constexpr size_t lock_count = 64;
+
+// (s-var) no_index
+// The value of nucleus::m_index for nuclei which are not in their parent's
+// index table.
+constexpr uint32_t no_index = 0xFFFFFFFF;
+
+// (s-var) max_cached_index
+// The highest index which atom::indexed remembers in an index table, so that
+// a stray large index cannot make the table huge.
+constexpr size_t max_cached_index = 0xFFFF;
+
+// (s-func) hash_name
+// Returns a hash of the given name for use in the children tables of nuclei,
+// and sets `len' to the name's length.
+uint32_t hash_name(const char *s, size_t &len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    const char *p = s;
+    for (; *p; p++) {
+        hash ^= static_cast<unsigned char>(*p);
+        hash *= 16777619u;
     }
-};
+    len = p - s;
+    return hash;
+}
+
+}
 
 // (inner class) nucleus
-// FIXME explain
+// The shared state of every atom with the same name. Each nucleus holds a
+// reference to its parent, so the root nucleus is always the last to be
+// destroyed.
+//
+// Nuclei other than the root are allocated from an arena owned by the root
+// (see nucleus::arena), and each nucleus finds its children through an
+// open-addressing hash table keyed by the hash of their names.
+//
+// Atoms may be used from any thread. The reference count is atomic, and the
+// children table and index table of each nucleus are guarded by the mutex
+// given by root_ext::lock_for. A nucleus is only removed from its parent's
+// table while holding that mutex, and only if its reference count drops to
+// zero while it is held, so a lookup can never find a nucleus which is being
+// destroyed.
 struct atom::nucleus {
+    // (inner struct) arena
+    // See below.
+    struct arena;
+
+    // (inner struct) root_ext
+    // See below.
+    struct root_ext;
+
+    // (inner struct) index_table
+    // The children found through atom::indexed, by their index. All of them
+    // have the same name prefix.
+    struct index_table {
+        std::string prefix;
+        std::vector<nucleus *> children;
+    };
+
     // (var) m_refcount
-    // FIXME explain
-    int m_refcount;
+    // The number of atoms referring to this nucleus, plus the number of its
+    // children.
+    std::atomic<int> m_refcount{0};
+
+    // (var) m_hash
+    // The hash of m_name (see hash_name).
+    uint32_t m_hash = 0;
 
     // (var) m_name
-    // FIXME explain
-    const char *m_name;
+    // The name of this nucleus, pointing to either m_inline_name or
+    // m_long_name.
+    const char *m_name = nullptr;
 
     // (var) m_parent
-    // FIXME explain
-    nucleus *m_parent;
+    // The parent of this nucleus, or null if this is the root.
+    nucleus *m_parent = nullptr;
 
     // (var) m_asset
-    // FIXME explain
-    asset *m_asset;
+    // The asset currently on this name, if any.
+    asset *m_asset = nullptr;
 
     // (var) m_children
-    // FIXME explain
-    std::map<const char *, nucleus *, nucleus_name_comparator> m_children;
+    // The children table, with m_child_capacity slots (a power of two) each
+    // holding a child or null. This is null if there are no children.
+    std::unique_ptr<nucleus *[]> m_children;
+
+    // (var) m_child_capacity, m_child_count
+    // The number of slots in the children table, and the number of them which
+    // are in use.
+    uint32_t m_child_capacity = 0;
+    uint32_t m_child_count = 0;
+
+    // (var) m_index
+    // The position of this nucleus in its parent's index table, or no_index if
+    // it is not in the table.
+    uint32_t m_index = no_index;
+
+    // (var) m_index_table
+    // The index table, or null if atom::indexed has not been used on this
+    // nucleus.
+    std::unique_ptr<index_table> m_index_table;
+
+    // (var) m_long_name
+    // The storage for m_name if it does not fit in m_inline_name.
+    std::unique_ptr<char[]> m_long_name;
+
+    // (var) m_inline_name
+    // The storage for m_name if it is short enough.
+    char m_inline_name[inline_name_size];
+
+    // (var) m_root_ext
+    // The extra data stored after the root nucleus, which is shared by every
+    // nucleus in the tree.
+    root_ext *m_root_ext = nullptr;
+
+    // (var) m_full_path
+    // The full path of this nucleus (see atom::full_path), or null if it has
+    // not been asked for yet. Names never change, so this is never
+    // invalidated. This is owned by the nucleus, and is atomic so that threads
+    // racing to build it agree on which one is kept.
+    std::atomic<std::string *> m_full_path{nullptr};
+
+    // (dtor)
+    // Frees the full path, if it was built.
+    ~nucleus() noexcept
+    {
+        delete m_full_path.load(std::memory_order_relaxed);
+    }
+
+    // (func) get_root_ext
+    // Returns the extra data stored after the root nucleus.
+    root_ext &get_root_ext() const
+    {
+        return *m_root_ext;
+    }
+
+    // (func) append_path
+    // Appends the full path of this nucleus to `out', using the saved paths of
+    // this nucleus or its parents where available.
+    void append_path(std::string &out) const
+    {
+        auto full_path = m_full_path.load(std::memory_order_acquire);
+        if (full_path) {
+            out += *full_path;
+        } else if (m_parent) {
+            m_parent->append_path(out);
+            out += '/';
+            out += m_name;
+        }
+    }
+
+    // (func) find_child
+    // Returns the child with the given name and name hash, or null if there is
+    // no such child.
+    nucleus *find_child(const char *name, uint32_t hash) const
+    {
+        if (!m_child_capacity)
+            return nullptr;
+
+        uint32_t mask = m_child_capacity - 1;
+        for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+            auto child = m_children[i];
+            if (!child)
+                return nullptr;
+            if (child->m_hash == hash && std::strcmp(child->m_name, name) == 0)
+                return child;
+        }
+    }
+
+    // (func) place_child
+    // Puts the given child in the first free slot for its hash. The table must
+    // have at least one free slot.
+    void place_child(nucleus *child)
+    {
+        uint32_t mask = m_child_capacity - 1;
+        uint32_t i = child->m_hash & mask;
+        while (m_children[i]) {
+            i = (i + 1) & mask;
+        }
+        m_children[i] = child;
+    }
+
+    // (func) insert_child
+    // Adds the given child to the table, which must not already hold a child
+    // with the same name. The table is grown beforehand if it would become
+    // more than 3/4 full.
+    void insert_child(nucleus *child)
+    {
+        if ((m_child_count + 1) * 4 > m_child_capacity * 3) {
+            uint32_t new_capacity = m_child_capacity ? m_child_capacity * 2 : 8;
+            std::unique_ptr<nucleus *[]> old_children(
+                new nucleus *[new_capacity]()
+            );
+            std::swap(m_children, old_children);
+            auto old_capacity = m_child_capacity;
+            m_child_capacity = new_capacity;
+            for (uint32_t i = 0; i < old_capacity; i++) {
+                if (old_children[i]) {
+                    place_child(old_children[i]);
+                }
+            }
+        }
+
+        place_child(child);
+        m_child_count++;
+    }
+
+    // (func) remove_child
+    // Removes the given child from the table. Any children after it in the same
+    // run of slots are moved back as needed, so that no lookup passes over the
+    // emptied slot.
+    void remove_child(nucleus *child)
+    {
+        uint32_t mask = m_child_capacity - 1;
+        uint32_t i = child->m_hash & mask;
+        while (m_children[i] != child) {
+            i = (i + 1) & mask;
+        }
+        m_children[i] = nullptr;
+
+        for (uint32_t j = (i + 1) & mask; m_children[j]; j = (j + 1) & mask) {
+            // Move the child in slot j into the empty slot i, unless its home
+            // slot lies cyclically within (i, j], in which case it must stay.
+            uint32_t home = m_children[j]->m_hash & mask;
+            bool stays = (i <= j) ?
+                (i < home && home <= j) :
+                (i < home || home <= j);
+            if (!stays) {
+                m_children[i] = m_children[j];
+                m_children[j] = nullptr;
+                i = j;
+            }
+        }
+
+        // Release the table once there are no children left, as most nuclei
+        // have no children at all.
+        if (--m_child_count == 0) {
+            m_children.reset();
+            m_child_capacity = 0;
+        }
+    }
+
+    // (func) first_child
+    // Returns the child in the lowest occupied slot of the table, or null if
+    // there are no children.
+    nucleus *first_child() const
+    {
+        for (uint32_t i = 0; i < m_child_capacity; i++) {
+            if (m_children[i])
+                return m_children[i];
+        }
+        return nullptr;
+    }
+
+    // (func) next_sibling
+    // Returns the child of this nucleus's parent in the next occupied slot
+    // after this one, or null if this is in the last occupied slot. Together
+    // with first_child, this visits every child once in order of their slots.
+    nucleus *next_sibling() const
+    {
+        auto parent = m_parent;
+        uint32_t mask = parent->m_child_capacity - 1;
+        uint32_t i = m_hash & mask;
+        while (parent->m_children[i] != this) {
+            i = (i + 1) & mask;
+        }
+
+        for (i++; i < parent->m_child_capacity; i++) {
+            if (parent->m_children[i])
+                return parent->m_children[i];
+        }
+        return nullptr;
+    }
+
+    // (func) get_lock
+    // Returns the mutex guarding the children table and index table of this
+    // nucleus. See root_ext::lock_for.
+    std::mutex &get_lock() const;
+
+    // (func) get_child
+    // Returns the child with the given name, creating it if there is no such
+    // child. The caller must hold the mutex given by get_lock.
+    atom get_child(const char *name, size_t name_len, uint32_t hash);
+};
+
+// (inner struct) nucleus::arena
+// Allocates the storage for nuclei in blocks, and keeps the storage of
+// destroyed nuclei for reuse. The storage is only released once the arena is
+// destroyed along with the root nucleus.
+//
+// Nuclei may be created and destroyed on any thread, so the arena is guarded by
+// a mutex.
+struct atom::nucleus::arena {
+    // (inner union) slot
+    // The storage for one nucleus, or a link in the free list if unused.
+    union slot {
+        slot *next;
+        alignas(nucleus) unsigned char storage[sizeof(nucleus)];
+    };
+
+    // (var) m_mutex
+    // The mutex guarding the members below.
+    std::mutex m_mutex;
+
+    // (var) m_blocks
+    // The blocks of slots allocated so far.
+    std::vector<std::unique_ptr<slot[]>> m_blocks;
+
+    // (var) m_free
+    // The first unused slot, or null if there are none.
+    slot *m_free = nullptr;
+
+    // (func) allocate
+    // Returns storage for a nucleus.
+    void *allocate()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_free) {
+            m_blocks.emplace_back(new slot[arena_block_size]);
+            auto &&block = m_blocks.back();
+            for (size_t i = 0; i < arena_block_size; i++) {
+                block[i].next = m_free;
+                m_free = &block[i];
+            }
+        }
+        auto result = m_free;
+        m_free = result->next;
+        return result;
+    }
+
+    // (func) deallocate
+    // Returns storage given by `allocate' for reuse.
+    void deallocate(void *p) noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto s = static_cast<slot *>(p);
+        s->next = m_free;
+        m_free = s;
+    }
+};
+
+// (inner struct) nucleus::root_ext
+// The extra data stored directly after the root nucleus in memory.
+struct atom::nucleus::root_ext {
+    // (var) m_proj
+    // The project given to atom::make_root.
+    project *m_proj;
+
+    // (var) m_arena
+    // The arena for the nuclei below this root.
+    arena m_arena;
+
+    // (var) m_locks
+    // The mutexes guarding the children tables of the nuclei below this root.
+    // Each mutex is shared by many nuclei, as giving every nucleus its own
+    // would make them much larger, and few nuclei are ever used by more than
+    // one thread at once.
+    std::mutex m_locks[lock_count];
+
+    // (explicit ctor)
+    // Constructs the extra data for a root belonging to the given project.
+    explicit root_ext(project *proj) :
+        m_proj(proj) {}
+
+    // (func) lock_for
+    // Returns the mutex guarding the children table of the given nucleus. The
+    // nuclei in each arena block are next to each other in memory, so they are
+    // spread evenly over the mutexes.
+    std::mutex &lock_for(const nucleus *nuc)
+    {
+        auto n = reinterpret_cast<uintptr_t>(nuc) / sizeof(nucleus);
+        return m_locks[n % lock_count];
+    }
 };
 
+// declared above
+std::mutex &atom::nucleus::get_lock() const
+{
+    return m_root_ext->lock_for(this);
+}
+
+// declared above
+atom atom::nucleus::get_child(const char *name, size_t name_len, uint32_t hash)
+{
+    auto child = find_child(name, hash);
+    if (child) {
+        return atom(child);
+    }
+
+    auto &&arena = get_root_ext().m_arena;
+    auto newnuc_space = arena.allocate();
+
+    nucleus *newnuc;
+    try {
+        newnuc = new(newnuc_space) nucleus;
+    } catch (...) {
+        arena.deallocate(newnuc_space);
+        throw;
+    }
+
+    try {
+        char *newname = newnuc->m_inline_name;
+        if (name_len >= inline_name_size) {
+            newnuc->m_long_name.reset(new char[name_len + 1]);
+            newname = newnuc->m_long_name.get();
+        }
+        std::memcpy(newname, name, name_len + 1);
+        newnuc->m_name = newname;
+        newnuc->m_hash = hash;
+        newnuc->m_parent = this;
+        newnuc->m_root_ext = m_root_ext;
+
+        insert_child(newnuc);
+    } catch (...) {
+        newnuc->~nucleus();
+        arena.deallocate(newnuc_space);
+        throw;
+    }
+
+    m_refcount.fetch_add(1, std::memory_order_relaxed);
+
+    return atom(newnuc);
+}
+
 // declared in res.hh
 atom::atom(nucleus *nuc) noexcept :
     m_nuc(nuc)
 {
     if (m_nuc) {
-        m_nuc->m_refcount++;
+        m_nuc->m_refcount.fetch_add(1, std::memory_order_relaxed);
     }
 }
 
@@ -79,20 +492,18 @@ asset *&atom::get_internal_asset_ptr() const
 // declared in res.hh
 atom atom::make_root(project *proj)
 {
-    auto nuc_space = operator new(sizeof(nucleus) + sizeof(project *));
+    auto nuc_space = operator new(sizeof(nucleus) + sizeof(nucleus::root_ext));
 
     nucleus *nuc;
     try {
         nuc = new(nuc_space) nucleus;
+        new(nuc + 1) nucleus::root_ext(proj);
     } catch (...) {
         operator delete(nuc_space);
         throw;
     }
-    nuc->m_refcount = 0;
     nuc->m_name = "_ROOT";
-    nuc->m_parent = nullptr;
-    nuc->m_asset = nullptr;
-    std::memcpy(nuc + 1, &proj, sizeof(project *));
+    nuc->m_root_ext = reinterpret_cast<nucleus::root_ext *>(nuc + 1);
     return atom(nuc);
 }
 
@@ -113,7 +524,7 @@ atom::atom(const atom &src) noexcept :
     m_nuc(src.m_nuc)
 {
     if (m_nuc) {
-        m_nuc->m_refcount++;
+        m_nuc->m_refcount.fetch_add(1, std::memory_order_relaxed);
     }
 }
 
@@ -128,13 +539,50 @@ atom::atom(atom &&src) noexcept :
 atom::~atom() noexcept
 {
     nucleus *nuc = m_nuc;
-    while (nuc && --nuc->m_refcount == 0) {
+    while (nuc) {
+        // Releasing a reference other than the last one needs no lock.
+        int count = nuc->m_refcount.load(std::memory_order_relaxed);
+        while (count > 1) {
+            if (nuc->m_refcount.compare_exchange_weak(
+                count,
+                count - 1,
+                std::memory_order_acq_rel)) {
+                return;
+            }
+        }
+
         nucleus *parent = nuc->m_parent;
-        if (parent) {
-            parent->m_children.erase(nuc->m_name);
+        if (!parent) {
+            // This is the root, so every other nucleus is already gone, and
+            // the arena can be destroyed along with it. No other thread can
+            // find the root without already holding a reference to it.
+            if (nuc->m_refcount.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                return;
+
+            nuc->m_root_ext->~root_ext();
+            nuc->~nucleus();
+            operator delete(nuc);
+            return;
         }
+
+        // The last reference is released while holding the parent's lock, so
+        // that no other thread can find this nucleus in the parent's table in
+        // the meantime. Another thread may have found it before the lock was
+        // taken, in which case it is still in use.
+        {
+            std::lock_guard<std::mutex> lock(parent->get_lock());
+            if (nuc->m_refcount.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                return;
+
+            parent->remove_child(nuc);
+            if (nuc->m_index != no_index) {
+                parent->m_index_table->children[nuc->m_index] = nullptr;
+            }
+        }
+
+        auto &&arena = parent->get_root_ext().m_arena;
         nuc->~nucleus();
-        operator delete(nuc);
+        arena.deallocate(nuc);
         nuc = parent;
     }
 }
@@ -195,44 +643,75 @@ atom atom::operator /(const char *s) const
         throw std::logic_error("res::atom::(slash op): atom is null");
     }
 
-    auto name_len = std::strlen(s);
+    size_t name_len;
+    auto hash = hash_name(s, name_len);
     if (name_len == 0) {
         throw std::logic_error("res::atom::(slash op): string is empty");
     }
 
-    auto iter = m_nuc->m_children.find(s);
-    if (iter != m_nuc->m_children.end()) {
-        return atom(iter->second);
+    std::lock_guard<std::mutex> lock(m_nuc->get_lock());
+    return m_nuc->get_child(s, name_len, hash);
+}
+
+// declared in res.hh
+atom atom::indexed(const char *prefix, size_t index) const
+{
+    if (!m_nuc) {
+        throw std::logic_error("res::atom::indexed: atom is null");
     }
 
-    auto newnuc_space = operator new(sizeof(nucleus) + name_len + 1);
+    // Build the name on the stack, with the digits written backwards from the
+    // end of the buffer.
+    auto prefix_len = std::strlen(prefix);
+    char name[64];
+    char *digits = name + sizeof(name);
+    *--digits = '\0';
+    size_t value = index;
+    do {
+        *--digits = '0' + value % 10;
+        value /= 10;
+    } while (value);
 
-    nucleus *newnuc;
-    try {
-        newnuc = new(newnuc_space) nucleus;
-    } catch (...) {
-        operator delete(newnuc_space);
-        throw;
+    if (prefix_len > static_cast<size_t>(digits - name)) {
+        return *this / (prefix + std::string(digits));
     }
+    digits -= prefix_len;
+    std::memcpy(digits, prefix, prefix_len);
 
-    auto name = static_cast<char *>(newnuc_space) + sizeof(nucleus);
-    newnuc->m_refcount = 0;
-    newnuc->m_name = name;
-    newnuc->m_parent = m_nuc;
-    newnuc->m_asset = nullptr;
-    std::strcpy(name, s);
+    std::lock_guard<std::mutex> lock(m_nuc->get_lock());
 
-    try {
-        m_nuc->m_children.insert({name, newnuc});
-    } catch (...) {
-        newnuc->~nucleus();
-        operator delete(newnuc_space);
-        throw;
+    auto &&table = m_nuc->m_index_table;
+    if (table &&
+        index < table->children.size() &&
+        table->children[index] &&
+        table->prefix == prefix) {
+        return atom(table->children[index]);
     }
 
-    m_nuc->m_refcount++;
+    // Remember the child for next time, unless the table is already in use for
+    // a different prefix. The table is grown before the child is found, as no
+    // atom may be released while the lock is held.
+    bool cache = false;
+    if (index <= max_cached_index) {
+        if (!table) {
+            table.reset(new nucleus::index_table{prefix, {}});
+        }
+        if (table->prefix == prefix) {
+            if (index >= table->children.size()) {
+                table->children.resize(index + 1);
+            }
+            cache = true;
+        }
+    }
 
-    return atom(newnuc);
+    size_t name_len;
+    auto hash = hash_name(digits, name_len);
+    auto result = m_nuc->get_child(digits, name_len, hash);
+    if (cache) {
+        table->children[index] = result.m_nuc;
+        result.m_nuc->m_index = index;
+    }
+    return result;
 }
 
 // declared in res.hh
@@ -275,14 +754,47 @@ std::string atom::name() const
 }
 
 // declared in res.hh
-std::string atom::full_path() const
+const std::string &atom::full_path() const
 {
+    static const std::string null_path = "[null]";
+    static const std::string root_path;
+
     if (!m_nuc) {
-        return "[null]";
+        return null_path;
     } else if (!m_nuc->m_parent) {
-        return "";
+        return root_path;
+    }
+
+    auto full_path = m_nuc->m_full_path.load(std::memory_order_acquire);
+    if (!full_path) {
+        // Build the path from the parent's path, saving that as well. This
+        // way, the paths of siblings only need their parent's path built once.
+        auto &&parent_path = atom(m_nuc->m_parent).full_path();
+        std::unique_ptr<std::string> path(new std::string);
+        path->reserve(parent_path.size() + 1 + std::strlen(m_nuc->m_name));
+        *path += parent_path;
+        *path += '/';
+        *path += m_nuc->m_name;
+
+        // If another thread saved its path first, use that one instead.
+        if (m_nuc->m_full_path.compare_exchange_strong(
+            full_path,
+            path.get(),
+            std::memory_order_acq_rel,
+            std::memory_order_acquire)) {
+            full_path = path.release();
+        }
+    }
+    return *full_path;
+}
+
+// declared in res.hh
+void atom::append_path(std::string &out) const
+{
+    if (!m_nuc) {
+        out += "[null]";
     } else {
-        return atom(m_nuc->m_parent).full_path() + "/" + m_nuc->m_name;
+        m_nuc->append_path(out);
     }
 }
 
@@ -307,12 +819,36 @@ std::vector<atom> atom::get_children() const
         throw std::logic_error("res::atom::get_children: atom is null");
     }
 
+    // The list is reserved before taking the lock, as no atom may be released
+    // while the lock is held. Other threads may add children in the meantime,
+    // so this is repeated until the list is large enough.
     std::vector<atom> result;
-    for (auto &&kv : m_nuc->m_children) {
-        auto &&child = kv.second;
-        atom child_atom(child);
-        result.push_back(child_atom);
+    for (;;) {
+        std::unique_lock<std::mutex> lock(m_nuc->get_lock());
+        if (result.capacity() < m_nuc->m_child_count) {
+            size_t count = m_nuc->m_child_count;
+            lock.unlock();
+            result.reserve(count);
+            continue;
+        }
+
+        for (uint32_t i = 0; i < m_nuc->m_child_capacity; i++) {
+            if (m_nuc->m_children[i]) {
+                result.push_back(atom(m_nuc->m_children[i]));
+            }
+        }
+        break;
     }
+
+    // The children table is in no particular order, so the children are
+    // sorted by name to give the same order every time.
+    std::sort(
+        result.begin(),
+        result.end(),
+        [](const atom &lhs, const atom &rhs) {
+            return std::strcmp(lhs.m_nuc->m_name, rhs.m_nuc->m_name) < 0;
+        }
+    );
     return result;
 }
 
@@ -325,21 +861,58 @@ std::vector<atom> atom::get_children_recursive() const
         );
     }
 
+    // The walk goes through the children tables directly, rather than building
+    // and sorting a list of children at every level.
     std::vector<atom> result;
-    for (auto &&kv : m_nuc->m_children) {
-        auto &&child = kv.second;
-        atom child_atom(child);
-        result.push_back(child_atom);
-        auto subchildren = child_atom.get_children_recursive();
-        result.insert(
-            result.end(),
-            subchildren.begin(),
-            subchildren.end()
-        );
+    walker w(*this);
+    while (w.next()) {
+        result.push_back(w.get());
     }
     return result;
 }
 
+// declared in res.hh
+atom::walker::walker(atom top) :
+    m_top(std::move(top)),
+    m_current(m_top),
+    m_descend(true)
+{
+    if (!m_top) {
+        throw std::logic_error("res::atom::walker: atom is null");
+    }
+}
+
+// declared in res.hh
+bool atom::walker::next()
+{
+    if (!m_current)
+        return false;
+
+    // Find the next atom before releasing the current one, as releasing it
+    // may destroy it. Each children table is read while holding its lock, and
+    // the current atom keeps every table along the way alive.
+    atom next;
+    auto nuc = m_current.m_nuc;
+    if (m_descend) {
+        std::lock_guard<std::mutex> lock(nuc->get_lock());
+        auto child = nuc->first_child();
+        if (child) {
+            next = atom(child);
+        }
+    }
+    for (; !next && nuc != m_top.m_nuc; nuc = nuc->m_parent) {
+        std::lock_guard<std::mutex> lock(nuc->m_parent->get_lock());
+        auto sibling = nuc->next_sibling();
+        if (sibling) {
+            next = atom(sibling);
+        }
+    }
+
+    m_descend = true;
+    m_current = std::move(next);
+    return bool(m_current);
+}
+
 // declared in res.hh
 project *atom::get_proj() const
 {
@@ -347,19 +920,224 @@ project *atom::get_proj() const
         throw std::logic_error("res::atom::get_proj: atom is null");
     }
 
-    // Find the root atom.
-    auto top = m_nuc;
-    while (top->m_parent) {
-        top = top->m_parent;
+    return m_nuc->m_root_ext->m_proj;
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(res_atom, Children)
+{
+    auto root = atom::make_root(nullptr);
+    EXPECT_EQ(root.get_proj(), nullptr);
+
+    // Create enough children to grow the children table several times, with
+    // some long enough to need separate storage for their names.
+    std::vector<atom> children;
+    for (int i = 0; i < 1000; i++) {
+        auto name = "child-$"_fmt(i);
+        if (i % 7 == 0) {
+            name += "-with-a-name-longer-than-the-inline-buffer";
+        }
+        children.push_back(root / name);
+        EXPECT_EQ(children.back().name(), name);
+        EXPECT_EQ(children.back().get_parent(), root);
+    }
+
+    // Looking up an existing name gives the same atom.
+    for (int i = 0; i < 1000; i++) {
+        EXPECT_EQ(root / children[i].name(), children[i]);
+    }
+
+    // Release some of the children, and check that the rest can still be
+    // found. Released names give new atoms with no asset.
+    for (int i = 0; i < 1000; i += 3) {
+        children[i] = nullptr;
+    }
+    for (int i = 0; i < 1000; i++) {
+        if (i % 3 == 0)
+            continue;
+        EXPECT_EQ(root / children[i].name(), children[i]);
+    }
+    EXPECT_EQ(root.get_children().size(), 666u);
+
+    // The children are listed in order of their names.
+    auto list = root.get_children();
+    for (size_t i = 1; i < list.size(); i++) {
+        EXPECT_LT(list[i - 1].name(), list[i].name());
     }
 
-    // Retrieve the project pointer stashed after the nucleus structure in
-    // memory.
-    project *proj;
-    std::memcpy(&proj, top + 1, sizeof(project *));
+    // Grandchildren keep their parents alive.
+    auto grandchild = root / "a" / "b" / "c";
+    EXPECT_EQ(grandchild.full_path(), "/a/b/c");
+    EXPECT_EQ(&grandchild.full_path(), &(root / "a" / "b" / "c").full_path());
+    EXPECT_EQ(grandchild.get_parent().full_path(), "/a/b");
+    EXPECT_EQ(root.full_path(), "");
+    EXPECT_EQ(atom().full_path(), "[null]");
+
+    std::string path = "path: ";
+    (root / "a" / "d").append_path(path);
+    EXPECT_EQ(path, "path: /a/d");
+    root.append_path(path);
+    atom().append_path(path);
+    EXPECT_EQ(path, "path: /a/d[null]");
+    EXPECT_EQ((root / "a" / "b").get_children().size(), 1u);
+    children.clear();
+    list.clear();
+    EXPECT_EQ(root.get_children().size(), 1u);
+    EXPECT_EQ(root.get_children_recursive().size(), 3u);
+}
+
+TEST(res_atom, Indexed)
+{
+    auto root = atom::make_root(nullptr);
+
+    // Indexed children are the same as the children with the full name.
+    auto page_3 = root.indexed("page-", 3);
+    EXPECT_EQ(page_3.name(), "page-3");
+    EXPECT_EQ(page_3, root / "page-3");
+    EXPECT_EQ(root.indexed("page-", 3), page_3);
+    auto page_12 = root / "page-12";
+    EXPECT_EQ(root.indexed("page-", 12), page_12);
+    EXPECT_EQ(root.indexed("page-", 0).name(), "page-0");
+
+    // Other prefixes work the same way, without using the index table.
+    auto other = root.indexed("other-", 3);
+    EXPECT_EQ(other.name(), "other-3");
+    EXPECT_NE(other, page_3);
+    EXPECT_EQ(root.indexed("other-", 3), other);
+    EXPECT_EQ(root.indexed("page-", 3), page_3);
+
+    // Released children are removed from the table.
+    page_3 = nullptr;
+    page_3 = root.indexed("page-", 3);
+    EXPECT_EQ(root.get_children().size(), 3u);
+    EXPECT_EQ(page_3, root / "page-3");
+
+    // Long prefixes and large indices.
+    std::string long_prefix(100, 'x');
+    EXPECT_EQ(
+        root.indexed(long_prefix.c_str(), 7).name(),
+        long_prefix + "7"
+    );
+    EXPECT_EQ(
+        root.indexed("page-", 1234567890).name(),
+        "page-1234567890"
+    );
+}
+
+TEST(res_atom, Walker)
+{
+    auto root = atom::make_root(nullptr);
+
+    std::vector<atom> names;
+    for (int i = 0; i < 20; i++) {
+        auto dir = root / "dir-$"_fmt(i);
+        names.push_back(dir);
+        for (int j = 0; j < i; j++) {
+            names.push_back(dir / "file-$"_fmt(j));
+        }
+    }
+    names.push_back(root / "dir-3" / "file-0" / "deep");
+
+    // Every descendant is visited once, after its parent.
+    std::set<atom> seen;
+    atom::walker w(root);
+    while (w.next()) {
+        EXPECT_TRUE(seen.insert(w.get()).second);
+        if (w.get().get_parent() != root) {
+            EXPECT_EQ(seen.count(w.get().get_parent()), 1u);
+        }
+    }
+    EXPECT_FALSE(w.next());
+    EXPECT_EQ(seen, std::set<atom>(names.begin(), names.end()));
+    EXPECT_EQ(root.get_children_recursive().size(), names.size());
+
+    // Each atom is followed by its own descendants.
+    auto list = root.get_children_recursive();
+    EXPECT_EQ(std::set<atom>(list.begin(), list.end()), seen);
+    for (auto &&i : util::range_of(list)) {
+        auto &&parent = list[i].get_parent();
+        if (parent == root)
+            continue;
+
+        auto it = std::find(list.begin(), list.begin() + i, parent);
+        ASSERT_NE(it, list.begin() + i);
+        auto prefix = parent.full_path() + "/";
+        for (auto j = it + 1; j != list.begin() + i; ++j) {
+            EXPECT_EQ(j->full_path().compare(0, prefix.size(), prefix), 0);
+        }
+    }
+
+    // Skipped atoms have their descendants skipped as well.
+    size_t count = 0;
+    root.for_each_descendant([&](const atom &name) {
+        count++;
+        return name != root / "dir-3" && name != root / "dir-19";
+    });
+    EXPECT_EQ(count, names.size() - 3 - 1 - 19);
+
+    // Walks below the root stay below their top atom.
+    count = 0;
+    (root / "dir-3").for_each_descendant([&](const atom &) {
+        count++;
+        return true;
+    });
+    EXPECT_EQ(count, 4u);
+
+    count = 0;
+    (root / "dir-0").for_each_descendant([&](const atom &) {
+        count++;
+        return true;
+    });
+    EXPECT_EQ(count, 0u);
+}
+
+TEST(res_atom, Threads)
+{
+    auto root = atom::make_root(nullptr);
+    auto shared = root / "shared";
+
+    // Every thread creates, finds and releases the same few names at once, so
+    // that names are often released on one thread while another finds them.
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&shared, t] {
+            std::vector<atom> held(7);
+            for (int i = 0; i < 3000; i++) {
+                int d = (i + t) % 16;
+                int f = i % 37;
+                auto dir = shared.indexed("dir-", d);
+                auto file = dir / "file-$"_fmt(f);
+                EXPECT_EQ(file.get_parent(), dir);
+                EXPECT_EQ(file.full_path(), "/shared/dir-$/file-$"_fmt(d, f));
+                EXPECT_EQ(shared / "dir-$"_fmt(d), dir);
+
+                // Keep a few names alive for longer than one step.
+                held[i % held.size()] = file;
+
+                if (i % 50 == 0) {
+                    EXPECT_LE(shared.get_children().size(), 16u);
+                    shared.for_each_descendant([](const atom &name) {
+                        auto &&path = name.full_path();
+                        EXPECT_EQ(path.compare(0, 8, "/shared/"), 0);
+                        return true;
+                    });
+                }
+            }
+        });
+    }
+    for (auto &&thread : threads) {
+        thread.join();
+    }
+
+    // Every name created by the threads has been released.
+    EXPECT_EQ(shared.get_children().size(), 0u);
+    EXPECT_EQ(root.get_children_recursive().size(), 1u);
+}
 
-    return proj;
 }
+#endif
 
 }
 }
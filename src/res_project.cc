@@ -0,0 +1,66 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include "res.hh"
+
+namespace drnsf {
+namespace res {
+
+// declared in res.hh
+bool project::demand(const atom &name)
+{
+    if (!m_demand_handler)
+        return false;
+
+    if (!name)
+        return false;
+
+    auto asset = name.get();
+    if (!asset) {
+        if (name == m_root)
+            return false;
+
+        // Processing the asset above this name may create one on it.
+        if (!demand(name.get_parent()))
+            return false;
+
+        asset = name.get();
+        if (!asset)
+            return true;
+    }
+
+    if (m_transact.get_status() != transact::status::ready)
+        return false;
+
+    bool changed = false;
+    try {
+        m_transact.run([&](TRANSACT) {
+            TS.describe("Process '$'"_fmt(name.full_path()));
+            changed = m_demand_handler(TS, *asset);
+        });
+    } catch (import_error &) {
+        return false;
+    }
+    return changed;
+}
+
+}
+}
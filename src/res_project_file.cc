@@ -0,0 +1,492 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <cstring>
+#include "res.hh"
+
+namespace drnsf {
+namespace res {
+
+namespace {
+
+// (s-var) file_magic
+// The magic number at the start of every project file ("DRPJ").
+constexpr uint32_t file_magic = 0x4A505244;
+
+// (s-var) file_version
+// The version of the project file format. This must be increased whenever the
+// format changes, including when any asset type's `reflect' function changes.
+constexpr uint32_t file_version = 1;
+
+// (s-var) null_atom_id
+// The index written in place of a null name.
+constexpr uint32_t null_atom_id = 0xFFFFFFFF;
+
+}
+
+// declared in res.hh
+project_writer::project_writer(project &proj) :
+    m_proj(proj),
+    m_asset_count(0),
+    m_asset_start(0)
+{
+    m_atoms.push_back(proj.get_asset_root());
+    m_atom_ids.emplace(proj.get_asset_root(), 0);
+}
+
+// declared in res.hh
+uint32_t project_writer::get_atom_id(const atom &name)
+{
+    auto iter = m_atom_ids.find(name);
+    if (iter != m_atom_ids.end())
+        return iter->second;
+
+    if (name.get_proj() != &m_proj)
+        throw export_error("res::project_writer: name from another project");
+
+    // Ensure the parent is present first. This always ends at the root, which
+    // is added by the constructor.
+    get_atom_id(name.get_parent());
+
+    uint32_t id = m_atoms.size();
+    m_atoms.push_back(name);
+    m_atom_ids.emplace(name, id);
+    return id;
+}
+
+// declared in res.hh
+void project_writer::write_bytes(const void *data, size_t size)
+{
+    auto p = static_cast<const util::byte *>(data);
+    m_data.insert(m_data.end(), p, p + size);
+}
+
+// declared in res.hh
+void project_writer::begin_asset(const char *type_name, const atom &name)
+{
+    m_asset_count++;
+    write_value(std::string(type_name));
+    write_value(name);
+
+    // The size of the asset's data is filled in by end_asset.
+    m_asset_start = m_data.size();
+    write_u64(0);
+}
+
+// declared in res.hh
+void project_writer::end_asset()
+{
+    uint64_t size = m_data.size() - m_asset_start - sizeof(uint64_t);
+    std::memcpy(&m_data[m_asset_start], &size, sizeof(size));
+}
+
+// declared in res.hh
+util::blob project_writer::finish()
+{
+    // The header and name table are written by a second writer, as they can
+    // only be written once all of the names are known.
+    project_writer header(m_proj);
+    header.write_u32(file_magic);
+    header.write_u32(file_version);
+
+    // Write the name table. The root is always the first name, and is not
+    // written.
+    header.write_u32(m_atoms.size());
+    for (size_t i = 1; i < m_atoms.size(); i++) {
+        header.write_u32(m_atom_ids.at(m_atoms[i].get_parent()));
+        header.write_value(m_atoms[i].name());
+    }
+
+    header.write_u32(m_asset_count);
+
+    auto result = std::move(header.m_data);
+    result.insert(result.end(), m_data.begin(), m_data.end());
+    return result;
+}
+
+// declared in res.hh
+void project_writer::write_value(const std::string &value)
+{
+    write_u32(value.size());
+    write_bytes(value.data(), value.size());
+}
+
+// declared in res.hh
+void project_writer::write_value(const atom &value)
+{
+    write_u32(value ? get_atom_id(value) : null_atom_id);
+}
+
+// declared in res.hh
+void project_writer::write_value(const util::slice &value)
+{
+    write_u64(value.size());
+    write_bytes(value.data(), value.size());
+}
+
+// declared in res.hh
+void project_writer::write_value(const util::packed_slice &value)
+{
+    // The data is written uncompressed, so that the reader can share it
+    // directly from the file.
+    write_value(value.unpack());
+}
+
+// declared in res.hh
+project_reader::project_reader(TRANSACT, project &proj, util::slice data) :
+    m_ts(TS),
+    m_data(std::move(data)),
+    m_pos(0),
+    m_asset_end(m_data.size()),
+    m_assets_left(0),
+    m_pack_threshold(proj.get_pack_threshold())
+{
+    if (!is_project_file(m_data))
+        throw import_error("res::project_reader: not a project file");
+
+    m_pos = sizeof(uint32_t);
+    if (read_u32() != file_version)
+        throw import_error("res::project_reader: unsupported version");
+
+    // Read the name table. Each name's parent must come before it, which also
+    // rules out any cycles.
+    auto atom_count = read_u32();
+    if (atom_count == 0)
+        throw import_error("res::project_reader: missing root name");
+
+    m_atoms.push_back(proj.get_asset_root());
+    for (uint32_t i = 1; i < atom_count; i++) {
+        auto parent_id = read_u32();
+        if (parent_id >= i)
+            throw import_error("res::project_reader: bad parent name");
+
+        std::string name;
+        read_value(name);
+        if (name.empty())
+            throw import_error("res::project_reader: empty name");
+
+        m_atoms.push_back(m_atoms[parent_id] / name);
+    }
+
+    m_assets_left = read_u32();
+}
+
+// declared in res.hh
+bool project_reader::is_project_file(const util::slice &data)
+{
+    if (data.size() < sizeof(uint32_t) * 2)
+        return false;
+
+    uint32_t magic;
+    std::memcpy(&magic, data.data(), sizeof(magic));
+    return magic == file_magic;
+}
+
+// declared in res.hh
+void project_reader::read_bytes(void *data, size_t size)
+{
+    if (size == 0)
+        return;
+
+    if (size > m_asset_end - m_pos)
+        throw import_error("res::project_reader: unexpected end of data");
+
+    std::memcpy(data, m_data.data() + m_pos, size);
+    m_pos += size;
+}
+
+// declared in res.hh
+bool project_reader::begin_asset(std::string &type_name, atom &name)
+{
+    if (m_assets_left == 0) {
+        if (m_pos != m_data.size())
+            throw import_error("res::project_reader: extra data at end");
+
+        return false;
+    }
+    m_assets_left--;
+
+    read_value(type_name);
+    read_value(name);
+    if (!name || name == m_atoms[0])
+        throw import_error("res::project_reader: bad asset name");
+
+    auto size = read_u64();
+    if (size > m_data.size() - m_pos)
+        throw import_error("res::project_reader: asset too long");
+
+    m_asset_end = m_pos + size;
+    return true;
+}
+
+// declared in res.hh
+void project_reader::end_asset()
+{
+    if (m_pos != m_asset_end)
+        throw import_error("res::project_reader: asset size mismatch");
+
+    m_asset_end = m_data.size();
+}
+
+// declared in res.hh
+void project_reader::read_value(std::string &value)
+{
+    size_t size = read_u32();
+    if (size > m_asset_end - m_pos)
+        throw import_error("res::project_reader: string too long");
+
+    value.assign(reinterpret_cast<const char *>(m_data.data() + m_pos), size);
+    m_pos += size;
+}
+
+// declared in res.hh
+void project_reader::read_value(atom &value)
+{
+    auto id = read_u32();
+    if (id == null_atom_id) {
+        value = nullptr;
+        return;
+    }
+
+    if (id >= m_atoms.size())
+        throw import_error("res::project_reader: bad name index");
+
+    value = m_atoms[id];
+}
+
+// declared in res.hh
+void project_reader::read_value(util::slice &value)
+{
+    auto size = read_u64();
+    if (size > m_asset_end - m_pos)
+        throw import_error("res::project_reader: data too long");
+
+    value = m_data.sub(m_pos, size);
+    m_pos += size;
+}
+
+// declared in res.hh
+void project_reader::read_value(util::packed_slice &value)
+{
+    util::slice data;
+    read_value(data);
+    if (m_pack_threshold && data.size() >= m_pack_threshold) {
+        value = util::packed_slice::pack(data);
+    } else {
+        value = std::move(data);
+    }
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (internal class) test_asset
+// An asset type with a property of each kind supported by project files, for
+// use by the tests below.
+class test_asset : public asset {
+    friend class asset;
+
+private:
+    explicit test_asset(project &proj) :
+        asset(proj) {}
+
+public:
+    using ref = res::ref<test_asset>;
+
+    DEFINE_APROP(number, uint32_t);
+    DEFINE_APROP(values, std::vector<double>);
+    DEFINE_APROP(data, util::slice);
+    DEFINE_APROP(label, std::string);
+    DEFINE_APROP(other, ref);
+    DEFINE_APROP(others, std::vector<anyref>);
+    DEFINE_APROP(packed, util::packed_slice);
+
+    template <typename Reflector>
+    void reflect(Reflector &rfl)
+    {
+        asset::reflect(rfl);
+        rfl.field(p_number, "Number");
+        rfl.field(p_values, "Values");
+        rfl.field(p_data, "Data");
+        rfl.field(p_label, "Label");
+        rfl.field(p_other, "Other");
+        rfl.field(p_others, "Others");
+        rfl.field(p_packed, "Packed");
+    }
+};
+
+}
+}
+
+namespace reflect {
+
+// reflection info for res::test_asset
+template <>
+struct asset_type_info<res::test_asset> {
+    using base_type = res::asset;
+
+    static constexpr const char *name = "res::test_asset";
+};
+
+}
+
+namespace res {
+
+TEST(res_project_file, RoundTrip)
+{
+    using file = project_file<test_asset>;
+
+    project src;
+    test_asset::ref a = src.get_asset_root() / "dir" / "a";
+    test_asset::ref b = src.get_asset_root() / "b";
+    src.get_transact().run([&](TRANSACT) {
+        a.create(TS, src);
+        a->set_number(TS, 1234);
+        a->set_values(TS, {1.5, -2.5, 3.0});
+        a->set_data(TS, util::blob{1, 2, 3});
+        a->set_label(TS, "hello");
+        a->set_other(TS, src.get_asset_root() / "b");
+        a->set_others(TS, {b, nullptr, src.get_asset_root() / "x" / "y"});
+        b.create(TS, src);
+    });
+
+    auto data = file::save(src);
+    EXPECT_TRUE(project_reader::is_project_file(data));
+
+    project dst;
+    test_asset::ref a2 = dst.get_asset_root() / "dir" / "a";
+    test_asset::ref b2 = dst.get_asset_root() / "b";
+    dst.get_transact().run([&](TRANSACT) {
+        file::load(TS, dst, data);
+    });
+    ASSERT_TRUE(a2.ok());
+    ASSERT_TRUE(b2.ok());
+    EXPECT_EQ(a2->get_number(), 1234u);
+    EXPECT_EQ(a2->get_values(), (std::vector<double>{1.5, -2.5, 3.0}));
+    EXPECT_EQ(a2->get_data(), (util::blob{1, 2, 3}));
+    EXPECT_EQ(a2->get_label(), "hello");
+    EXPECT_EQ(a2->get_other(), b2);
+    ASSERT_EQ(a2->get_others().size(), 3u);
+    EXPECT_EQ(a2->get_others()[0], b2);
+    EXPECT_FALSE(a2->get_others()[1]);
+    EXPECT_EQ(a2->get_others()[2].full_path(), "/x/y");
+    EXPECT_EQ(b2->get_number(), 0u);
+
+    // Saving the loaded project gives the same file.
+    EXPECT_EQ(file::save(dst), data);
+
+    // The loaded names are already in use.
+    EXPECT_THROW(dst.get_transact().run([&](TRANSACT) {
+        file::load(TS, dst, data);
+    }), import_error);
+
+    // Truncated data must be rejected.
+    project bad;
+    data.pop_back();
+    EXPECT_THROW(bad.get_transact().run([&](TRANSACT) {
+        file::load(TS, bad, data);
+    }), import_error);
+}
+
+TEST(res_project_file, PackThreshold)
+{
+    using file = project_file<test_asset>;
+
+    // Data which compresses well, and data too small to be packed.
+    util::blob big(10000);
+    for (auto &&i : util::range_of(big)) {
+        big[i] = i % 13;
+    }
+    util::blob small = {1, 2, 3};
+
+    project src;
+    test_asset::ref a = src.get_asset_root() / "a";
+    test_asset::ref b = src.get_asset_root() / "b";
+    src.get_transact().run([&](TRANSACT) {
+        a.create(TS, src);
+        a->set_packed(TS, util::packed_slice::pack(big));
+        b.create(TS, src);
+        b->set_packed(TS, util::slice(small));
+    });
+    auto data = file::save(src);
+
+    // Packed data is saved unpacked, and is packed again as it is loaded if
+    // it reaches the loading project's threshold.
+    project dst;
+    dst.set_pack_threshold(4096);
+    test_asset::ref a2 = dst.get_asset_root() / "a";
+    test_asset::ref b2 = dst.get_asset_root() / "b";
+    dst.get_transact().run([&](TRANSACT) {
+        file::load(TS, dst, data);
+    });
+    ASSERT_TRUE(a2.ok());
+    ASSERT_TRUE(b2.ok());
+    EXPECT_TRUE(a2->get_packed().is_packed());
+    EXPECT_EQ(a2->get_packed().unpack(), big);
+    EXPECT_FALSE(b2->get_packed().is_packed());
+    EXPECT_EQ(b2->get_packed().unpack(), small);
+    EXPECT_EQ(file::save(dst), data);
+}
+
+TEST(res_project_file, BadData)
+{
+    using file = project_file<test_asset>;
+
+    project src;
+    test_asset::ref a = src.get_asset_root() / "a";
+    src.get_transact().run([&](TRANSACT) {
+        a.create(TS, src);
+        a->set_label(TS, "hello");
+        a->set_others(TS, {a, nullptr});
+    });
+    auto data = file::save(src);
+
+    auto load = [](util::blob data) {
+        project dst;
+        dst.get_transact().run([&](TRANSACT) {
+            file::load(TS, dst, std::move(data));
+        });
+    };
+    EXPECT_NO_THROW(load(data));
+
+    // Data truncated at any point must be rejected.
+    for (size_t size = 0; size < data.size(); size++) {
+        EXPECT_THROW(
+            load(util::blob(data.begin(), data.begin() + size)),
+            import_error
+        ) << "size: " << size;
+    }
+
+    // An array count too large for the rest of the asset must be rejected
+    // before anything is allocated for it. The asset ends with the count and
+    // elements of `others' and then the size of the empty packed data.
+    auto count_pos = data.size() - 8 - 2 * 4 - 4;
+    ASSERT_EQ(data[count_pos], 2);
+    for (uint32_t count : {3u, 0x40000000u, 0xFFFFFFFFu}) {
+        auto bad = data;
+        std::memcpy(&bad[count_pos], &count, sizeof(count));
+        EXPECT_THROW(load(std::move(bad)), import_error) << "count: " << count;
+    }
+}
+#endif
+
+}
+}
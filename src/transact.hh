@@ -387,7 +387,10 @@ public:
     void redo();
 
     // (func) run
-    // FIXME explain
+    // Runs the given function with a new teller, then commits the resulting
+    // transaction to the undo history. If the function throws an exception,
+    // its changes are rolled back and the exception is rethrown. If the
+    // function made no changes, no transaction is recorded.
     void run(std::function<void(TRANSACT)> fn);
 
     // (event) on_status_change
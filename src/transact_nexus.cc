@@ -170,16 +170,33 @@ void nexus::run(std::function<void(TRANSACT)> fn)
     m_status = status::busy;
     on_status_change();
 
-    // Create the teller used to build this transaction. If this function
-    // exits without committing the transaction, the teller will rollback
-    // all of the changes automatically.
-    transact::teller ts;
-
-    // Run the functor given to the nexus.
-    fn(ts);
+    std::unique_ptr<transaction> t;
+    try {
+        // Create the teller used to build this transaction. If this block
+        // exits without committing the transaction, the teller will rollback
+        // all of the changes automatically.
+        transact::teller ts;
+
+        // Run the functor given to the nexus.
+        fn(ts);
+
+        // Commit the transaction, unless the functor made no changes. Empty
+        // transactions are not recorded, as there would be nothing to undo.
+        if (!ts.m_ops.empty()) {
+            t = ts.commit();
+        }
+    } catch (...) {
+        // The teller has already rolled back any changes by this point.
+        m_status = status::ready;
+        on_status_change();
+        throw;
+    }
 
-    // Commit the transaction.
-    auto t = ts.commit();
+    if (!t) {
+        m_status = status::ready;
+        on_status_change();
+        return;
+    }
 
     // Set this new transaction's next pointer to the current next-to-undo
     // transaction, and set the next-to-undo to the new transaction.
@@ -19,11 +19,18 @@
 //
 
 #include "common.hh"
+#include <cstdio>
+#include <cstring>
 #include <sstream>
 #include "util.hh"
 
 #if _WIN32
-#include <windows.h> // for wchar_t conversions
+#include <windows.h> // for wchar_t conversions, file mapping
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 namespace drnsf {
@@ -131,5 +138,155 @@ std::fstream fstream_open_bin(
 #endif
 }
 
+#ifdef _WIN32
+// declared in util.hh
+slice map_file(std::string filename)
+{
+    // FILE_SHARE_DELETE allows replace_file to replace the file while it is
+    // open here.
+    HANDLE file = CreateFileW(
+        u8str_to_wstr(filename).c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr
+    );
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("util::map_file: failed to open file");
+    DRNSF_ON_EXIT { CloseHandle(file); };
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+        throw std::runtime_error("util::map_file: failed to get file size");
+
+    // Empty files cannot be mapped.
+    if (size.QuadPart == 0)
+        return {};
+
+    HANDLE mapping = CreateFileMappingW(
+        file,
+        nullptr,
+        PAGE_READONLY,
+        0,
+        0,
+        nullptr
+    );
+    if (!mapping)
+        throw std::runtime_error("util::map_file: failed to map file");
+    DRNSF_ON_EXIT { CloseHandle(mapping); };
+
+    void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+        throw std::runtime_error("util::map_file: failed to map file");
+
+    std::shared_ptr<const void> owner(view, [](const void *view) {
+        UnmapViewOfFile(view);
+    });
+    return slice(
+        std::move(owner),
+        static_cast<const byte *>(view),
+        size_t(size.QuadPart)
+    );
+}
+
+// declared in util.hh
+void replace_file(std::string from, std::string to)
+{
+    auto wfrom = u8str_to_wstr(from);
+    auto wto = u8str_to_wstr(to);
+
+#ifdef FILE_RENAME_FLAG_POSIX_SEMANTICS
+    // MoveFileEx cannot replace a file which is mapped into memory, but a
+    // rename with POSIX semantics can, leaving the old file without a name
+    // until its mappings are released. This needs Windows 10, so MoveFileEx is
+    // still used if it fails.
+    HANDLE file = CreateFileW(
+        wfrom.c_str(),
+        DELETE | SYNCHRONIZE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr
+    );
+    if (file != INVALID_HANDLE_VALUE) {
+        DRNSF_ON_EXIT { CloseHandle(file); };
+
+        // The new name must be a full path.
+        DWORD path_len = GetFullPathNameW(wto.c_str(), 0, nullptr, nullptr);
+        std::wstring path(path_len, L'\0');
+        path_len = GetFullPathNameW(
+            wto.c_str(),
+            path_len,
+            &path[0],
+            nullptr
+        );
+
+        // FILE_RENAME_INFO ends with the new name, which is not terminated.
+        size_t name_size = path_len * sizeof(wchar_t);
+        std::vector<unsigned char> info_buf(
+            sizeof(FILE_RENAME_INFO) + name_size
+        );
+        auto info = reinterpret_cast<FILE_RENAME_INFO *>(info_buf.data());
+        info->Flags =
+            FILE_RENAME_FLAG_REPLACE_IF_EXISTS |
+            FILE_RENAME_FLAG_POSIX_SEMANTICS;
+        info->RootDirectory = nullptr;
+        info->FileNameLength = DWORD(name_size);
+        std::memcpy(info->FileName, path.data(), name_size);
+
+        if (path_len && SetFileInformationByHandle(
+            file,
+            FileRenameInfoEx,
+            info,
+            DWORD(info_buf.size()))) {
+            return;
+        }
+    }
+#endif
+
+    if (!MoveFileExW(wfrom.c_str(), wto.c_str(), MOVEFILE_REPLACE_EXISTING))
+        throw std::runtime_error("util::replace_file: failed to rename file");
+}
+#else
+// declared in util.hh
+slice map_file(std::string filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("util::map_file: failed to open file");
+    DRNSF_ON_EXIT { close(fd); };
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw std::runtime_error("util::map_file: failed to get file size");
+
+    // Empty files cannot be mapped.
+    size_t size = st.st_size;
+    if (size == 0)
+        return {};
+
+    void *view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (view == MAP_FAILED)
+        throw std::runtime_error("util::map_file: failed to map file");
+
+    std::shared_ptr<const void> owner(view, [size](const void *view) {
+        munmap(const_cast<void *>(view), size);
+    });
+    return slice(std::move(owner), static_cast<const byte *>(view), size);
+}
+
+// declared in util.hh
+void replace_file(std::string from, std::string to)
+{
+    // rename(2) replaces the target atomically, and any mappings of the old
+    // file are unaffected.
+    if (std::rename(from.c_str(), to.c_str()) != 0)
+        throw std::runtime_error("util::replace_file: failed to rename file");
+}
+#endif
+
 }
 }
@@ -29,10 +29,18 @@
  * as less-terrible string formatting.
  */
 
+#include <cassert>
+#include <stdexcept>
+#include <array>
+#include <utility>
+#include <type_traits>
 #include <vector>
 #include <string>
 #include <list>
+#include <memory>
+#include <unordered_map>
 #include <fstream>
+#include <functional>
 
 namespace drnsf {
 namespace util {
@@ -53,6 +61,132 @@ using byte = unsigned char;
  */
 using blob = std::vector<byte>;
 
+/*
+ * util::slice
+ *
+ * An immutable, reference-counted view of a range of bytes. A slice holds a
+ * shared reference to the storage it points into (its "owner"), so the bytes
+ * remain valid for as long as any slice referring to them is alive.
+ *
+ * Slices are cheap to copy and to narrow (see `sub'), which allows one large
+ * buffer (for example an entire NSF file, or a memory-mapped file) to be split
+ * into many smaller pieces without copying any of the underlying data.
+ *
+ * Because the bytes are never modified through a slice, editing a slice's data
+ * is done by copying it into a blob (`to_blob'), changing the blob, and then
+ * constructing a new slice from the result.
+ */
+class slice {
+    friend class blob_store;
+
+private:
+    // (var) m_owner
+    // A shared reference to the storage holding the bytes, or null if this
+    // slice is empty.
+    std::shared_ptr<const void> m_owner;
+
+    // (var) m_data
+    // A pointer to the first byte in the slice.
+    const byte *m_data;
+
+    // (var) m_size
+    // The number of bytes in the slice.
+    size_t m_size;
+
+public:
+    // (typedefs)
+    // Provided for compatibility with standard container-style code.
+    using value_type = byte;
+    using size_type = size_t;
+    using const_iterator = const byte *;
+    using iterator = const_iterator;
+
+    // (default ctor)
+    // Constructs an empty slice.
+    slice() noexcept :
+        m_data(nullptr),
+        m_size(0) {}
+
+    // (conversion ctor)
+    // Constructs a slice which takes ownership of the given blob's data.
+    slice(blob data);
+
+    // (explicit ctor)
+    // Constructs a slice over `size' bytes starting at `data'. The bytes must
+    // remain valid for as long as `owner' is alive.
+    explicit slice(
+        std::shared_ptr<const void> owner,
+        const byte *data,
+        size_t size) noexcept :
+        m_owner(std::move(owner)),
+        m_data(data),
+        m_size(size) {}
+
+    // (func) data, size, empty
+    // Accessors for the bytes in the slice.
+    const byte *data() const noexcept
+    {
+        return m_data;
+    }
+    size_t size() const noexcept
+    {
+        return m_size;
+    }
+    bool empty() const noexcept
+    {
+        return m_size == 0;
+    }
+
+    // (func) begin, end
+    // Iterators over the bytes in the slice.
+    const_iterator begin() const noexcept
+    {
+        return m_data;
+    }
+    const_iterator end() const noexcept
+    {
+        return m_data + m_size;
+    }
+
+    // (subscript operator)
+    // Returns the byte at the given index. No range checking is performed.
+    const byte &operator [](size_t index) const noexcept
+    {
+        return m_data[index];
+    }
+
+    // (func) sub
+    // Returns a slice of `size' bytes starting at `offset' bytes into this
+    // slice. The new slice shares this slice's storage.
+    slice sub(size_t offset, size_t size) const;
+
+    // (func) to_blob
+    // Returns a copy of the bytes in this slice.
+    blob to_blob() const;
+
+    // (equal operator, not-equal operator)
+    // Slices (and blobs) compare equal if they hold the same sequence of bytes,
+    // regardless of where those bytes are stored.
+    friend bool operator ==(const slice &lhs, const slice &rhs) noexcept;
+    friend bool operator ==(const slice &lhs, const blob &rhs) noexcept;
+    friend bool operator ==(const blob &lhs, const slice &rhs) noexcept
+    {
+        return rhs == lhs;
+    }
+    friend bool operator !=(const slice &lhs, const slice &rhs) noexcept
+    {
+        return !(lhs == rhs);
+    }
+    friend bool operator !=(const slice &lhs, const blob &rhs) noexcept
+    {
+        return !(lhs == rhs);
+    }
+    friend bool operator !=(const blob &lhs, const slice &rhs) noexcept
+    {
+        return !(rhs == lhs);
+    }
+};
+
 /*
  * util::nocopy
  *
@@ -77,6 +211,185 @@ protected:
     nocopy() = default;
 };
 
+/*
+ * util::hash64
+ *
+ * Returns a 64-bit hash of the given bytes. The data is consumed eight bytes
+ * at a time, so this is fast enough to hash whole files. The result may differ
+ * between platforms, so it may be stored (for example, as a local cache key)
+ * but must not be compared across machines.
+ */
+uint64_t hash64(const byte *data, size_t size) noexcept;
+
+/*
+ * util::blob_store
+ *
+ * A content-addressed store of byte data, used to deduplicate identical data
+ * held by different slices. Each slice given to `intern' is checked against
+ * the data seen so far (by hash, and then by comparing the bytes), and if an
+ * identical slice is still alive, a slice sharing that one's storage is
+ * returned in its place. Otherwise, the slice is returned as it is, without
+ * copying its data, and remembered for later calls.
+ *
+ * Replacing a duplicate only frees memory once nothing else refers to the
+ * duplicate's storage. Data is often a small part of a larger buffer, such as
+ * a page or a mapped file, and that buffer stays alive for as long as any other
+ * part of it is still in use. Likewise, the slice returned for a duplicate
+ * keeps the first slice's buffer alive.
+ *
+ * The store does not keep any data alive by itself: once every slice of some
+ * storage is gone, the storage is freed as usual, and the store forgets it.
+ *
+ * This class is not thread-safe.
+ */
+class blob_store : private nocopy {
+public:
+    // (inner struct) stats
+    // Counters describing the store's effect so far.
+    struct stats {
+        // (var) intern_count, intern_bytes
+        // The number of slices given to `intern', and their total size.
+        size_t intern_count = 0;
+        size_t intern_bytes = 0;
+
+        // (var) replaced_count, replaced_bytes
+        // The number of those slices which were replaced by an identical
+        // slice, and their total size. This is not the amount of memory freed,
+        // as the replaced slices' storage may still be held elsewhere.
+        size_t replaced_count = 0;
+        size_t replaced_bytes = 0;
+
+        // (var) unique_count, unique_bytes
+        // The number of those slices which were new, and so were remembered
+        // for later calls, and their total size.
+        size_t unique_count = 0;
+        size_t unique_bytes = 0;
+    };
+
+private:
+    // (inner struct) item
+    // Data which has been given to `intern'. A weak reference to the data's
+    // storage is held, so that the store does not keep it alive.
+    struct item {
+        std::weak_ptr<const void> owner;
+        const byte *data;
+        size_t size;
+    };
+
+    // (var) m_items
+    // The data given to `intern', by hash.
+    std::unordered_multimap<uint64_t, item> m_items;
+
+    // (var) m_prune_size
+    // The size of m_items at which expired items are next removed (see
+    // `prune').
+    size_t m_prune_size;
+
+    // (var) m_stats
+    // See get_stats.
+    stats m_stats;
+
+public:
+    // (default ctor)
+    // Constructs an empty store.
+    blob_store() :
+        m_prune_size(1024) {}
+
+    // (func) intern
+    // Returns a slice with the same bytes as `data', sharing the storage of a
+    // previously interned slice if there is one with identical bytes which is
+    // still alive. Otherwise, returns `data' and remembers it for later calls.
+    slice intern(slice data);
+
+    // (func) prune
+    // Forgets any data whose storage has been freed. This is done
+    // automatically by `intern' as the store grows.
+    void prune();
+
+    // (func) get_stats
+    // Returns the counters for the store.
+    const stats &get_stats() const
+    {
+        return m_stats;
+    }
+};
+
+/*
+ * util::lz_compress, util::lz_decompress
+ *
+ * A fast LZ77-family codec, similar to LZ4, for holding data in memory in a
+ * smaller form. It favors speed over compression ratio.
+ *
+ * lz_decompress must be given the size of the original data. It throws
+ * std::logic_error if the compressed data is corrupt or does not decompress to
+ * exactly that size.
+ */
+blob lz_compress(const byte *data, size_t size);
+blob lz_decompress(const byte *data, size_t size, size_t out_size);
+
+/*
+ * util::packed_slice
+ *
+ * Bytes which are held either as a plain slice or compressed (see lz_compress).
+ * This allows large data which is rarely used, such as the unprocessed pages
+ * of an NSF file, to take up less memory.
+ *
+ * Compressed data is decompressed by `unpack' when it is needed. The most
+ * recently unpacked data is kept in a small cache shared by all packed slices,
+ * and data which is still in use elsewhere is never decompressed twice, so
+ * repeated calls to `unpack' are cheap.
+ *
+ * Like slices, packed slices are immutable and cheap to copy.
+ */
+class packed_slice {
+private:
+    // (inner struct) packed_data
+    // Compressed data, shared by copies of a packed slice.
+    struct packed_data;
+
+    // (var) m_plain
+    // The bytes, if they are not compressed.
+    slice m_plain;
+
+    // (var) m_packed
+    // The compressed bytes, or null if they are not compressed.
+    std::shared_ptr<const packed_data> m_packed;
+
+public:
+    // (default ctor)
+    // Constructs an empty packed slice.
+    packed_slice() = default;
+
+    // (conversion ctor)
+    // Constructs a packed slice holding the given bytes uncompressed.
+    packed_slice(slice data) :
+        m_plain(std::move(data)) {}
+
+    // (s-func) pack
+    // Returns a packed slice holding the given bytes compressed. If the bytes
+    // do not compress to a smaller size, they are held uncompressed instead.
+    static packed_slice pack(const slice &data);
+
+    // (func) unpack
+    // Returns the bytes, decompressing them if necessary.
+    slice unpack() const;
+
+    // (func) is_packed
+    // Returns true if the bytes are held compressed.
+    bool is_packed() const noexcept
+    {
+        return m_packed != nullptr;
+    }
+
+    // (func) size
+    // Returns the number of bytes when unpacked.
+    size_t size() const noexcept;
+
+    // (func) stored_size
+    // Returns the number of bytes taken up by the data as it is held.
+    size_t stored_size() const noexcept;
+};
+
 /*
  * util::polymorphic
  *
@@ -575,6 +888,11 @@ public:
     // FIXME explain
     void begin(const util::blob &data);
 
+    // (func) begin
+    // Binds the reader to the bytes referenced by the given slice. The slice
+    // must outlive the reader's use of the data.
+    void begin(const util::slice &data);
+
     // (func) end
     // FIXME explain
     void end();
@@ -624,6 +942,338 @@ public:
     void discard_bits(int bits);
 };
 
+/*
+ * util::span_reader
+ *
+ * A lightweight alternative to `binreader' for parsing small, fixed-layout
+ * structures such as file headers, where the per-read checks of `binreader'
+ * would make up most of the cost.
+ *
+ * Instead of checking each read, the caller first calls `require(n)', which
+ * throws if fewer than `n' bytes remain. The next `n' bytes may then be read
+ * with no further checks; reading beyond them is a programming error, which
+ * is caught by assertions in debug builds only. For example:
+ *
+ *   util::span_reader r(data);
+ *   r.require(8);
+ *   auto magic = r.read_u32();
+ *   auto count = r.read_u32();
+ *   r.require(count * 4);
+ *   ...
+ *
+ * Bit values are read as in `binreader' (least significant bits first), and
+ * as with `binreader', byte reads must not be made part-way into a byte of bit
+ * data.
+ */
+class span_reader {
+private:
+    // (var) m_data
+    // A pointer to the next unread byte.
+    const unsigned char *m_data;
+
+    // (var) m_end
+    // A pointer to the end of the data.
+    const unsigned char *m_end;
+
+    // (var) m_limit
+    // A pointer to the end of the range given to the last call to `require'.
+    // This is only used by assertions.
+    const unsigned char *m_limit;
+
+    // (var) m_bitbuf
+    // Bits which have been loaded from the data but not yet read by
+    // `read_ubits', in their order of reading from the least significant bit.
+    uint64_t m_bitbuf;
+
+    // (var) m_bitbuf_len
+    // The number of bits held in m_bitbuf.
+    int m_bitbuf_len;
+
+public:
+    // (explicit ctor)
+    // Binds the reader to the given data, which must outlive the reader.
+    explicit span_reader(const unsigned char *data, size_t size) :
+        m_data(data),
+        m_end(data + size),
+        m_limit(data),
+        m_bitbuf(0),
+        m_bitbuf_len(0) {}
+
+    // (explicit ctor)
+    // Binds the reader to the bytes referenced by the given slice, which must
+    // outlive the reader.
+    explicit span_reader(const util::slice &data) :
+        span_reader(data.data(), data.size()) {}
+
+    // (func) remaining
+    // Returns the number of bytes which have not yet been read.
+    size_t remaining() const
+    {
+        return m_end - m_data;
+    }
+
+    // (func) require
+    // Throws std::logic_error if fewer than `size' bytes remain. Otherwise,
+    // allows the next `size' bytes to be read.
+    void require(size_t size)
+    {
+        if (size > remaining())
+            throw std::logic_error("util::span_reader::require: out of data");
+
+        m_limit = m_data + size;
+    }
+
+    // (func) read_u8
+    // Reads an unsigned 8-bit integer.
+    uint8_t read_u8()
+    {
+        assert(m_data < m_limit);
+        assert(m_bitbuf_len == 0);
+        return *m_data++;
+    }
+
+    // (func) read_u16
+    // Reads a little-endian unsigned 16-bit integer.
+    uint16_t read_u16()
+    {
+        assert(m_limit - m_data >= 2);
+        assert(m_bitbuf_len == 0);
+        uint16_t value = m_data[0] | m_data[1] << 8;
+        m_data += 2;
+        return value;
+    }
+
+    // (func) read_u32
+    // Reads a little-endian unsigned 32-bit integer.
+    uint32_t read_u32()
+    {
+        assert(m_limit - m_data >= 4);
+        assert(m_bitbuf_len == 0);
+        uint32_t value = m_data[0] |
+            m_data[1] << 8 |
+            m_data[2] << 16 |
+            uint32_t(m_data[3]) << 24;
+        m_data += 4;
+        return value;
+    }
+
+    // (func) read_s8, read_s16, read_s32
+    // Signed counterparts of read_u8, read_u16, and read_u32.
+    int8_t read_s8() { return read_u8(); }
+    int16_t read_s16() { return read_u16(); }
+    int32_t read_s32() { return read_u32(); }
+
+    // (func) read_ubits
+    // Reads an unsigned value of the given number of bits, from 1 to 32.
+    uint32_t read_ubits(int bits)
+    {
+        assert(bits > 0 && bits <= 32);
+        while (m_bitbuf_len < bits) {
+            assert(m_data < m_limit);
+            m_bitbuf |= uint64_t(*m_data++) << m_bitbuf_len;
+            m_bitbuf_len += 8;
+        }
+        uint32_t value = m_bitbuf & ((uint64_t(1) << bits) - 1);
+        m_bitbuf >>= bits;
+        m_bitbuf_len -= bits;
+        return value;
+    }
+
+    // (func) read_sbits
+    // Reads a two's complement signed value of the given number of bits, from
+    // 1 to 32.
+    int32_t read_sbits(int bits)
+    {
+        int64_t value = read_ubits(bits);
+        value <<= 64 - bits;
+        value >>= 64 - bits;
+        return value;
+    }
+
+    // (func) discard
+    // Skips over the given number of bytes.
+    void discard(size_t bytes)
+    {
+        assert(size_t(m_limit - m_data) >= bytes);
+        assert(m_bitbuf_len == 0);
+        m_data += bytes;
+    }
+};
+
+/*
+ * util::bitfield
+ *
+ * A compile-time description of a fixed-layout record made of packed bit
+ * fields, such as the vertex and polygon records of NSF entries. The template
+ * arguments are the widths of the fields in bits, from the least significant
+ * bits of the record upward, which is the same order as `binreader' and
+ * `binwriter' read and write them. For example:
+ *
+ *   using point = util::bitfield<4, 12, 16>;
+ *
+ *   auto value = point::load(data);        // reads point::byte_count bytes
+ *   auto flags = point::get<0>(value);     // unsigned 4-bit field
+ *   auto x = point::get_signed<1>(value);  // signed 12-bit field
+ *
+ *   point::store(data, point::put<0>(flags) | point::put<1>(x) | ...);
+ *
+ * The shifts and masks of each field are computed at compile time, so reading
+ * or writing a record compiles down to a little-endian load or store followed
+ * by a few shift and mask instructions, with no per-field checks. Bounds must
+ * be checked by the caller once for each record, or once for an array of them
+ * (e.g. with span_reader::require).
+ *
+ * Records may be up to 64 bits, and individual fields up to 32 bits.
+ */
+template <int... Widths>
+class bitfield {
+    static_assert(sizeof...(Widths) > 0, "bitfield with no fields");
+    static_assert(((Widths > 0 && Widths <= 32) && ...), "bad field width");
+    static_assert((Widths + ...) <= 64, "bitfield larger than 64 bits");
+
+public:
+    // (s-var) field_count
+    // The number of fields in the record.
+    static constexpr int field_count = sizeof...(Widths);
+
+    // (s-var) bit_count, byte_count
+    // The size of the record in bits, and in whole bytes.
+    static constexpr int bit_count = (Widths + ...);
+    static constexpr int byte_count = (bit_count + 7) / 8;
+
+    // (typedef) word
+    // The integer type used to hold a whole record.
+    using word = std::conditional_t<(bit_count <= 32), uint32_t, uint64_t>;
+
+    // (typedef) fields
+    // The unsigned values of every field of a record (see unpack).
+    using fields = std::array<uint32_t, field_count>;
+
+private:
+    // (s-var) s_widths
+    // The template arguments, for indexing by the functions below.
+    static constexpr int s_widths[] = { Widths... };
+
+    // (s-func) offset_of
+    // Returns the bit offset of the given field within the record.
+    static constexpr int offset_of(int index)
+    {
+        int offset = 0;
+        for (int i = 0; i < index; i++) {
+            offset += s_widths[i];
+        }
+        return offset;
+    }
+
+    // (s-func) unpack_impl, pack_impl
+    // Implementations of unpack and pack over every field index.
+    template <std::size_t... I>
+    static constexpr fields unpack_impl(word value, std::index_sequence<I...>)
+    {
+        return {{ get<I>(value)... }};
+    }
+    template <std::size_t... I>
+    static constexpr word pack_impl(const fields &f, std::index_sequence<I...>)
+    {
+        return (put<I>(f[I]) | ...);
+    }
+
+public:
+    // (s-var) width, offset, mask
+    // The width in bits, the bit offset, and the unshifted mask of field `I'.
+    template <int I>
+    static constexpr int width = s_widths[I];
+    template <int I>
+    static constexpr int offset = offset_of(I);
+    template <int I>
+    static constexpr uint32_t mask = uint32_t((uint64_t(1) << width<I>) - 1);
+
+    // (s-func) get
+    // Returns the unsigned value of field `I' of the given record.
+    template <int I>
+    static constexpr uint32_t get(word value)
+    {
+        return uint32_t(value >> offset<I>) & mask<I>;
+    }
+
+    // (s-func) get_signed
+    // Returns the value of field `I' of the given record, sign-extended from
+    // the field's width.
+    template <int I>
+    static constexpr int32_t get_signed(word value)
+    {
+        return int32_t(get<I>(value) << (32 - width<I>)) >> (32 - width<I>);
+    }
+
+    // (s-func) put
+    // Returns the given value placed in field `I' of an otherwise zero record.
+    // Bits of the value beyond the field's width are discarded. Signed values
+    // are stored as two's complement.
+    template <int I>
+    static constexpr word put(uint32_t value)
+    {
+        return word(value & mask<I>) << offset<I>;
+    }
+
+    // (s-func) fits, fits_signed
+    // Returns true if the given value can be stored in field `I' without loss,
+    // as an unsigned or signed value respectively.
+    template <int I>
+    static constexpr bool fits(int64_t value)
+    {
+        return (value >= 0) & (value <= int64_t(mask<I>));
+    }
+    template <int I>
+    static constexpr bool fits_signed(int64_t value)
+    {
+        return (value >= -(int64_t(1) << (width<I> - 1))) &
+            (value < (int64_t(1) << (width<I> - 1)));
+    }
+
+    // (s-func) unpack
+    // Returns the unsigned values of every field of the given record.
+    static constexpr fields unpack(word value)
+    {
+        return unpack_impl(value, std::make_index_sequence<field_count>());
+    }
+
+    // (s-func) pack
+    // Returns the record made of the given field values. See `put'.
+    static constexpr word pack(const fields &f)
+    {
+        return pack_impl(f, std::make_index_sequence<field_count>());
+    }
+
+    // (s-func) load
+    // Reads a record from the given data, which must hold at least
+    // `byte_count' bytes. Any bits beyond `bit_count' are ignored.
+    static word load(const unsigned char *data)
+    {
+        word value = 0;
+        for (int i = 0; i < byte_count; i++) {
+            value |= word(data[i]) << (i * 8);
+        }
+        if constexpr (bit_count < int(sizeof(word) * 8)) {
+            value &= (word(1) << bit_count) - 1;
+        }
+        return value;
+    }
+
+    // (s-func) store
+    // Writes the given record to the given data, which must have room for at
+    // least `byte_count' bytes. Any bits beyond `bit_count' are written as
+    // zero.
+    static void store(unsigned char *data, word value)
+    {
+        if constexpr (bit_count < int(sizeof(word) * 8)) {
+            value &= (word(1) << bit_count) - 1;
+        }
+        for (int i = 0; i < byte_count; i++) {
+            data[i] = value >> (i * 8);
+        }
+    }
+};
+
 /*
  * util::binwriter
  *
@@ -658,6 +1308,13 @@ public:
     // FIXME explain
     void begin();
 
+    // (func) begin
+    // Same as begin(), but writes into the given buffer instead of a new one.
+    // The buffer's existing contents are discarded, but its storage is kept,
+    // so a buffer returned by `end' can be passed back in here to avoid
+    // reallocating it for each use.
+    void begin(util::blob buffer);
+
     // (func) end
     // FIXME explain
     util::blob end();
@@ -764,5 +1421,51 @@ std::fstream fstream_open_bin(
     std::fstream::openmode mode
 );
 
+/*
+ * util::map_file
+ *
+ * Maps the specified file into memory as read-only and returns a slice over the
+ * entire file. The mapping is released once the returned slice and every slice
+ * derived from it have been destroyed. Pages of the file are only read from the
+ * disk as they are accessed.
+ *
+ * The file must not be truncated or rewritten in-place while the mapping is
+ * alive. Code which saves over a file which may be mapped should write to a new
+ * file and then replace the original with it (see replace_file).
+ *
+ * If the file cannot be opened or mapped, std::runtime_error is thrown.
+ */
+slice map_file(std::string filename);
+
+/*
+ * util::replace_file
+ *
+ * Renames the file `from' to `to', replacing any existing file at `to'. This
+ * works even if the file being replaced is still mapped by map_file, in which
+ * case the mapping keeps the old file's data until it is released.
+ *
+ * On Windows, this needs Windows 10 or later for replacing a mapped file.
+ *
+ * If the file cannot be renamed, std::runtime_error is thrown.
+ */
+void replace_file(std::string from, std::string to);
+
+/*
+ * util::parallel_for
+ *
+ * Calls `fn' once for each index from 0 up to (but not including) `count',
+ * spreading the calls across a number of worker threads no greater than the
+ * number of available cores. The order in which the indices are visited is not
+ * specified, and `fn' must be safe to call concurrently with itself. This
+ * function returns once every call has completed.
+ *
+ * If any call throws an exception, the remaining indices which have not yet
+ * been started are skipped, and the exception from the lowest index which
+ * threw is rethrown on the calling thread after the workers have finished.
+ */
+void parallel_for(
+    std::size_t count,
+    const std::function<void(std::size_t)> &fn);
+
 }
 }
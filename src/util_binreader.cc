@@ -62,6 +62,22 @@ void binreader::begin(const util::blob &data)
     }
 }
 
+// declared in util.hh
+void binreader::begin(const util::slice &data)
+{
+    if (m_data)
+        throw std::logic_error("util::binreader::begin: already started");
+
+    if (data.size() == 0) {
+        static unsigned char garbage[1];
+        m_data = garbage;
+        m_size = 0;
+    } else {
+        m_data = data.data();
+        m_size = data.size();
+    }
+}
+
 // declared in util.hh
 void binreader::end()
 {
@@ -395,6 +411,106 @@ TEST(util_binreader, OverrunError)
     EXPECT_THROW(r_8.read_u8(), std::logic_error);
 }
 
+TEST(util_span_reader, IntRead)
+{
+    blob data = { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC, 0xDE, 0xF0, 0xFF };
+    span_reader r(data.data(), data.size());
+    r.require(data.size());
+    EXPECT_EQ(r.read_u32(), 0x78563412u);
+    EXPECT_EQ(r.read_u16(), 0xBC9A);
+    EXPECT_EQ(r.read_s16(), -0x0F22);
+    EXPECT_EQ(r.read_s8(), -1);
+    EXPECT_EQ(r.remaining(), 0u);
+}
+
+TEST(util_span_reader, BitsMatchBinreader)
+{
+    blob data = { 0b01000010, 0b10111010, 0b10101010, 0b10101010, 0b11101010 };
+    const int widths[] = { 1, 1, 4, 4, 5, 23, 2 };
+
+    binreader br;
+    br.begin(data);
+    span_reader sr(data.data(), data.size());
+    sr.require(data.size());
+    for (auto &&bits : widths) {
+        EXPECT_EQ(sr.read_ubits(bits), br.read_ubits(bits));
+    }
+    br.end();
+
+    sr = span_reader(data.data(), data.size());
+    sr.require(data.size());
+    br.begin(data);
+    for (auto &&bits : widths) {
+        EXPECT_EQ(sr.read_sbits(bits), br.read_sbits(bits));
+    }
+    br.end();
+}
+
+TEST(util_span_reader, RequireError)
+{
+    blob data = { 0, 0, 0 };
+    span_reader r(data.data(), data.size());
+    r.require(3);
+    EXPECT_THROW(r.require(4), std::logic_error);
+    r.discard(2);
+    EXPECT_THROW(r.require(2), std::logic_error);
+    r.require(1);
+}
+
+TEST(util_bitfield, Layout)
+{
+    using layout = bitfield<4, 12, 2, 2, 12>;
+    static_assert(layout::bit_count == 32);
+    static_assert(layout::byte_count == 4);
+    static_assert(layout::offset<0> == 0);
+    static_assert(layout::offset<2> == 16);
+    static_assert(layout::offset<4> == 20);
+    static_assert(layout::mask<1> == 0xFFF);
+    static_assert(std::is_same_v<layout::word, uint32_t>);
+
+    using big = bitfield<32, 8, 3>;
+    static_assert(big::byte_count == 6);
+    static_assert(std::is_same_v<big::word, uint64_t>);
+}
+
+TEST(util_bitfield, MatchBinreader)
+{
+    using layout = bitfield<1, 5, 12, 3, 16, 11>;
+    blob data = { 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC, 0xDE, 0xF0 };
+
+    binreader r;
+    r.begin(data.data(), layout::byte_count);
+    auto value = layout::load(data.data());
+    auto fields = layout::unpack(value);
+    EXPECT_EQ(fields[0], r.read_ubits(1));
+    EXPECT_EQ(fields[1], r.read_ubits(5));
+    EXPECT_EQ(layout::get_signed<2>(value), r.read_sbits(12));
+    EXPECT_EQ(fields[3], r.read_ubits(3));
+    EXPECT_EQ(fields[4], r.read_ubits(16));
+    EXPECT_EQ(fields[5], r.read_ubits(11));
+    r.end();
+
+    blob out(layout::byte_count);
+    layout::store(out.data(), layout::pack(fields));
+    EXPECT_EQ(out, blob(data.begin(), data.begin() + layout::byte_count));
+}
+
+TEST(util_bitfield, PutAndFits)
+{
+    using layout = bitfield<4, 12>;
+    EXPECT_EQ(layout::put<1>(-1), 0xFFF0u);
+    EXPECT_EQ(layout::put<0>(0x1F), 0xFu);
+    EXPECT_EQ(layout::get_signed<1>(layout::put<1>(-2048)), -2048);
+
+    EXPECT_TRUE(layout::fits<0>(15));
+    EXPECT_FALSE(layout::fits<0>(16));
+    EXPECT_FALSE(layout::fits<0>(-1));
+    EXPECT_TRUE(layout::fits_signed<1>(-2048));
+    EXPECT_TRUE(layout::fits_signed<1>(2047));
+    EXPECT_FALSE(layout::fits_signed<1>(2048));
+    EXPECT_FALSE(layout::fits_signed<1>(-2049));
+}
+
 }
 #endif
 
@@ -43,6 +43,14 @@ void binwriter::begin()
     m_data = {};
 }
 
+// declared in util.hh
+void binwriter::begin(util::blob buffer)
+{
+    begin();
+    m_data = std::move(buffer);
+    m_data.clear();
+}
+
 // declared in util.hh
 util::blob binwriter::end()
 {
@@ -320,6 +328,24 @@ TEST(util_binwriter, DoubleEndError)
     EXPECT_THROW(w.end(), std::logic_error);
 }
 
+TEST(util_binwriter, ReuseBuffer)
+{
+    binwriter w;
+    util::blob buffer;
+    buffer.reserve(64);
+    buffer.push_back(0xFF);
+    auto storage = buffer.data();
+
+    w.begin(std::move(buffer));
+    w.write_u16(0x1234);
+    buffer = w.end();
+    EXPECT_EQ(buffer, (util::blob{ 0x34, 0x12 }));
+    EXPECT_EQ(buffer.data(), storage);
+
+    w.begin(std::move(buffer));
+    EXPECT_THROW(w.begin(util::blob{}), std::logic_error);
+}
+
 TEST(util_binwriter, Padding)
 {
     binwriter w;
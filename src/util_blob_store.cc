@@ -0,0 +1,237 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include <cstring>
+#include "util.hh"
+
+namespace drnsf {
+namespace util {
+
+namespace {
+
+// (s-func) mix64
+// Scrambles the bits of the given value (the finalizer from MurmurHash3).
+inline uint64_t mix64(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDull;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ull;
+    value ^= value >> 33;
+    return value;
+}
+
+}
+
+// declared in util.hh
+uint64_t hash64(const byte *data, size_t size) noexcept
+{
+    const uint64_t k = 0x9E3779B97F4A7C15ull;
+
+    uint64_t hash = size * k;
+    size_t i = 0;
+
+    // Hash eight bytes at a time. The words are read in the machine's byte
+    // order, so the result depends on the machine. This is fine for the keys
+    // of the on-disk process cache (see nsf::process_cache), which is private
+    // to one user on one machine.
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ mix64(word)) * k;
+    }
+
+    // Hash any remaining bytes.
+    if (i < size) {
+        uint64_t word = 0;
+        std::memcpy(&word, data + i, size - i);
+        hash = (hash ^ mix64(word)) * k;
+    }
+
+    return mix64(hash);
+}
+
+// declared in util.hh
+slice blob_store::intern(slice data)
+{
+    m_stats.intern_count++;
+    m_stats.intern_bytes += data.size();
+
+    // Empty slices have no storage to share.
+    if (data.empty())
+        return data;
+
+    auto hash = hash64(data.data(), data.size());
+
+    // Look for live data with the same bytes.
+    auto range = m_items.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        auto &&item = it->second;
+        if (item.size != data.size())
+            continue;
+
+        auto owner = item.owner.lock();
+        if (!owner)
+            continue;
+
+        // The given slice may be the stored one (or share its bytes).
+        if (item.data == data.data())
+            return data;
+
+        if (std::memcmp(item.data, data.data(), data.size()) != 0)
+            continue;
+
+        m_stats.replaced_count++;
+        m_stats.replaced_bytes += data.size();
+        return slice(std::move(owner), item.data, item.size);
+    }
+
+    // The data is new, so it is kept where it is (for example, in a mapped
+    // file) rather than copied.
+    m_stats.unique_count++;
+    m_stats.unique_bytes += data.size();
+
+    m_items.emplace(hash, item{data.m_owner, data.data(), data.size()});
+
+    // Clean up the entries for freed data every so often, so that the store
+    // does not grow without bound as data is freed and replaced.
+    if (m_items.size() >= m_prune_size) {
+        prune();
+        m_prune_size = std::max<size_t>(1024, m_items.size() * 2);
+    }
+
+    return data;
+}
+
+// declared in util.hh
+void blob_store::prune()
+{
+    for (auto it = m_items.begin(); it != m_items.end();) {
+        if (it->second.owner.expired()) {
+            it = m_items.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(util_hash64, Basic)
+{
+    blob a = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+    blob b = a;
+    EXPECT_EQ(hash64(a.data(), a.size()), hash64(b.data(), b.size()));
+
+    // Every byte and the length should affect the hash.
+    for (auto &&i : range_of(b)) {
+        b[i] ^= 1;
+        EXPECT_NE(hash64(a.data(), a.size()), hash64(b.data(), b.size()));
+        b[i] ^= 1;
+    }
+    EXPECT_NE(hash64(a.data(), a.size()), hash64(a.data(), a.size() - 1));
+}
+
+TEST(util_blob_store, Dedup)
+{
+    blob_store store;
+
+    slice a = blob{ 1, 2, 3, 4 };
+    slice b = blob{ 0, 1, 2, 3, 4, 5 };
+    slice c = blob{ 1, 2, 3, 5 };
+
+    // New data is kept in its own storage, without copying.
+    EXPECT_EQ(store.intern(a).data(), a.data());
+    EXPECT_EQ(store.intern(a).data(), a.data());
+
+    // Identical bytes in other storage are replaced by the first slice.
+    auto b_sub = store.intern(b.sub(1, 4));
+    EXPECT_EQ(b_sub.data(), a.data());
+    EXPECT_EQ(b_sub, a);
+
+    EXPECT_EQ(store.intern(c).data(), c.data());
+
+    auto &&stats = store.get_stats();
+    EXPECT_EQ(stats.intern_count, 4u);
+    EXPECT_EQ(stats.intern_bytes, 16u);
+    EXPECT_EQ(stats.replaced_count, 1u);
+    EXPECT_EQ(stats.replaced_bytes, 4u);
+    EXPECT_EQ(stats.unique_count, 2u);
+    EXPECT_EQ(stats.unique_bytes, 8u);
+}
+
+TEST(util_blob_store, FreeDuplicate)
+{
+    blob_store store;
+
+    auto a = store.intern(blob{ 1, 2, 3, 4 });
+
+    // A duplicate's storage is freed once the duplicate has been replaced, if
+    // nothing else refers to it.
+    auto b_data = std::make_shared<blob>(blob{ 1, 2, 3, 4 });
+    std::weak_ptr<blob> b_weak = b_data;
+    slice b(b_data, b_data->data(), b_data->size());
+    b_data = nullptr;
+
+    b = store.intern(std::move(b));
+    EXPECT_EQ(b.data(), a.data());
+    EXPECT_TRUE(b_weak.expired());
+
+    // Replacing part of a larger buffer does not free the buffer while the
+    // rest of it is still in use.
+    auto c_data = std::make_shared<blob>(blob{ 1, 2, 3, 4, 5, 6, 7, 8 });
+    std::weak_ptr<blob> c_weak = c_data;
+    slice c(c_data, c_data->data(), c_data->size());
+    c_data = nullptr;
+
+    auto c_head = store.intern(c.sub(0, 4));
+    EXPECT_EQ(c_head.data(), a.data());
+    EXPECT_FALSE(c_weak.expired());
+
+    c = {};
+    EXPECT_TRUE(c_weak.expired());
+
+    EXPECT_EQ(store.get_stats().replaced_count, 2u);
+    EXPECT_EQ(store.get_stats().replaced_bytes, 8u);
+}
+
+TEST(util_blob_store, WeakReference)
+{
+    blob_store store;
+
+    auto a = store.intern(blob{ 1, 2, 3, 4 });
+
+    // Once the stored data is freed, identical data is no longer replaced.
+    a = {};
+    auto b = store.intern(blob{ 1, 2, 3, 4 });
+    EXPECT_EQ(store.get_stats().replaced_count, 0u);
+
+    store.prune();
+    EXPECT_EQ(store.intern(blob{ 1, 2, 3, 4 }).data(), b.data());
+}
+
+}
+#endif
+
+}
+}
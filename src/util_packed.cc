@@ -0,0 +1,412 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include "util.hh"
+
+namespace drnsf {
+namespace util {
+
+namespace {
+
+// The compressed data is a series of sequences, each made of:
+//
+//   - a token byte, holding the number of literal bytes in its upper 4 bits
+//     and the length of the match minus 4 in its lower 4 bits
+//   - extra literal length bytes, if the literal length is 15 or more
+//   - the literal bytes themselves
+//   - the 16-bit little-endian offset of the match, counting back from the
+//     current position in the output
+//   - extra match length bytes, if the match length minus 4 is 15 or more
+//
+// Extra length bytes are added to the 4-bit value, and continue for as long as
+// each is 255. The final sequence has no match, and ends after its literals.
+
+// (s-var) min_match, max_offset
+// The shortest match which is encoded, and the furthest back it may begin.
+constexpr size_t min_match = 4;
+constexpr size_t max_offset = 65535;
+
+// (s-var) hash_bits
+// The number of bits in the hash of a 4-byte sequence used by lz_compress to
+// find matches.
+constexpr int hash_bits = 14;
+
+// (s-func) read_u32
+// Reads four bytes in the machine's byte order, for comparing sequences.
+inline uint32_t read_u32(const byte *data)
+{
+    uint32_t value;
+    std::memcpy(&value, data, 4);
+    return value;
+}
+
+// (s-func) write_length
+// Writes the extra length bytes for the given length, less the 15 already
+// held in its token.
+void write_length(blob &out, size_t length)
+{
+    length -= 15;
+    while (length >= 255) {
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back(length);
+}
+
+// (s-func) write_sequence
+// Writes one sequence. A match length of zero means there is no match, which
+// is only allowed for the final sequence.
+void write_sequence(
+    blob &out,
+    const byte *literals,
+    size_t literal_length,
+    size_t offset,
+    size_t match_length)
+{
+    size_t match_code = match_length ? match_length - min_match : 0;
+
+    out.push_back(
+        std::min<size_t>(literal_length, 15) << 4 |
+        std::min<size_t>(match_code, 15)
+    );
+    if (literal_length >= 15) {
+        write_length(out, literal_length);
+    }
+    out.insert(out.end(), literals, literals + literal_length);
+
+    if (match_length) {
+        out.push_back(offset);
+        out.push_back(offset >> 8);
+        if (match_code >= 15) {
+            write_length(out, match_code);
+        }
+    }
+}
+
+// (s-func) read_length
+// Reads the extra length bytes following a 4-bit length of 15.
+size_t read_length(const byte *data, size_t size, size_t &pos)
+{
+    size_t length = 15;
+    byte b;
+    do {
+        if (pos >= size)
+            throw std::logic_error("util::lz_decompress: bad data");
+
+        b = data[pos++];
+        length += b;
+    } while (b == 255);
+    return length;
+}
+
+// (s-var) s_cache_mutex
+// Guards s_cache and the `unpacked' members of every packed_data.
+std::mutex s_cache_mutex;
+
+// (s-var) s_cache
+// The most recently unpacked data, most recent first. Holding these keeps the
+// data in memory after all other users are gone.
+std::list<std::shared_ptr<const blob>> s_cache;
+
+// (s-var) cache_capacity
+// The maximum number of entries in s_cache.
+constexpr size_t cache_capacity = 16;
+
+}
+
+// declared in util.hh
+blob lz_compress(const byte *data, size_t size)
+{
+    blob out;
+    out.reserve(size / 2 + 16);
+
+    // The most recent position of each hashed 4-byte sequence, plus one, or
+    // zero if there is none.
+    std::vector<size_t> table(size_t(1) << hash_bits);
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + min_match <= size) {
+        auto seq = read_u32(data + pos);
+        auto hash = (seq * 2654435761u) >> (32 - hash_bits);
+        auto candidate = table[hash];
+        table[hash] = pos + 1;
+
+        if (candidate == 0 ||
+            pos - (candidate - 1) > max_offset ||
+            read_u32(data + candidate - 1) != seq) {
+            pos++;
+            continue;
+        }
+
+        // Extend the match as far as it goes.
+        auto match = candidate - 1;
+        size_t length = min_match;
+        while (pos + length < size &&
+            data[match + length] == data[pos + length]) {
+            length++;
+        }
+
+        write_sequence(out, data + anchor, pos - anchor, pos - match, length);
+        pos += length;
+        anchor = pos;
+    }
+
+    write_sequence(out, data + anchor, size - anchor, 0, 0);
+    return out;
+}
+
+// declared in util.hh
+blob lz_decompress(const byte *data, size_t size, size_t out_size)
+{
+    blob out(out_size);
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    while (in_pos < size) {
+        byte token = data[in_pos++];
+
+        // Copy the literals.
+        size_t literal_length = token >> 4;
+        if (literal_length == 15) {
+            literal_length = read_length(data, size, in_pos);
+        }
+        if (literal_length > size - in_pos ||
+            literal_length > out_size - out_pos)
+            throw std::logic_error("util::lz_decompress: bad data");
+
+        if (literal_length != 0) {
+            std::memcpy(out.data() + out_pos, data + in_pos, literal_length);
+        }
+        in_pos += literal_length;
+        out_pos += literal_length;
+
+        // The final sequence has no match.
+        if (in_pos == size)
+            break;
+
+        // Copy the match. The match may overlap the bytes it produces, so it
+        // is copied a byte at a time.
+        if (size - in_pos < 2)
+            throw std::logic_error("util::lz_decompress: bad data");
+
+        size_t offset = data[in_pos] | data[in_pos + 1] << 8;
+        in_pos += 2;
+
+        size_t match_length = token & 0xF;
+        if (match_length == 15) {
+            match_length = read_length(data, size, in_pos);
+        }
+        match_length += min_match;
+
+        if (offset == 0 || offset > out_pos ||
+            match_length > out_size - out_pos)
+            throw std::logic_error("util::lz_decompress: bad data");
+
+        auto src = out.data() + out_pos - offset;
+        auto dest = out.data() + out_pos;
+        for (size_t i = 0; i < match_length; i++) {
+            dest[i] = src[i];
+        }
+        out_pos += match_length;
+    }
+
+    if (out_pos != out_size)
+        throw std::logic_error("util::lz_decompress: bad data size");
+
+    return out;
+}
+
+// declared in util.hh
+struct packed_slice::packed_data {
+    // (var) packed
+    // The compressed bytes.
+    blob packed;
+
+    // (var) size
+    // The size of the bytes when decompressed.
+    size_t size;
+
+    // (var) unpacked
+    // The decompressed bytes from the most recent `unpack', if they are still
+    // in use anywhere. Guarded by s_cache_mutex.
+    mutable std::weak_ptr<const blob> unpacked;
+};
+
+// declared in util.hh
+packed_slice packed_slice::pack(const slice &data)
+{
+    auto packed = lz_compress(data.data(), data.size());
+    if (packed.size() >= data.size())
+        return data;
+
+    packed.shrink_to_fit();
+
+    packed_slice result;
+    result.m_packed = std::make_shared<const packed_data>(
+        packed_data{std::move(packed), data.size(), {}}
+    );
+    return result;
+}
+
+// declared in util.hh
+slice packed_slice::unpack() const
+{
+    if (!m_packed)
+        return m_plain;
+
+    std::unique_lock<std::mutex> lock(s_cache_mutex);
+
+    auto unpacked = m_packed->unpacked.lock();
+    if (!unpacked) {
+        // Decompress without holding the lock, so that other threads are not
+        // held up behind this one.
+        lock.unlock();
+        auto fresh = std::make_shared<const blob>(lz_decompress(
+            m_packed->packed.data(),
+            m_packed->packed.size(),
+            m_packed->size
+        ));
+        lock.lock();
+
+        // Another thread may have unpacked the same data in the meantime.
+        unpacked = m_packed->unpacked.lock();
+        if (!unpacked) {
+            m_packed->unpacked = fresh;
+            s_cache.push_front(fresh);
+            if (s_cache.size() > cache_capacity) {
+                s_cache.pop_back();
+            }
+            return slice(fresh, fresh->data(), fresh->size());
+        }
+    }
+
+    // Move the data to the front of the cache, if it is in there.
+    for (auto it = s_cache.begin(); it != s_cache.end(); ++it) {
+        if (*it == unpacked) {
+            s_cache.splice(s_cache.begin(), s_cache, it);
+            break;
+        }
+    }
+
+    return slice(unpacked, unpacked->data(), unpacked->size());
+}
+
+// declared in util.hh
+size_t packed_slice::size() const noexcept
+{
+    return m_packed ? m_packed->size : m_plain.size();
+}
+
+// declared in util.hh
+size_t packed_slice::stored_size() const noexcept
+{
+    return m_packed ? m_packed->packed.size() : m_plain.size();
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+// (s-func) make_test_data
+// Returns data for the tests below which is partly repetitive (and so can be
+// compressed) and partly pseudo-random.
+blob make_test_data(size_t size)
+{
+    blob data(size);
+    uint32_t state = 1;
+    for (auto &&i : range_of(data)) {
+        state = state * 1103515245 + 12345;
+        if (i % 1000 < 600) {
+            data[i] = i % 7;
+        } else {
+            data[i] = state >> 16;
+        }
+    }
+    return data;
+}
+
+TEST(util_lz, RoundTrip)
+{
+    for (size_t size : { 0, 1, 3, 4, 5, 100, 65536, 300000 }) {
+        auto data = make_test_data(size);
+        auto packed = lz_compress(data.data(), data.size());
+        EXPECT_EQ(lz_decompress(packed.data(), packed.size(), size), data);
+    }
+
+    // Long runs produce long match lengths.
+    blob zeroes(100000);
+    auto packed = lz_compress(zeroes.data(), zeroes.size());
+    EXPECT_LT(packed.size(), 1000u);
+    EXPECT_EQ(lz_decompress(packed.data(), packed.size(), 100000), zeroes);
+}
+
+TEST(util_lz, BadData)
+{
+    auto data = make_test_data(10000);
+    auto packed = lz_compress(data.data(), data.size());
+
+    // Wrong size.
+    EXPECT_THROW(
+        lz_decompress(packed.data(), packed.size(), 9999),
+        std::logic_error
+    );
+    EXPECT_THROW(
+        lz_decompress(packed.data(), packed.size(), 10001),
+        std::logic_error
+    );
+
+    // Truncated.
+    EXPECT_THROW(
+        lz_decompress(packed.data(), packed.size() / 2, 10000),
+        std::logic_error
+    );
+}
+
+TEST(util_packed_slice, PackAndUnpack)
+{
+    slice data = make_test_data(65536);
+
+    packed_slice plain = data;
+    EXPECT_FALSE(plain.is_packed());
+    EXPECT_EQ(plain.unpack().data(), data.data());
+
+    auto packed = packed_slice::pack(data);
+    EXPECT_TRUE(packed.is_packed());
+    EXPECT_EQ(packed.size(), data.size());
+    EXPECT_LT(packed.stored_size(), data.size());
+
+    // Unpacking again while the first result is held gives the same storage.
+    auto unpacked = packed.unpack();
+    EXPECT_EQ(unpacked, data);
+    EXPECT_EQ(packed.unpack().data(), unpacked.data());
+
+    // Incompressible data is left unpacked.
+    slice random = blob{ 0x3A, 0x91, 0x07, 0xEE };
+    EXPECT_FALSE(packed_slice::pack(random).is_packed());
+}
+
+}
+#endif
+
+}
+}
@@ -0,0 +1,122 @@
+//
+// DRNSF - An unofficial Crash Bandicoot level editor
+// Copyright (C) 2017-2018  DRNSF contributors
+//
+// See the AUTHORS.md file for more details.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "common.hh"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include "util.hh"
+
+namespace drnsf {
+namespace util {
+
+// declared in util.hh
+void parallel_for(
+    std::size_t count,
+    const std::function<void(std::size_t)> &fn)
+{
+    if (count == 0)
+        return;
+
+    std::atomic<std::size_t> next_index(0);
+    std::atomic<bool> stopped(false);
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    std::size_t error_index = count;
+
+    auto worker = [&]{
+        while (!stopped) {
+            auto i = next_index++;
+            if (i >= count)
+                break;
+
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (i < error_index) {
+                    error = std::current_exception();
+                    error_index = i;
+                }
+                stopped = true;
+            }
+        }
+    };
+
+    // Use the calling thread as one of the workers. `hardware_concurrency'
+    // may return zero if the number of cores is not known.
+    std::size_t thread_count = std::thread::hardware_concurrency();
+    thread_count = std::max<std::size_t>(thread_count, 1);
+    thread_count = std::min(thread_count, count);
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+    for (std::size_t i = 1; i < thread_count; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &&thread : threads) {
+        thread.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+#if FEATURE_INTERNAL_TEST
+namespace {
+
+TEST(util_parallel_for, VisitsEachIndexOnce)
+{
+    std::vector<std::atomic<int>> visits(1000);
+    parallel_for(visits.size(), [&](std::size_t i) {
+        visits[i]++;
+    });
+    for (auto &&visit_count : visits) {
+        EXPECT_EQ(visit_count, 1);
+    }
+}
+
+TEST(util_parallel_for, ZeroCount)
+{
+    parallel_for(0, [](std::size_t i) {
+        FAIL();
+    });
+}
+
+TEST(util_parallel_for, Exception)
+{
+    EXPECT_THROW(
+        parallel_for(100, [](std::size_t i) {
+            if (i == 50)
+                throw std::runtime_error("test");
+        }),
+        std::runtime_error
+    );
+}
+
+}
+#endif
+
+}
+}